@@ -5,6 +5,7 @@
 #include <cctype>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <locale>
 #include <numeric>
 #include <regex>
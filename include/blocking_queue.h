@@ -0,0 +1,80 @@
+#ifndef HAPI_BLOCKING_QUEUE_H
+#define HAPI_BLOCKING_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+namespace hapi {
+// Bounded queue used to hand work from one thread to another
+template <typename T>
+class BlockingQueue {
+ public:
+  BlockingQueue(std::size_t capacity) : _capacity(capacity) {}
+
+  // adds an item without waiting, returns false if the queue is full or closed
+  bool try_push(T item) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_closed || _items.size() >= _capacity) {
+        return false;
+      }
+      _items.push_back(std::move(item));
+    }
+    _cv.notify_one();
+    return true;
+  }
+
+  // waits for an item, returns false once the queue is closed and empty
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this] { return _closed || !_items.empty(); });
+    if (_items.empty()) {
+      return false;
+    }
+    item = std::move(_items.front());
+    _items.pop_front();
+    return true;
+  }
+
+  // like pop() but gives up at the deadline, false if no item came by then
+  template <typename Clock, typename Duration>
+  bool pop(T &item,
+           const std::chrono::time_point<Clock, Duration> &deadline) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait_until(lock, deadline,
+                   [this] { return _closed || !_items.empty(); });
+    if (_items.empty()) {
+      return false;
+    }
+    item = std::move(_items.front());
+    _items.pop_front();
+    return true;
+  }
+
+  // stops accepting items and wakes every waiting consumer
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+    }
+    _cv.notify_all();
+  }
+
+  std::size_t size() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _items.size();
+  }
+
+ private:
+  std::size_t _capacity;
+  bool _closed{false};
+  std::deque<T> _items;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+};
+}  // namespace hapi
+
+#endif
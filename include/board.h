@@ -1,13 +1,15 @@
 #ifndef HAPI_BOARD_H
 #define HAPI_BOARD_H
 
+#include <chrono>
 #include <stdexcept>
 
+#include "pmt_board.h"
+
 namespace hapi {
 // Controls the HAPI-E board
-class Board {
+class Board : public PMTBoard {
  public:
-  enum TriggerSource { PMT = 0, PI = 1 };
   // the board instance
   static Board& instance() {
     static Board _instance;
@@ -16,19 +18,21 @@ class Board {
   // Triggers the HAPI-E board if the trigger source is set to the PI, if not
   // throws an error
   void trigger();
+  // sets the width of the pulse sent by trigger()
+  void set_trigger_width(std::chrono::microseconds width);
   // arms the board so it can capture images
-  void arm();
+  void arm() override;
   // disarms the board
-  void disarm();
+  void disarm() override;
 
   // returns true if the board has captured an image
-  bool is_done();
+  bool is_done() override;
 
   // clears the state of the board
-  void reset();
+  void reset() override;
 
   // sets the trigger source to either come from the PMT or the PI.
-  void set_trigger_source(TriggerSource source);
+  void set_trigger_source(TriggerSource source) override;
   // sets the delay in microseconds
   void set_delay(unsigned int delay);
   // sets the exposure in microseconds
@@ -38,10 +42,15 @@ class Board {
 
   // sets the pmt gain voltage 0.5-1.1V
   // steps of 0.6/256 volts 0x00-0xFF
-  void set_pmt_gain(int gain_byte);
+  void set_pmt_gain(int gain_byte) override;
   // sets the pmt threshold voltage 0.0-3.3V
   // steps of 3.3/256 volts 0x00-0xFF
-  void set_pmt_threshold(int threshold_byte);
+  void set_pmt_threshold(int threshold_byte) override;
+  // the last pmt gain and threshold bytes written, -1 until written
+  int pmt_gain();
+  int pmt_threshold();
+  // steady clock time
+  std::chrono::duration<double> now() override;
 
  private:
   Board();
@@ -57,6 +66,10 @@ class Board {
   int _trigger_pin{3};
   int _trigger_source_pin{4};
   TriggerSource _trigger_source{TriggerSource::PMT};
+  std::chrono::microseconds _trigger_width{100};
+  // last values written to the pmt, -1 until written
+  int _pmt_gain{-1};
+  int _pmt_threshold{-1};
 };
 }  // namespace hapi
 #endif
@@ -0,0 +1,141 @@
+#ifndef HAPI_CAMERA_GROUP_H
+#define HAPI_CAMERA_GROUP_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Spinnaker.h"
+
+#include "blocking_queue.h"
+#include "usb_camera.h"
+
+namespace hapi {
+// Several cameras looking at the same volume, e.g. for stereo holography.
+// They share the board's trigger and every camera has its own grab thread
+// and stream buffers, so images come in from all of them at once instead of
+// one camera after the other. collect() matches the images of one trigger
+// event by when they arrived and by the camera frame counters and clocks.
+// With image events there are no grab threads, the driver hands every image
+// to a sink as soon as it completes and nothing waits in collect().
+class CameraGroup {
+ public:
+  using clock = std::chrono::steady_clock;
+  // takes an image from the camera with the given index, called on the
+  // driver's thread with the time it came in. Returns false if it can't take
+  // the image, which is then given back to the camera.
+  using sink_t =
+      std::function<bool(std::size_t, Spinnaker::ImagePtr, clock::time_point)>;
+
+  CameraGroup();
+  // stops the grab threads if acquisition is still running
+  ~CameraGroup();
+
+  void add(std::shared_ptr<USBCamera> camera);
+  // releases the cameras, call before the Spinnaker system is released
+  void clear();
+
+  std::size_t size();
+  USBCamera &camera(std::size_t index);
+  // serial number, read when the camera was added
+  const std::string &serial(std::size_t index);
+
+  // images arriving further than window before an event belong to an earlier
+  // one, see collect()
+  void set_window(std::chrono::milliseconds window);
+  // longest collect() waits for a camera after the event
+  void set_timeout(std::chrono::milliseconds timeout);
+
+  // gives every camera buffers stream buffers, begins acquisition on all of
+  // them and starts their grab threads for collect(). With a sink the
+  // cameras' image events go straight to it instead.
+  void begin(unsigned int buffers, sink_t sink = nullptr);
+  // stops the grab threads or event handlers, releases images nobody
+  // collected and ends acquisition
+  void end();
+
+  // sends a software trigger to every camera that uses one
+  void trigger();
+  // waits for the images of the event triggered at the given time, one per
+  // camera in the order they were added. Cameras that missed the event get a
+  // null image. Returns the number of images collected.
+  std::size_t collect(std::vector<Spinnaker::ImagePtr> &images,
+                      clock::time_point at);
+
+  // images lost because collect() fell behind the cameras
+  unsigned long dropped();
+  // images that matched no event, e.g. from a spurious trigger
+  unsigned long stale();
+  // times a camera had no image for an event
+  unsigned long missed();
+  // frames the cameras counted but never delivered
+  unsigned long skipped();
+
+ private:
+  struct grab_t {
+    Spinnaker::ImagePtr _image;
+    // the camera's frame counter and clock (ns)
+    uint64_t _frame_id;
+    uint64_t _timestamp;
+    clock::time_point _received;
+  };
+
+  struct unit_t;
+
+  // passes the images the driver completes on to the sink. They stay out of
+  // the stream buffers until released like grabbed ones.
+  class handler_t : public Spinnaker::ImageEvent {
+   public:
+    handler_t(CameraGroup &group, unit_t &unit);
+    void OnImageEvent(Spinnaker::ImagePtr image);
+
+   private:
+    CameraGroup &_group;
+    unit_t &_unit;
+  };
+
+  struct unit_t {
+    unit_t(std::shared_ptr<USBCamera> camera);
+    ~unit_t();
+
+    std::shared_ptr<USBCamera> _camera;
+    std::size_t _index;
+    std::string _serial;
+    BlockingQueue<grab_t> _grabbed;
+    std::thread _thread;
+    std::unique_ptr<handler_t> _handler;
+    // last collected image, to check the next one follows it
+    bool _first{true};
+    uint64_t _frame_id{0};
+    uint64_t _timestamp{0};
+  };
+
+  std::vector<std::unique_ptr<unit_t>> _units;
+  std::chrono::milliseconds _window;
+  std::chrono::milliseconds _timeout;
+  std::atomic<bool> _grabbing{false};
+  sink_t _sink;
+  std::atomic<unsigned long> _dropped{0};
+  unsigned long _stale{0};
+  unsigned long _missed{0};
+  // also counted on the event threads
+  std::atomic<unsigned long> _skipped{0};
+
+  // hands the camera's images to its queue until end()
+  void grab(unit_t &unit);
+  // stamps an image and queues it for collect(), or drops it if the queue is
+  // full
+  void deliver(unit_t &unit, Spinnaker::ImagePtr image);
+  // hands an image from an event to the sink, or drops it if the sink is full
+  void forward(unit_t &unit, Spinnaker::ImagePtr image);
+  // releases what the grab thread queued but nobody collected
+  void drain(unit_t &unit);
+};
+}  // namespace hapi
+
+#endif
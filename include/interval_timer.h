@@ -0,0 +1,68 @@
+#ifndef HAPI_INTERVAL_TIMER_H
+#define HAPI_INTERVAL_TIMER_H
+
+#include <atomic>
+#include <chrono>
+
+#include <time.h>
+
+namespace hapi {
+// Periodic timer on absolute CLOCK_MONOTONIC deadlines (timerfd). Deadlines
+// are always the start time plus a whole number of periods so the schedule
+// does not drift with how long each iteration takes.
+class IntervalTimer {
+ public:
+  struct stats_t {
+    // number of deadlines waited for
+    unsigned long _count;
+    // deadlines skipped because the caller was more than a period late
+    unsigned long _missed;
+    // wake up lateness past the deadline in microseconds
+    double _late_mean;
+    double _late_max;
+    // achieved period between wake ups in microseconds
+    double _period_mean;
+    double _period_min;
+    double _period_max;
+    // standard deviation of the achieved period in microseconds
+    double _jitter;
+  };
+
+  IntervalTimer(std::chrono::microseconds period);
+  ~IntervalTimer();
+
+  // starts the schedule, the first deadline is one period from now. Calling
+  // it again restarts the schedule and keeps the statistics.
+  void start();
+  // sleeps until the next deadline. Returns false without waiting it out if
+  // cancel becomes false.
+  bool wait(const volatile std::atomic<bool> &cancel);
+  // changes the period starting from the next deadline
+  void set_period(std::chrono::microseconds period);
+  std::chrono::microseconds period();
+
+  const stats_t stats();
+
+ private:
+  int _fd{-1};
+  bool _started{false};
+  std::chrono::microseconds _period;
+  timespec _next;
+  timespec _last_wake;
+
+  unsigned long _count{0};
+  unsigned long _missed{0};
+  double _late_sum{0};
+  double _late_max{0};
+  // running mean and sum of squared differences of the period (Welford)
+  unsigned long _periods{0};
+  double _period_mean{0};
+  double _period_m2{0};
+  double _period_min{0};
+  double _period_max{0};
+
+  void arm();
+};
+}  // namespace hapi
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef HAPI_LASER_GROUP_H
+#define HAPI_LASER_GROUP_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blocking_queue.h"
+#include "laser_monitor.h"
+#include "obis.h"
+
+namespace hapi {
+// Several OBIS lasers, e.g. one per wavelength. Every laser has its own
+// serial i/o thread that runs its commands and its own LaserMonitor, so the
+// lasers are opened, set up and shut down at the same time and a slow one
+// never holds up the others or the caller.
+class LaserGroup {
+ public:
+  // called on the monitor thread of laser index when its fault code changes
+  using fault_callback_t =
+      std::function<void(std::size_t index, FaultCode fault,
+                         const LaserMonitor::snapshot_t &snapshot)>;
+
+  LaserGroup();
+  // turns every laser off, in parallel
+  ~LaserGroup();
+
+  // opens up to count of the devices, trying them in order and count at a
+  // time. Devices that are busy or fail are logged and skipped. setup runs on
+  // each laser's thread right after it is opened. Returns the number open.
+  std::size_t open(const std::vector<std::string> &devices, std::size_t count,
+                   std::function<void(OBISLaser &)> setup = nullptr);
+  // stops the monitors and closes every laser, in parallel
+  void close();
+
+  std::size_t size();
+  OBISLaser &laser(std::size_t index);
+  const std::string &device(std::size_t index);
+  // wavelength from sys_info, read when the laser was opened
+  double wavelength(std::size_t index);
+
+  // runs f on every laser at once, each on its own thread, and waits for all
+  // of them. Rethrows the first failure once all are done.
+  void each(std::function<void(std::size_t index, OBISLaser &laser)> f);
+  // queues f on the laser's thread without waiting, false if its queue is
+  // full
+  bool post(std::size_t index, std::function<void(OBISLaser &laser)> f);
+
+  // makes the given laser the only one emitting, without waiting for the
+  // lasers to switch
+  void select(std::size_t index);
+  // the laser last selected
+  std::size_t selected();
+  // the laser that has confirmed it is the only one emitting, or -1 while
+  // switching or when more than one is on
+  int emitting();
+
+  void start_monitors(std::chrono::milliseconds period,
+                      fault_callback_t callback = nullptr);
+  void stop_monitors();
+  LaserMonitor &monitor(std::size_t index);
+  // every laser's fault code or'ed together, safe from any thread
+  FaultCode fault();
+  // failed polls of all the monitors
+  unsigned long errors();
+
+ private:
+  struct unit_t {
+    unit_t(const std::string &device);
+    ~unit_t();
+
+    std::string _device;
+    std::unique_ptr<OBISLaser> _laser;
+    std::unique_ptr<LaserMonitor> _monitor;
+    double _wavelength{0};
+    // emission as last set through select()
+    std::atomic<bool> _on{true};
+    BlockingQueue<std::function<void()>> _commands;
+    std::thread _thread;
+  };
+
+  std::vector<std::unique_ptr<unit_t>> _units;
+  std::atomic<std::size_t> _selected{0};
+
+  // runs f on the unit's thread, the future holds any exception
+  std::future<void> run(unit_t &unit, std::function<void()> f);
+};
+}  // namespace hapi
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef HAPI_LASER_MONITOR_H
+#define HAPI_LASER_MONITOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "obis.h"
+
+namespace hapi {
+// Polls the laser's telemetry on its own thread so nothing time critical
+// waits on the serial port. The latest reading is published through a triple
+// buffer: the monitor never waits for the reader and the reader never waits
+// for the monitor.
+class LaserMonitor {
+ public:
+  struct snapshot_t {
+    OBISLaser::telemetry_t _telemetry;
+    // false until the first successful poll
+    bool _valid;
+    // number of the poll this came from
+    unsigned long _sequence;
+    std::chrono::steady_clock::time_point _time;
+  };
+  // called on the monitor thread when the laser's fault code changes
+  using fault_callback_t =
+      std::function<void(FaultCode fault, const snapshot_t &snapshot)>;
+
+  LaserMonitor(OBISLaser &laser, std::chrono::milliseconds period);
+  ~LaserMonitor();
+
+  void set_fault_callback(fault_callback_t callback);
+  void start();
+  void stop();
+
+  // the latest reading. Only one thread may call this.
+  const snapshot_t &snapshot();
+  // the fault code of the latest reading, safe from any thread
+  FaultCode fault();
+  // polls that failed, e.g. serial timeouts
+  unsigned long errors();
+
+ private:
+  OBISLaser &_laser;
+  std::chrono::milliseconds _period;
+  fault_callback_t _callback;
+  std::thread _thread;
+  bool _stop{false};
+  std::mutex _mutex;
+  std::condition_variable _wake;
+
+  // triple buffer: the monitor writes _slots[_back], the reader reads
+  // _slots[_front], and _middle holds the third slot's index plus a flag set
+  // when it holds a reading the reader has not taken yet
+  snapshot_t _slots[3];
+  unsigned int _back{0};
+  unsigned int _front{1};
+  std::atomic<unsigned int> _middle{2};
+
+  std::atomic<FaultCode> _fault{0};
+  std::atomic<unsigned long> _errors{0};
+
+  void run();
+  void publish(const snapshot_t &snapshot);
+};
+}  // namespace hapi
+
+#endif
@@ -1,14 +1,45 @@
 #ifndef HAPI_LOGGER_H
 #define HAPI_LOGGER_H
 
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <streambuf>
 #include <string>
+#include <thread>
 #include <vector>
 
+// lowest level compiled in, e.g. -DHAPI_LOG_FLOOR=WARNING leaves every
+// HAPI_DEBUG and HAPI_INFO statement out of the build
+#ifndef HAPI_LOG_FLOOR
+#define HAPI_LOG_FLOOR DEBUG
+#endif
+
+// logs at the given level, without evaluating the message when the level is
+// filtered out: HAPI_LOG(log, INFO) << "Frame " << n << std::endl;
+#define HAPI_LOG(logger, level)                 \
+  if (!(logger).enabled(hapi::Logger::level)) { \
+  } else                                        \
+    (logger).log(hapi::Logger::level)
+#define HAPI_DEBUG(logger) HAPI_LOG(logger, DEBUG)
+#define HAPI_INFO(logger) HAPI_LOG(logger, INFO)
+
 namespace hapi {
+// Logs asynchronously so the acquisition threads never wait on the console.
+// Every thread writes its message into its own fixed size record, std::endl
+// hands the record to a lock-free ring buffer and a background thread adds
+// the timestamp and level, writes it out and flushes. Safe to use from any
+// thread. Messages longer than a record are cut short.
 class Logger {
  public:
   enum LogLevel { DEBUG, INFO, WARNING, ERROR, CRITICAL };
+  // what a thread does when the ring buffer is full: wait for the background
+  // thread, drop the message, or drop only debug and info messages
+  enum DropPolicy { BLOCK, DROP, DROP_INFO };
 
   // the logger instance
   static Logger &instance() {
@@ -19,6 +50,19 @@ class Logger {
   void set_stream(std::ostream &out);
   void set_streams(std::ostream &debug, std::ostream &info, std::ostream &warn,
                    std::ostream &error, std::ostream &critical);
+  void set_drop_policy(DropPolicy policy);
+  // messages below level are dropped before they are formatted
+  void set_level(LogLevel level);
+  LogLevel level();
+  bool enabled(LogLevel l) {
+    return l >= HAPI_LOG_FLOOR && l >= _level.load(std::memory_order_relaxed);
+  }
+  // debug, info, warning, error or critical in any case
+  static LogLevel parse_level(std::string name);
+  // messages lost to a full ring buffer so far
+  unsigned long dropped();
+  // waits until every message logged so far has been written
+  void flush();
 
   std::ostream &log(LogLevel l);
   std::ostream &debug();
@@ -30,14 +74,47 @@ class Logger {
   std::ostream &append();
 
  private:
+  struct record_t;
+  struct slot_t;
+  class buffer_t;
+  struct stream_t;
+
   Logger();
   ~Logger();
-  std::ostream _debug;
-  std::ostream _info;
-  std::ostream _warning;
-  std::ostream _error;
-  std::ostream _critical;
-  std::ostream _last;
+
+  std::atomic<std::streambuf *> _outs[CRITICAL + 1];
+  std::atomic<int> _level{DEBUG};
+  std::atomic<int> _policy{DROP_INFO};
+  std::atomic<unsigned long> _dropped{0};
+
+  // the ring buffer, _head is the next slot to fill and _tail the next one
+  // the background thread writes out
+  std::unique_ptr<slot_t[]> _ring;
+  std::atomic<std::size_t> _head{0};
+  std::atomic<std::size_t> _tail{0};
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::condition_variable _flushed;
+  bool _stop{false};
+  std::thread _thread;
+
+  // the last timestamp written, only used by the background thread
+  int64_t _stamp_ms{-1};
+  int64_t _stamp_s{-1};
+  char _stamp[32];
+  unsigned long _dropped_reported{0};
+
+  // this thread's record and stream
+  stream_t &local();
+  // queues a finished record, false if it was dropped
+  bool push(const record_t &record);
+  // writes out records until stopped
+  void run();
+  // writes out everything queued, false if there was nothing
+  bool drain();
+  void write(const record_t &record);
+  const char *stamp(int64_t ms);
 };
 }  // namespace hapi
 
@@ -3,9 +3,13 @@
 
 #include "serial.h"
 
+#include <chrono>
 #include <exception>
+#include <functional>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 using FaultCode = unsigned long;
@@ -116,6 +120,27 @@ class OBISLaser {
     double _currentMin;
     // maximum operating current
     double _currentMax;
+    // number of on/off cycles
+    unsigned int _cycles;
+    // hours the laser has been on
+    unsigned int _hours;
+    // hours the diode has been operated
+    unsigned int _diodeHours;
+  };
+
+  // everything that changes while the laser runs, read in one batch
+  struct telemetry_t {
+    StatusCode _status;
+    FaultCode _fault;
+    State _state;
+    // output power in watts
+    double _power;
+    // diode current in amps
+    double _current;
+    // temperatures in celsius
+    double _baseplateTemp;
+    double _diodeTemp;
+    double _internalTemp;
   };
 
   static const std::vector<StatusBits> status_bits(const StatusCode status);
@@ -139,9 +164,31 @@ class OBISLaser {
 
   template <typename T>
   const T query(const std::string str);
+  template <typename T>
+  const T query(const char *cmd);
+  // sends all the queries without waiting for each reply and returns the
+  // replies in the same order
+  const std::vector<std::string> query_batch(
+      const std::vector<std::string> &cmds);
+  // converts a reply to a query into a value, reading no further than its
+  // length
+  template <typename T>
+  static const T parse(const std::string &line);
+  template <typename T>
+  static const T parse(const char *line, std::size_t length);
 
   void complete_handshake(void);
 
+  // how long to wait for each reply and how many times to ask again if it
+  // doesn't come
+  void set_timeout(std::chrono::milliseconds timeout);
+  void set_retries(unsigned int retries);
+  // checked while waiting for the laser, returning true gives up on it
+  void set_cancel(std::function<bool()> cancel);
+  // number of replies that timed out and of queries asked again
+  unsigned long timeouts(void);
+  unsigned long retries(void);
+
   // causes device to warm boot if implemented
   void reset(void);
   // runs a self-test procedure if implemented
@@ -186,6 +233,9 @@ class OBISLaser {
   // returns the system info, if query it queries the device
   const sys_info_t sys_info(bool query = false);
 
+  // queries the status, faults, power and temperatures in one batch
+  const telemetry_t telemetry(void);
+
   // enters and stores user-defined information, data can have a maximum length
   // of 31 characters
   void user(const unsigned short index, const std::string data);
@@ -262,28 +312,63 @@ class OBISLaser {
   bool _handshake;
   sys_info_t _info;
   SerialInterface _serial;
+  // one command or batch at a time, the monitor thread shares the laser
+  std::mutex _mutex;
+  unsigned int _max_retries{2};
+  unsigned long _retries{0};
+
+  // longest reply kept and most queries in one call to batch()
+  static const std::size_t max_line = 128;
+  static const std::size_t max_batch = 32;
+  // replies of the last batch, null terminated. Guarded by _mutex.
+  char _lines[max_batch][max_line];
+  std::size_t _lengths[max_batch];
 
   const std::string result(const std::string str);
+  // sends up to max_batch queries and reads their replies into _lines
+  // without allocating. The caller holds _mutex.
+  void batch(const char *const *cmds, std::size_t count);
+
+  static double number(const char *line, std::size_t length,
+                       std::true_type is_float);
+  static unsigned long number(const char *line, std::size_t length,
+                              std::false_type is_float);
 };
 
 template <>
-const std::string OBISLaser::query(const std::string str);
+const std::string OBISLaser::parse(const char *line, std::size_t length);
 
 template <>
-const OBISLaser::State OBISLaser::query(const std::string str);
+const OBISLaser::State OBISLaser::parse(const char *line, std::size_t length);
 
 template <>
-const OBISLaser::DeviceType OBISLaser::query(const std::string str);
+const OBISLaser::DeviceType OBISLaser::parse(const char *line,
+                                             std::size_t length);
 
 template <>
-const OBISLaser::SourceType OBISLaser::query(const std::string str);
+const OBISLaser::SourceType OBISLaser::parse(const char *line,
+                                             std::size_t length);
+
+template <typename T>
+const T OBISLaser::parse(const char *line, std::size_t length) {
+  return static_cast<T>(number(line, length, std::is_floating_point<T>()));
+}
+
+template <typename T>
+const T OBISLaser::parse(const std::string &line) {
+  return parse<T>(line.c_str(), line.length());
+}
+
+template <typename T>
+const T OBISLaser::query(const char *cmd) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  batch(&cmd, 1);
+  return parse<T>(_lines[0], _lengths[0]);
+}
 
 template <typename T>
 const T OBISLaser::query(const std::string str) {
-  T val;
-  std::istringstream ss(result(str));
-  ss >> val;
-  return val;
+  return query<T>(str.c_str());
 }
 
 #endif
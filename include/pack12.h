@@ -0,0 +1,25 @@
+#ifndef HAPI_PACK12_H
+#define HAPI_PACK12_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace hapi {
+// 12 bit pixels packed two into three bytes, in the GenICam Mono12p layout:
+// the low 8 bits of the first pixel, then its high 4 bits in the low nibble
+// and the low 4 bits of the second pixel in the high nibble, then the high 8
+// bits of the second pixel. Built for ARM the kernels use NEON, 16 pixels at
+// a time.
+
+// bytes n packed pixels take
+inline std::size_t packed12_size(std::size_t n) { return (n * 3 + 1) / 2; }
+
+// packs n 16 bit pixels shifted right by shift, 4 for MSB aligned Mono16
+void pack12(const uint16_t *src, uint8_t *dst, std::size_t n,
+            unsigned int shift = 4);
+// unpacks n pixels to 16 bits shifted left by shift
+void unpack12(const uint8_t *src, uint16_t *dst, std::size_t n,
+              unsigned int shift = 4);
+}  // namespace hapi
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef HAPI_PMT_BOARD_H
+#define HAPI_PMT_BOARD_H
+
+#include <chrono>
+
+namespace hapi {
+// The parts of the HAPI-E board the pmt calibration uses, so it can run
+// against the real board or a simulated one
+class PMTBoard {
+ public:
+  enum TriggerSource { PMT = 0, PI = 1 };
+
+  virtual ~PMTBoard() {}
+
+  // arms the board so it can capture images
+  virtual void arm() = 0;
+  // disarms the board
+  virtual void disarm() = 0;
+  // returns true if the board has captured an image
+  virtual bool is_done() = 0;
+  // clears the state of the board
+  virtual void reset() = 0;
+  // sets the trigger source to either come from the PMT or the PI.
+  virtual void set_trigger_source(TriggerSource source) = 0;
+  // sets the pmt gain voltage 0.5-1.1V
+  // steps of 0.6/256 volts 0x00-0xFF
+  virtual void set_pmt_gain(int gain_byte) = 0;
+  // sets the pmt threshold voltage 0.0-3.3V
+  // steps of 3.3/256 volts 0x00-0xFF
+  virtual void set_pmt_threshold(int threshold_byte) = 0;
+  // the time on the board's clock in seconds, only differences are meaningful
+  virtual std::chrono::duration<double> now() = 0;
+};
+}  // namespace hapi
+#endif
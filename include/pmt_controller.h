@@ -0,0 +1,64 @@
+#ifndef HAPI_PMT_CONTROLLER_H
+#define HAPI_PMT_CONTROLLER_H
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "Spinnaker.h"
+#include "config.h"
+
+namespace hapi {
+// Keeps the pmt at the edge of the noise while acquiring in TRIGGER mode.
+// Every pmt_control_window events it looks at the trigger rate and the
+// fraction of frames with nothing in them (noise triggers) and steps the
+// threshold, or the gain once the threshold is at a limit, one way or the
+// other. Enabled by the pmt_control config key.
+class PMTController {
+ public:
+  PMTController(Config &config);
+
+  // marks the frame empty or not. Called by the writer thread before the
+  // frame is saved.
+  void classify(Spinnaker::ImagePtr &image);
+  // counts an event and adjusts the pmt at the end of a window. Called by the
+  // control thread while the board is disarmed.
+  void update();
+
+ private:
+  int _gain;
+  int _threshold;
+  int _gain_min;
+  int _gain_max;
+  int _threshold_min;
+  int _threshold_max;
+  int _step;
+  unsigned int _window;
+  // most triggers per second before the pmt is made less sensitive
+  double _rate_max;
+  // fractions of empty frames above which the pmt is made less sensitive and
+  // below which it is made more sensitive
+  double _empty_high;
+  double _empty_low;
+  // mean difference from the background, relative to the background level,
+  // below which a frame is empty
+  double _empty_diff;
+
+  // control thread
+  unsigned int _triggers{0};
+  std::chrono::steady_clock::time_point _window_start;
+  unsigned int _window_frames{0};
+  unsigned int _window_empty{0};
+
+  // writer thread
+  std::vector<float> _background;
+  std::vector<float> _sample;
+  unsigned int _since_empty{0};
+  std::atomic<unsigned int> _frames{0};
+  std::atomic<unsigned int> _empty{0};
+
+  bool sample(Spinnaker::ImagePtr &image);
+};
+}  // namespace hapi
+
+#endif
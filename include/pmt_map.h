@@ -0,0 +1,68 @@
+#ifndef HAPI_PMT_MAP_H
+#define HAPI_PMT_MAP_H
+
+#if _HAS_CXX17
+#include <filesystem>
+#else
+#include <experimental/filesystem>
+namespace std {
+namespace filesystem = std::experimental::filesystem;
+};
+#endif
+#include <ctime>
+#include <map>
+#include <utility>
+
+namespace hapi {
+// Noise trigger rates measured over the pmt (gain, threshold) grid, saved
+// between runs so a calibration can start from the last one and only re-probe
+// the settings near its result
+class PMTMap {
+ public:
+  struct entry_t {
+    // triggers seen
+    unsigned int _count;
+    // seconds the board was armed
+    double _live;
+    // when it was measured
+    std::time_t _time;
+    // laser baseplate temperature when it was measured, NaN if unknown
+    double _temp;
+  };
+
+  PMTMap();
+
+  void load(std::filesystem::path p);
+  void save(std::filesystem::path p);
+
+  // sets the temperature recorded with new measurements, NaN if unknown
+  void set_temperature(double temp);
+  double temperature();
+
+  // records a measurement, replacing any earlier one at the same setting
+  void record(unsigned int gain, unsigned int threshold, unsigned int count,
+              double live);
+  // records the result of a calibration
+  void set_result(unsigned int gain, unsigned int threshold);
+
+  // true if there is a result measured within max_age seconds and max_temp
+  // degrees of the current temperature
+  bool has_result(double max_age, double max_temp);
+  std::pair<unsigned int, unsigned int> result();
+
+  // true if the entry was measured within max_age seconds and max_temp
+  // degrees of the current temperature
+  bool is_current(const entry_t &entry, double max_age, double max_temp);
+
+  const std::map<std::pair<unsigned int, unsigned int>, entry_t> &entries();
+
+ private:
+  double _temp;
+  bool _has_result{false};
+  std::pair<unsigned int, unsigned int> _result;
+  entry_t _result_entry;
+  std::map<std::pair<unsigned int, unsigned int>, entry_t> _entries;
+};
+}  // namespace hapi
+
+#endif
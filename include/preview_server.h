@@ -0,0 +1,65 @@
+#ifndef HAPI_PREVIEW_SERVER_H
+#define HAPI_PREVIEW_SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace hapi {
+// Serves live preview images over http straight from memory, for aligning
+// the optics without writing every frame to the sd card. Each camera is a
+// stream of downscaled 8 bit bmp images:
+//   /               page showing every stream
+//   /stream/<i>     multipart/x-mixed-replace, a new part per frame
+//   /frame/<i>.bmp  the latest frame
+class PreviewServer {
+ public:
+  // listens at the ipv4 address and port, e.g. 127.0.0.1 for this machine
+  // only or 0.0.0.0 for every interface. Frames are shrunk to at most width
+  // pixels across.
+  PreviewServer(const std::string &address, unsigned short port,
+                std::size_t streams, unsigned int width);
+  // disconnects the clients and stops listening
+  ~PreviewServer();
+
+  // downscales a mono 8 bit image, encodes it and wakes the stream's clients.
+  // Never waits for a client.
+  void publish(std::size_t stream, const uint8_t *data, std::size_t width,
+               std::size_t height, std::size_t stride);
+
+ private:
+  struct client_t {
+    std::thread _thread;
+    std::atomic<bool> _done{false};
+  };
+
+  int _listen{-1};
+  int _stop[2]{-1, -1};
+  unsigned int _width;
+  std::atomic<bool> _running{true};
+  std::thread _accept;
+  std::list<client_t> _clients;
+
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  // latest encoded frame of every stream and how many there have been
+  std::vector<std::shared_ptr<const std::string>> _frames;
+  std::vector<unsigned long> _sequences;
+
+  void accept_loop();
+  // answers one request, streams until the client leaves
+  void serve(int fd);
+  // waits for a frame newer than sequence, null once stopping
+  std::shared_ptr<const std::string> next(std::size_t stream,
+                                          unsigned long &sequence);
+};
+}  // namespace hapi
+
+#endif
@@ -4,9 +4,12 @@
 #include <chrono>
 #include <memory>
 #include <string>
+#include <vector>
 
-#include "obis.h"
-#include "usb_camera.h"
+#include "camera_group.h"
+#include "config.h"
+#include "laser_group.h"
+#include "preview_server.h"
 
 #if _HAS_CXX17
 #include <filesystem>
@@ -19,13 +22,43 @@ namespace filesystem = std::experimental::filesystem;
 
 namespace hapi {
 enum HAPIMode { TRIGGER, INTERVAL, TRIGGER_TEST, ALIGN, CW };
-void acquisition_loop(std::shared_ptr<USBCamera> &camera, OBISLaser &laser,
+
+// an image handed from the real-time control thread to the writer thread
+struct frame_t {
+  // one image per camera, null where a camera missed the trigger
+  std::vector<Spinnaker::ImagePtr> _images;
+  // added to each image's name to tell the cameras apart, empty with one
+  std::vector<std::string> _suffixes;
+  // number of the image in this run
+  unsigned int _count;
+  // time the trigger was received
+  std::string _time;
+  // wavelength of the laser that lit the frame when the lasers take turns,
+  // 0 otherwise
+  double _wavelength;
+  // set for an image that came straight from a camera event, the writer
+  // fills in the trigger it belongs to from when it came in
+  bool _event{false};
+  CameraGroup::clock::time_point _received;
+};
+
+// Runs the trigger/arm/grab loop on a real-time thread (see the rt_cpu and
+// rt_priority config keys) and saves images on a normal priority writer
+// thread that stays off the real-time cpu. Each laser is polled on its own
+// monitor thread and acquisition stops on a laser fault. With laser_interleave
+// set the lasers take turns, one per image. Every camera grabs on its own
+// thread and the images of one trigger are saved together, or with
+// camera_events every image goes from the driver straight to the writer.
+// ALIGN mode serves them from memory on preview_port instead.
+void acquisition_loop(CameraGroup &cameras, LaserGroup &lasers,
                       std::filesystem::path &out_dir, std::string &image_type,
-                      std::chrono::milliseconds interval_time, HAPIMode mode);
-void acquire_image(std::shared_ptr<USBCamera> &camera,
-                   std::filesystem::path &out_dir, std::string &image_type,
-                   unsigned int image_count, const std::string &image_time,
-                   HAPIMode mode);
+                      std::chrono::milliseconds interval_time, HAPIMode mode,
+                      Config &config);
+// converts, saves, and thumbnails the grabbed images, one camera per thread,
+// then releases them. With a preview server they are only published to it.
+void save_image(frame_t &frame, std::filesystem::path &out_dir,
+                std::string &image_type, HAPIMode mode,
+                PreviewServer *preview = nullptr);
 bool use_camera(HAPIMode mode);
 };  // namespace hapi
 
@@ -15,6 +15,8 @@ namespace filesystem = std::experimental::filesystem;
 namespace hapi {
 Config get_config();
 std::string get_image_type(Config &config);
+// applies the log_ keys to the logger
+void configure_logger(Config &config);
 std::filesystem::path get_out_dir(std::string &start_time, Config &config);
 };  // namespace hapi
 #endif
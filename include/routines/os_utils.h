@@ -2,6 +2,7 @@
 #define HAPI_OS_UTILS_H
 #include <atomic>
 #include <string>
+#include <vector>
 
 namespace hapi {
 extern volatile std::atomic<bool> running;
@@ -13,6 +14,31 @@ bool initialize_signal_handlers();
 
 bool is_root();
 std::string exec(const char *cmd);
+
+// a usb serial device (ttyACM) and the usb device it belongs to
+struct usb_serial_t {
+  // e.g. /dev/ttyACM0
+  std::string _device;
+  // usb port the device is plugged into, e.g. 1-1.3
+  std::string _port;
+  unsigned int _vid;
+  unsigned int _pid;
+  std::string _serial;
+};
+// lists the usb serial devices from sysfs that match the vendor id, product id
+// and serial number, ordered by usb port so the order stays the same across
+// reboots. A zero id or an empty serial number matches any.
+std::vector<usb_serial_t> find_usb_serial(unsigned int vid = 0,
+                                          unsigned int pid = 0,
+                                          const std::string &serial = "");
+
+// makes the calling thread real-time: SCHED_FIFO at the given priority, pinned
+// to the given cpu, with all current and future pages locked into memory
+bool set_realtime(int priority, int cpu);
+// pins every thread of the process to every online cpu except the real-time
+// one and puts the calling thread at normal priority. Threads created
+// afterwards inherit the affinity, so call it before starting any.
+bool set_non_realtime(int rt_cpu);
 };  // namespace hapi
 
 #endif
@@ -1,19 +1,69 @@
 #ifndef HAPI_PMT_CALIBRATE_H
 #define HAPI_PMT_CALIBRATE_H
+#include <chrono>
 #include <stdexcept>
-#include <utility>
+
+#include "board.h"
+#include "pmt_map.h"
+
 namespace hapi {
+struct pmt_calibration_t {
+  unsigned int _gain;
+  unsigned int _threshold;
+  // false trigger rate predicted at the chosen settings in hertz, zero for
+  // the binary search
+  double _rate;
+  // upper confidence bound of the predicted rate in hertz
+  double _rate_upper;
+  // number of gain/threshold settings probed
+  unsigned int _probes;
+  // time the calibration took on the board's clock
+  std::chrono::milliseconds _duration;
+};
+
 /**
  * pmt_calibrate
  *
- * Finds calibration values for the pmt gain and trigger threshold
+ * Finds calibration values for the pmt gain and trigger threshold with a
+ * binary search. Each probe is a sequential test that stops as soon as it
+ * can tell at the given confidence whether the noise rate is low enough. The
+ * large first steps use a quicker test with a wider margin.
+ *
+ * millis: the probe window, a setting passes if it sees well under one noise
+ * trigger per window
+ * confidence: confidence level of each probe's decision (0.5-0.999)
+ * map: the result is recorded here. If it holds a recent result taken at a
+ * similar laser temperature only a setting either side of it is checked, and
+ * a setting that moved is searched for from scratch.
+ * board: the board to calibrate, a SimulatedBoard for testing
+ *
+ * Returns: the gain and threshold values
+ */
+pmt_calibration_t pmt_calibrate(long long millis, double confidence,
+                                PMTMap &map,
+                                PMTBoard &board = Board::instance());
+
+/**
+ * pmt_calibrate_rate
+ *
+ * Finds calibration values for the pmt gain and trigger threshold by
+ * measuring the false trigger rate at a handful of settings and fitting
+ * log(rate) as a line in the setting, first over the gain at the mid
+ * threshold and then over the threshold at the chosen gain.
  *
- * millis: the limit to check within
+ * target_rate: the false trigger rate to aim for in hertz
+ * confidence: confidence level the rate's upper bound must stay under the
+ * target with (0.5-0.999)
+ * millis: live time of each rate probe in milliseconds
+ * map: every probe is recorded here. Recent measurements taken at a similar
+ * laser temperature replace the coarse probes.
+ * board: the board to calibrate, a SimulatedBoard for testing
  *
- * Returns: a pair of ints, the first the gain value, the second the threshold
- * value
+ * Returns: the chosen gain and threshold with their predicted rate
  */
-std::pair<unsigned int, unsigned int> pmt_calibrate(long long millis);
+pmt_calibration_t pmt_calibrate_rate(double target_rate, double confidence,
+                                     long long millis, PMTMap &map,
+                                     PMTBoard &board = Board::instance());
 class PMTCalibrationError : public std::runtime_error {
  public:
   PMTCalibrationError() noexcept
@@ -1,12 +1,18 @@
 #ifndef HAPI_STR_UTILS_H
 #define HAPI_STR_UTILS_H
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace hapi {
 // Returns a std::string of the current time in the format YYYY_MM_DD-HH_MM_SS
 std::string str_time();
 void lower(std::string &in);
+// splits a list like "a, b,c" into its items, trimmed and without empty ones
+std::vector<std::string> split_list(const std::string &in, char delim = ',');
+// 64 bit FNV-1a hash, stable across builds unlike std::hash
+uint64_t fnv1a(const std::string &in);
 };  // namespace hapi
 
 #endif
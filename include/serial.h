@@ -1,8 +1,11 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <functional>
+#include <stdexcept>
 #include <string>
 
 //#if defined(__linux__)
@@ -16,8 +19,30 @@
 // using speed_t = unsigned int;
 //#endif
 
+// thrown when the device does not answer or accept data before the deadline
+class SerialTimeout : public std::runtime_error {
+ public:
+  SerialTimeout(const std::string &what) : std::runtime_error(what) {}
+};
+
+// thrown when another process has the device open
+class SerialBusy : public std::runtime_error {
+ public:
+  SerialBusy(const std::string &what) : std::runtime_error(what) {}
+};
+
+// thrown when the cancel hook asks a wait to stop
+class SerialCancelled : public std::runtime_error {
+ public:
+  SerialCancelled(const std::string &what) : std::runtime_error(what) {}
+};
+
+// All waits are poll() based with a deadline. The device is always opened
+// non-blocking, blocking only records what the caller asked for.
 class SerialInterface {
  public:
+  using clock = std::chrono::steady_clock;
+
   SerialInterface(void);
   SerialInterface(std::string device, speed_t baud, bool blocking = true);
   ~SerialInterface(void);
@@ -26,22 +51,68 @@ class SerialInterface {
   void close(void);
   bool is_open(void);
 
+  // returns the next line including the delimiter, waiting up to the timeout
+  // for it. Throws SerialTimeout if it doesn't arrive.
   std::string getline(char delim = '\n');
+  std::string getline(char delim, clock::time_point deadline);
+  // copies the next line including the delimiter into line and terminates it,
+  // returns its length. A line that doesn't fit is cut short, the rest of it
+  // is dropped.
+  std::size_t getline(char *line, std::size_t size, char delim,
+                      clock::time_point deadline);
+  // returns everything received so far without waiting
   std::string read(void);
+  // drops everything received so far, e.g. a late reply after a timeout
+  void discard(void);
 
+  // writes all of str, waiting up to the timeout for the device to take it.
+  // Throws SerialTimeout if it doesn't.
   int write(const std::string str);
   int write(const char c);
+  int write(const char *data, std::size_t length, clock::time_point deadline);
 
   int printf(const char *fmt, ...);
 
   bool is_blocking(void);
 
+  // how long getline and write wait
+  void set_timeout(std::chrono::milliseconds timeout);
+  std::chrono::milliseconds timeout(void);
+  // checked while waiting, returning true stops the wait with SerialCancelled
+  void set_cancel(std::function<bool()> cancel);
+
+  // number of reads and writes that timed out
+  unsigned long timeouts(void);
+
  protected:
-  int _device_fd;
-  std::FILE *_device_f{nullptr};
+  int _device_fd{-1};
   struct termios _config;
 
   bool _blocking;
+  std::chrono::milliseconds _timeout{1000};
+  std::function<bool()> _cancel;
+  unsigned long _timeouts{0};
+
+  // received bytes not handed out yet, _size bytes starting at _head and
+  // wrapping around the end of the buffer
+  char _buffer[4096];
+  std::size_t _head{0};
+  std::size_t _size{0};
+
+  // reads as much as fits into the buffer, returns the number of bytes read.
+  // Waits until the deadline for at least one byte.
+  std::size_t fill(clock::time_point deadline);
+  // waits for events on the device until the deadline, returns false if it
+  // passed
+  bool wait(short events, clock::time_point deadline);
+  // length of the first buffered line including the delimiter, 0 if there
+  // is no delimiter yet
+  std::size_t find(char delim);
+  // moves the first n buffered bytes to the end of str
+  void take(std::string &str, std::size_t n);
+  // drops the first n buffered bytes, copying up to size of them to dest.
+  // Returns the number copied.
+  std::size_t take(char *dest, std::size_t size, std::size_t n);
 };
 
 #endif
@@ -0,0 +1,58 @@
+#ifndef HAPI_SIMULATED_BOARD_H
+#define HAPI_SIMULATED_BOARD_H
+
+#include <random>
+
+#include "pmt_board.h"
+
+namespace hapi {
+// A HAPI-E board with a modelled pmt for trying out the calibration without
+// hardware. Its clock is virtual and only moves when the board is used, so a
+// calibration that takes minutes on the real board finishes in milliseconds.
+class SimulatedBoard : public PMTBoard {
+ public:
+  struct model_t {
+    // dark count rate in hertz at gain and threshold 0x80
+    double _dark_rate;
+    // e-folds of the dark count rate per gain and per threshold step
+    double _gain_slope;
+    double _threshold_slope;
+    // real particle rate in hertz and how many of them trigger the board at
+    // gain and threshold 0x80
+    double _particle_rate;
+    double _particle_efficiency;
+    // most triggers per second the pmt can produce
+    double _max_rate;
+  };
+
+  // a model roughly matching the flight pmt
+  static model_t default_model();
+
+  SimulatedBoard(const model_t &model, unsigned int seed);
+
+  void arm() override;
+  void disarm() override;
+  bool is_done() override;
+  void reset() override;
+  void set_trigger_source(TriggerSource source) override;
+  void set_pmt_gain(int gain_byte) override;
+  void set_pmt_threshold(int threshold_byte) override;
+  std::chrono::duration<double> now() override;
+
+  // the modelled trigger rate in hertz at the given setting
+  double rate(int gain, int threshold) const;
+
+ private:
+  model_t _model;
+  std::mt19937 _rng;
+  int _gain{-1};
+  int _threshold{-1};
+  bool _armed{false};
+  // virtual time in seconds and when the armed board next triggers
+  double _clock{0};
+  double _event{0};
+
+  void schedule();
+};
+}  // namespace hapi
+#endif
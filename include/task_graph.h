@@ -0,0 +1,40 @@
+#ifndef HAPI_TASK_GRAPH_H
+#define HAPI_TASK_GRAPH_H
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace hapi {
+// Named tasks that each run on their own thread as soon as the tasks they
+// come after are done, e.g. to bring the board, lasers and cameras up at the
+// same time. How long each task took is logged.
+class TaskGraph {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  TaskGraph();
+
+  // adds a task that runs once every task named in after is done. Those have
+  // to be added first, so there can't be a cycle.
+  void add(const std::string &name, const std::vector<std::string> &after,
+           std::function<void()> task);
+  // runs every task and waits for all of them. Tasks after one that failed
+  // are skipped. Rethrows the first failure.
+  void run();
+
+ private:
+  struct task_t {
+    std::string _name;
+    std::vector<std::size_t> _after;
+    std::function<void()> _task;
+  };
+
+  std::vector<task_t> _tasks;
+
+  std::size_t find(const std::string &name);
+};
+}  // namespace hapi
+
+#endif
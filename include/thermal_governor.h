@@ -0,0 +1,45 @@
+#ifndef HAPI_THERMAL_GOVERNOR_H
+#define HAPI_THERMAL_GOVERNOR_H
+
+#include <chrono>
+
+#include "config.h"
+#include "laser_monitor.h"
+#include "obis.h"
+
+namespace hapi {
+// Slows image taking down as the laser's temperatures approach the limits
+// from sys_info() and speeds it back up as they recover, instead of stopping
+// on an over temperature fault. Within thermal_margin degrees of a limit the
+// duty (the fraction of the nominal image rate) falls linearly down to
+// thermal_min_duty at the limit.
+class ThermalGovernor {
+ public:
+  ThermalGovernor(const OBISLaser::sys_info_t &info, Config &config);
+
+  // updates the duty from a new reading, returns true if it changed enough
+  // to be applied
+  bool update(const LaserMonitor::snapshot_t &snapshot);
+  // fraction of the nominal rate, 1 when the laser is cool
+  double duty();
+  // the nominal period stretched by the duty
+  std::chrono::microseconds stretch(std::chrono::microseconds nominal);
+
+  // true if the fault code only has temperature faults, which clear once the
+  // laser cools down
+  static bool is_thermal(FaultCode fault);
+
+ private:
+  double _baseplate_max;
+  double _diode_max;
+  double _internal_max;
+  double _margin;
+  double _min_duty;
+  // duty the temperatures call for smoothed on the way up, and the last one
+  // returned from update()
+  double _duty{1};
+  double _applied{1};
+};
+}  // namespace hapi
+
+#endif
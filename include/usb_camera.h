@@ -1,6 +1,8 @@
 #ifndef HAPI_CAMERA_H
 #define HAPI_CAMERA_H
 
+#include <chrono>
+#include <cstdint>
 #include <map>
 #include <memory>
 #include <string>
@@ -14,6 +16,23 @@ class USBCamera {
  public:
   enum TriggerType { SOFTWARE, HARDWARE };
 
+  // usb link as the camera reports it, in bytes per second
+  struct link_t {
+    int64_t _speed;
+    int64_t _throughput_limit;
+    int64_t _throughput;
+    // frame rate the camera can reach with its current settings and limit
+    double _resulting_fps;
+  };
+
+  // result of probe()
+  struct probe_t {
+    unsigned long _frames;
+    unsigned long _incomplete;
+    double _fps;
+    double _bytes_per_s;
+  };
+
   USBCamera(Spinnaker::CameraPtr ptr);
   ~USBCamera();
 
@@ -27,12 +46,24 @@ class USBCamera {
   void reset_trigger();
   // prints the device info to the console
   std::map<std::string, std::string> get_device_info();
+  // the device serial number, readable before init()
+  std::string serial();
   // sets the acquisition mode (SingleFrame, MultiFrame, Continuous)
   void set_acquisition_mode(const Spinnaker::AcquisitionModeEnums mode);
   // begin image acquisition
   void begin_acquisition();
   // get an acquired image, waits for one if there isn't one ready
   Spinnaker::ImagePtr acquire_image();
+  // waits up to timeout for the next image without triggering, null if none
+  // came
+  Spinnaker::ImagePtr next_image(std::chrono::milliseconds timeout);
+  // number of stream buffers the driver fills before images are lost, set
+  // before beginning acquisition
+  void set_buffer_count(unsigned int count);
+  // has the driver call handler with every image as it completes, instead of
+  // waiting in next_image(). Register before beginning acquisition.
+  void register_image_event(Spinnaker::ImageEvent& handler);
+  void unregister_image_event(Spinnaker::ImageEvent& handler);
   // end image acquisition
   void end_acquisition();
   // initialize the camera
@@ -49,6 +80,28 @@ class USBCamera {
   void set_auto_gain(Spinnaker::GainAutoEnums a);
   // set gain
   void set_gain(double gain);
+  // sets what the camera sends, e.g. Mono12p to keep the sensor's full depth
+  void set_pixel_format(Spinnaker::PixelFormatEnums format);
+  double get_gain();
+  double get_exposure();
+  // stores the current settings in the camera's user set and has the camera
+  // load them on power up
+  void save_user_set();
+  // restores the settings stored with save_user_set()
+  void load_user_set();
+  link_t link();
+  // caps the bandwidth the camera uses on the usb link, 0 lifts the cap
+  void set_throughput_limit(int64_t bytes_per_s);
+  // the stream's buffer and frame counters that the driver provides, e.g.
+  // lost and incomplete frames
+  std::map<std::string, int64_t> stream_stats();
+  // lets the camera run free at its current settings for the given time and
+  // measures the sustained frame rate, then restores the trigger. Call
+  // between acquisitions.
+  probe_t probe(std::chrono::milliseconds duration);
+  // the trigger type of settings loaded from the user set, without writing
+  // the trigger nodes
+  void set_trigger_type(TriggerType type);
 
  private:
   // Spinnaker camera pointer
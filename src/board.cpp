@@ -2,18 +2,45 @@
 
 #include <thread>
 
+#include <time.h>
+
 #include <wiringPi.h>
 #include <wiringPiI2C.h>
 
 using namespace hapi;
 
 #define HAPI_PIN_DELAY std::chrono::milliseconds(100)
+// how far ahead of the end of a pulse to stop sleeping and start spinning
+#define HAPI_PULSE_SPIN_NS 200000L
+
+/**
+ * hold_until
+ *
+ * Returns at the given CLOCK_MONOTONIC time with microsecond accuracy. Sleeps
+ * for most of the wait and spins for the last part since the scheduler can
+ * wake us late.
+ */
+inline void hold_until(const timespec &end) {
+  auto ns = [](const timespec &t) {
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+  };
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long long wake = ns(end) - HAPI_PULSE_SPIN_NS;
+  if (wake > ns(now)) {
+    timespec t{(time_t)(wake / 1000000000LL), (long)(wake % 1000000000LL)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, nullptr) != 0) {
+    }
+  }
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while (ns(now) < ns(end));
+}
 
 Board::Board() {
   // initialize wiringPi and create the board instance
   wiringPiSetup();
   _i2c = wiringPiI2CSetup(0x51);
-  piHiPri(99);
   pinMode(_arm_pin, OUTPUT);
   pinMode(_done_pin, INPUT);
   pinMode(_trigger_pin, OUTPUT);
@@ -33,13 +60,21 @@ Board::Board() {
 
 void Board::trigger() {
   if (_trigger_source == Board::TriggerSource::PI) {
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
     digitalWrite(_trigger_pin, HIGH);
-    std::this_thread::sleep_for(HAPI_PIN_DELAY);
+    long long ns = end.tv_nsec + _trigger_width.count() * 1000LL;
+    end.tv_sec += ns / 1000000000LL;
+    end.tv_nsec = ns % 1000000000LL;
+    hold_until(end);
     digitalWrite(_trigger_pin, LOW);
-    std::this_thread::sleep_for(HAPI_PIN_DELAY);
   }
 }
 
+void Board::set_trigger_width(std::chrono::microseconds width) {
+  _trigger_width = width;
+}
+
 void Board::arm() {
   digitalWrite(_arm_pin, HIGH);
   std::this_thread::sleep_for(HAPI_PIN_DELAY);
@@ -52,6 +87,10 @@ void Board::disarm() {
 
 bool Board::is_done() { return digitalRead(_done_pin); }
 
+std::chrono::duration<double> Board::now() {
+  return std::chrono::steady_clock::now().time_since_epoch();
+}
+
 void Board::reset() {
   arm();
   disarm();
@@ -84,11 +123,20 @@ void Board::set_pulse(unsigned int pulse) {
   std::this_thread::sleep_for(HAPI_PIN_DELAY);
 }
 void Board::set_pmt_gain(int gain_byte) {
+  // the DAC holds its value, skip the write and settle time if unchanged
+  if (gain_byte == _pmt_gain) return;
   wiringPiI2CWriteReg8(_i2c, 0x00, gain_byte);
+  _pmt_gain = gain_byte;
   std::this_thread::sleep_for(std::chrono::milliseconds(100));
 }
 
 void Board::set_pmt_threshold(int threshold_byte) {
+  if (threshold_byte == _pmt_threshold) return;
   wiringPiI2CWriteReg8(_i2c, 0x01, threshold_byte);
+  _pmt_threshold = threshold_byte;
   std::this_thread::sleep_for(std::chrono::milliseconds(100));
 }
+
+int Board::pmt_gain() { return _pmt_gain; }
+
+int Board::pmt_threshold() { return _pmt_threshold; }
@@ -0,0 +1,276 @@
+#include "camera_group.h"
+
+#include <cstdlib>
+#include <exception>
+
+#include "logger.h"
+
+using namespace hapi;
+
+// images a grab thread may hold for collect() before it starts dropping them
+#define HAPI_GRAB_QUEUE_SIZE 2
+
+// longest a grab thread waits for an image before checking for end() again
+#define HAPI_GRAB_SLICE std::chrono::milliseconds(100)
+
+CameraGroup::unit_t::unit_t(std::shared_ptr<USBCamera> camera)
+    : _camera(camera), _grabbed(HAPI_GRAB_QUEUE_SIZE) {}
+
+CameraGroup::unit_t::~unit_t() {
+  _grabbed.close();
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+}
+
+CameraGroup::handler_t::handler_t(CameraGroup &group, unit_t &unit)
+    : _group(group), _unit(unit) {}
+
+void CameraGroup::handler_t::OnImageEvent(Spinnaker::ImagePtr image) {
+  if (_group._grabbing) {
+    _group.forward(_unit, image);
+  } else {
+    image->Release();
+  }
+}
+
+CameraGroup::CameraGroup()
+    : _window(std::chrono::milliseconds(20)),
+      _timeout(std::chrono::milliseconds(1000)) {}
+
+CameraGroup::~CameraGroup() { end(); }
+
+void CameraGroup::add(std::shared_ptr<USBCamera> camera) {
+  _units.emplace_back(new unit_t(camera));
+  _units.back()->_index = _units.size() - 1;
+  _units.back()->_serial = camera->serial();
+}
+
+void CameraGroup::clear() {
+  end();
+  _units.clear();
+}
+
+std::size_t CameraGroup::size() { return _units.size(); }
+
+USBCamera &CameraGroup::camera(std::size_t index) {
+  return *_units.at(index)->_camera;
+}
+
+const std::string &CameraGroup::serial(std::size_t index) {
+  return _units.at(index)->_serial;
+}
+
+void CameraGroup::set_window(std::chrono::milliseconds window) {
+  _window = window;
+}
+
+void CameraGroup::set_timeout(std::chrono::milliseconds timeout) {
+  _timeout = timeout;
+}
+
+void CameraGroup::begin(unsigned int buffers, sink_t sink) {
+  Logger &log = Logger::instance();
+  bool events = sink != nullptr;
+  // set before the first event can come in
+  _sink = sink;
+  _grabbing = true;
+  for (auto &unit : _units) {
+    unit->_first = true;
+    try {
+      unit->_camera->set_buffer_count(buffers);
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Using the default stream buffers on camera "
+                        << unit->_serial << "." << std::endl;
+    }
+    if (events) {
+      unit->_handler.reset(new handler_t(*this, *unit));
+      unit->_camera->register_image_event(*unit->_handler);
+    }
+    unit->_camera->begin_acquisition();
+  }
+  if (!events) {
+    for (auto &unit : _units) {
+      unit_t *u = unit.get();
+      u->_thread = std::thread([this, u]() { grab(*u); });
+    }
+  }
+}
+
+void CameraGroup::end() {
+  if (!_grabbing) {
+    return;
+  }
+  _grabbing = false;
+  for (auto &unit : _units) {
+    if (unit->_thread.joinable()) {
+      unit->_thread.join();
+    }
+  }
+  for (auto &unit : _units) {
+    try {
+      unit->_camera->end_acquisition();
+      // no more events come in once acquisition has ended
+      if (unit->_handler) {
+        unit->_camera->unregister_image_event(*unit->_handler);
+      }
+    } catch (const std::exception &ex) {
+      Logger::instance().exception(ex)
+          << "Failed to end acquisition on camera " << unit->_serial << "."
+          << std::endl;
+    }
+    unit->_handler.reset();
+    drain(*unit);
+  }
+  _sink = nullptr;
+}
+
+void CameraGroup::trigger() {
+  for (auto &unit : _units) {
+    try {
+      unit->_camera->grab_next_image_by_trigger();
+    } catch (const std::exception &ex) {
+      Logger::instance().exception(ex)
+          << "Failed to trigger camera " << unit->_serial << "." << std::endl;
+    }
+  }
+}
+
+std::size_t CameraGroup::collect(std::vector<Spinnaker::ImagePtr> &images,
+                                 clock::time_point at) {
+  Logger &log = Logger::instance();
+  images.assign(_units.size(), nullptr);
+  clock::time_point deadline = at + _timeout;
+  std::vector<grab_t> event(_units.size());
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < _units.size(); i++) {
+    unit_t &unit = *_units[i];
+    grab_t grabbed;
+    while (unit._grabbed.pop(grabbed, deadline)) {
+      if (grabbed._received >= at - _window) {
+        break;
+      }
+      // came in before the trigger, so it belongs to an event nobody waited
+      // for
+      _stale++;
+      log.warning() << "Discarding frame " << grabbed._frame_id
+                    << " of camera " << unit._serial
+                    << ", it came before the trigger." << std::endl;
+      grabbed._image->Release();
+      grabbed._image = nullptr;
+    }
+    if (grabbed._image == nullptr) {
+      _missed++;
+      log.warning() << "No image from camera " << unit._serial
+                    << " for this trigger." << std::endl;
+      continue;
+    }
+    if (!unit._first && grabbed._frame_id > unit._frame_id + 1) {
+      uint64_t lost = grabbed._frame_id - unit._frame_id - 1;
+      _skipped += lost;
+      log.warning() << "Camera " << unit._serial << " lost " << lost
+                    << " frame(s) before frame " << grabbed._frame_id << "."
+                    << std::endl;
+    }
+    event[i] = grabbed;
+    images[i] = grabbed._image;
+    count++;
+  }
+
+  // the camera clocks aren't synchronized, but between two triggers they all
+  // advance by the same time. A camera that doesn't is showing another event.
+  int64_t window = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       _window)
+                       .count();
+  int reference = -1;
+  int64_t reference_step = 0;
+  for (std::size_t i = 0; i < _units.size(); i++) {
+    unit_t &unit = *_units[i];
+    if (images[i] == nullptr) {
+      // the next step spans more than one trigger, don't compare it
+      unit._first = true;
+      continue;
+    }
+    if (!unit._first) {
+      int64_t step = (int64_t)(event[i]._timestamp - unit._timestamp);
+      if (reference < 0) {
+        reference = i;
+        reference_step = step;
+      } else if (std::llabs(step - reference_step) > window) {
+        log.warning() << "Camera " << unit._serial << " is "
+                      << (step - reference_step) / 1000000.0
+                      << " ms out of step with camera "
+                      << _units[reference]->_serial << "." << std::endl;
+      }
+    }
+    unit._first = false;
+    unit._frame_id = event[i]._frame_id;
+    unit._timestamp = event[i]._timestamp;
+  }
+  return count;
+}
+
+unsigned long CameraGroup::dropped() { return _dropped; }
+
+unsigned long CameraGroup::stale() { return _stale; }
+
+unsigned long CameraGroup::missed() { return _missed; }
+
+unsigned long CameraGroup::skipped() { return _skipped; }
+
+void CameraGroup::grab(unit_t &unit) {
+  Logger &log = Logger::instance();
+  while (_grabbing) {
+    Spinnaker::ImagePtr image;
+    try {
+      image = unit._camera->next_image(HAPI_GRAB_SLICE);
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Failed to grab an image from camera "
+                        << unit._serial << "." << std::endl;
+      std::this_thread::sleep_for(HAPI_GRAB_SLICE);
+      continue;
+    }
+    if (image != nullptr) {
+      deliver(unit, image);
+    }
+  }
+}
+
+void CameraGroup::deliver(unit_t &unit, Spinnaker::ImagePtr image) {
+  grab_t grabbed;
+  grabbed._image = image;
+  grabbed._received = clock::now();
+  grabbed._frame_id = image->GetFrameID();
+  grabbed._timestamp = image->GetTimeStamp();
+  if (!unit._grabbed.try_push(grabbed)) {
+    // give the buffer back to the camera rather than starve it
+    _dropped++;
+    image->Release();
+  }
+}
+
+void CameraGroup::forward(unit_t &unit, Spinnaker::ImagePtr image) {
+  clock::time_point received = clock::now();
+  // nothing collects these, so the lost frames are counted here
+  uint64_t frame_id = image->GetFrameID();
+  if (!unit._first && frame_id > unit._frame_id + 1) {
+    uint64_t lost = frame_id - unit._frame_id - 1;
+    _skipped += lost;
+    Logger::instance().warning()
+        << "Camera " << unit._serial << " lost " << lost
+        << " frame(s) before frame " << frame_id << "." << std::endl;
+  }
+  unit._first = false;
+  unit._frame_id = frame_id;
+  if (!_sink(unit._index, image, received)) {
+    _dropped++;
+    image->Release();
+  }
+}
+
+void CameraGroup::drain(unit_t &unit) {
+  grab_t grabbed;
+  while (unit._grabbed.pop(grabbed, clock::now())) {
+    grabbed._image->Release();
+  }
+}
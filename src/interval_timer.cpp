@@ -0,0 +1,141 @@
+#include "interval_timer.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using namespace hapi;
+
+// longest single sleep before checking the cancel flag again
+#define HAPI_TIMER_SLICE_MS 100
+
+inline double to_us(const timespec &t) {
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+inline void add_us(timespec &t, long long us) {
+  long long ns = t.tv_sec * 1000000000LL + t.tv_nsec + us * 1000;
+  t.tv_sec = ns / 1000000000;
+  t.tv_nsec = ns % 1000000000;
+}
+
+IntervalTimer::IntervalTimer(std::chrono::microseconds period)
+    : _period(period) {
+  _fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (_fd < 0) {
+    throw std::runtime_error(std::string("Could not create timerfd: ")
+                                 .append(std::strerror(errno)));
+  }
+}
+
+IntervalTimer::~IntervalTimer() {
+  if (_fd >= 0) {
+    ::close(_fd);
+  }
+}
+
+void IntervalTimer::start() {
+  clock_gettime(CLOCK_MONOTONIC, &_next);
+  _last_wake = _next;
+  add_us(_next, _period.count());
+  _started = true;
+  arm();
+}
+
+void IntervalTimer::arm() {
+  itimerspec spec{};
+  spec.it_value = _next;
+  if (timerfd_settime(_fd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+    throw std::runtime_error(std::string("Could not arm timerfd: ")
+                                 .append(std::strerror(errno)));
+  }
+}
+
+bool IntervalTimer::wait(const volatile std::atomic<bool> &cancel) {
+  pollfd pfd{_fd, POLLIN, 0};
+  for (;;) {
+    if (!cancel) {
+      return false;
+    }
+    int r = poll(&pfd, 1, HAPI_TIMER_SLICE_MS);
+    if (r < 0 && errno != EINTR) {
+      throw std::runtime_error(std::string("Could not wait on timerfd: ")
+                                   .append(std::strerror(errno)));
+    }
+    if (r > 0) {
+      std::uint64_t expirations;
+      if (::read(_fd, &expirations, sizeof expirations) ==
+          sizeof expirations) {
+        break;
+      }
+    }
+  }
+
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double late = to_us(now) - to_us(_next);
+  _count++;
+  _late_sum += late;
+  if (late > _late_max) _late_max = late;
+
+  double period = to_us(now) - to_us(_last_wake);
+  _last_wake = now;
+  _periods++;
+  if (_periods == 1) {
+    _period_min = _period_max = period;
+  } else {
+    if (period < _period_min) _period_min = period;
+    if (period > _period_max) _period_max = period;
+  }
+  double delta = period - _period_mean;
+  _period_mean += delta / _periods;
+  _period_m2 += delta * (period - _period_mean);
+
+  // next deadline is a whole period after the last one, skipping any that
+  // have already passed so a long stall does not cause a burst of triggers
+  add_us(_next, _period.count());
+  while (to_us(_next) <= to_us(now)) {
+    add_us(_next, _period.count());
+    _missed++;
+  }
+  arm();
+  return true;
+}
+
+void IntervalTimer::set_period(std::chrono::microseconds period) {
+  if (_started) {
+    add_us(_next, period.count() - _period.count());
+    _period = period;
+    arm();
+  } else {
+    _period = period;
+  }
+}
+
+std::chrono::microseconds IntervalTimer::period() { return _period; }
+
+const IntervalTimer::stats_t IntervalTimer::stats() {
+  stats_t s{};
+  s._count = _count;
+  s._missed = _missed;
+  if (_count > 0) {
+    s._late_mean = _late_sum / _count;
+    s._late_max = _late_max;
+  }
+  if (_periods > 0) {
+    s._period_mean = _period_mean;
+    s._period_min = _period_min;
+    s._period_max = _period_max;
+  }
+  if (_periods > 1) {
+    s._jitter = std::sqrt(_period_m2 / (_periods - 1));
+  }
+  return s;
+}
@@ -0,0 +1,237 @@
+#include "laser_group.h"
+
+#include <exception>
+#include <stdexcept>
+
+#include "logger.h"
+
+using namespace hapi;
+
+// commands that may wait for a laser's thread before post() gives up
+#define HAPI_LASER_COMMANDS 16
+
+LaserGroup::unit_t::unit_t(const std::string &device)
+    : _device(device), _commands(HAPI_LASER_COMMANDS) {
+  _thread = std::thread([this]() {
+    std::function<void()> f;
+    while (_commands.pop(f)) {
+      f();
+    }
+  });
+}
+
+LaserGroup::unit_t::~unit_t() {
+  _commands.close();
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+  _monitor.reset();
+  _laser.reset();
+}
+
+LaserGroup::LaserGroup() {}
+
+LaserGroup::~LaserGroup() { close(); }
+
+std::future<void> LaserGroup::run(unit_t &unit, std::function<void()> f) {
+  auto task = std::make_shared<std::packaged_task<void()>>(f);
+  std::future<void> done = task->get_future();
+  if (!unit._commands.try_push([task]() { (*task)(); })) {
+    throw std::runtime_error("Laser command queue is full: " + unit._device);
+  }
+  return done;
+}
+
+std::size_t LaserGroup::open(const std::vector<std::string> &devices,
+                             std::size_t count,
+                             std::function<void(OBISLaser &)> setup) {
+  Logger &log = Logger::instance();
+  std::size_t next = 0;
+  while (_units.size() < count && next < devices.size()) {
+    // open as many as are still missing at once
+    std::vector<std::unique_ptr<unit_t>> round;
+    std::vector<std::future<void>> opened;
+    for (; next < devices.size() && round.size() < count - _units.size();
+         next++) {
+      HAPI_INFO(log) << "Opening laser " << devices[next] << "." << std::endl;
+      round.emplace_back(new unit_t(devices[next]));
+      unit_t *unit = round.back().get();
+      opened.push_back(run(*unit, [unit, setup]() {
+        unit->_laser.reset(new OBISLaser(unit->_device));
+        if (setup) {
+          setup(*unit->_laser);
+        }
+        unit->_wavelength = unit->_laser->sys_info()._wavelength;
+      }));
+    }
+    for (std::size_t i = 0; i < round.size(); i++) {
+      try {
+        opened[i].get();
+        _units.push_back(std::move(round[i]));
+      } catch (const SerialBusy &ex) {
+        HAPI_INFO(log) << round[i]->_device << " is in use by another process."
+                       << std::endl;
+      } catch (const std::exception &ex) {
+        log.exception(ex) << "Failed to open laser " << round[i]->_device
+                          << "." << std::endl;
+      }
+    }
+  }
+  return _units.size();
+}
+
+void LaserGroup::close() {
+  stop_monitors();
+  std::vector<std::future<void>> closed;
+  for (auto &unit : _units) {
+    unit_t *u = unit.get();
+    // the laser turns itself off when destroyed. If its thread can't take
+    // the job, the unit's destructor does it on this thread instead.
+    try {
+      closed.push_back(run(*u, [u]() {
+        u->_monitor.reset();
+        u->_laser.reset();
+      }));
+    } catch (const std::exception &ex) {
+      Logger::instance().exception(ex) << std::endl;
+    }
+  }
+  for (auto &c : closed) {
+    c.wait();
+  }
+  _units.clear();
+}
+
+std::size_t LaserGroup::size() { return _units.size(); }
+
+OBISLaser &LaserGroup::laser(std::size_t index) {
+  return *_units.at(index)->_laser;
+}
+
+const std::string &LaserGroup::device(std::size_t index) {
+  return _units.at(index)->_device;
+}
+
+double LaserGroup::wavelength(std::size_t index) {
+  return _units.at(index)->_wavelength;
+}
+
+void LaserGroup::each(
+    std::function<void(std::size_t index, OBISLaser &laser)> f) {
+  std::vector<std::future<void>> done;
+  for (std::size_t i = 0; i < _units.size(); i++) {
+    OBISLaser *laser = _units[i]->_laser.get();
+    done.push_back(run(*_units[i], [f, i, laser]() { f(i, *laser); }));
+  }
+  std::exception_ptr error;
+  for (auto &d : done) {
+    try {
+      d.get();
+    } catch (...) {
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+bool LaserGroup::post(std::size_t index,
+                      std::function<void(OBISLaser &laser)> f) {
+  unit_t *unit = _units.at(index).get();
+  return unit->_commands.try_push([unit, f]() {
+    try {
+      f(*unit->_laser);
+    } catch (const std::exception &ex) {
+      Logger::instance().exception(ex)
+          << "Laser command failed on " << unit->_device << "." << std::endl;
+    }
+  });
+}
+
+void LaserGroup::select(std::size_t index) {
+  _selected = index;
+  for (std::size_t i = 0; i < _units.size(); i++) {
+    unit_t *unit = _units[i].get();
+    bool on = i == index;
+    bool posted = post(i, [unit, on](OBISLaser &laser) {
+      if (!on) {
+        unit->_on = false;
+      }
+      laser.state(on ? OBISLaser::State::On : OBISLaser::State::Off);
+      if (on) {
+        unit->_on = true;
+      }
+    });
+    if (!posted) {
+      Logger::instance().warning()
+          << "Laser " << unit->_device << " is behind, could not switch it."
+          << std::endl;
+    }
+  }
+}
+
+std::size_t LaserGroup::selected() { return _selected; }
+
+int LaserGroup::emitting() {
+  int on = -1;
+  for (std::size_t i = 0; i < _units.size(); i++) {
+    if (_units[i]->_on) {
+      if (on >= 0) {
+        return -1;
+      }
+      on = i;
+    }
+  }
+  return on;
+}
+
+void LaserGroup::start_monitors(std::chrono::milliseconds period,
+                                fault_callback_t callback) {
+  for (std::size_t i = 0; i < _units.size(); i++) {
+    unit_t &unit = *_units[i];
+    unit._monitor.reset(new LaserMonitor(*unit._laser, period));
+    if (callback) {
+      unit._monitor->set_fault_callback(
+          [callback, i](FaultCode fault,
+                        const LaserMonitor::snapshot_t &snapshot) {
+            callback(i, fault, snapshot);
+          });
+    }
+    unit._monitor->start();
+  }
+}
+
+void LaserGroup::stop_monitors() {
+  for (auto &unit : _units) {
+    if (unit->_monitor) {
+      unit->_monitor->stop();
+    }
+  }
+}
+
+LaserMonitor &LaserGroup::monitor(std::size_t index) {
+  return *_units.at(index)->_monitor;
+}
+
+FaultCode LaserGroup::fault() {
+  FaultCode fault = 0;
+  for (auto &unit : _units) {
+    if (unit->_monitor) {
+      fault |= unit->_monitor->fault();
+    }
+  }
+  return fault;
+}
+
+unsigned long LaserGroup::errors() {
+  unsigned long errors = 0;
+  for (auto &unit : _units) {
+    if (unit->_monitor) {
+      errors += unit->_monitor->errors();
+    }
+  }
+  return errors;
+}
@@ -0,0 +1,97 @@
+#include "laser_monitor.h"
+
+#include "logger.h"
+
+using namespace hapi;
+
+// set in LaserMonitor::_middle when the middle slot holds a new reading
+#define HAPI_SNAPSHOT_FRESH 4u
+#define HAPI_SNAPSHOT_INDEX 3u
+
+LaserMonitor::LaserMonitor(OBISLaser &laser, std::chrono::milliseconds period)
+    : _laser(laser), _period(period) {
+  for (auto &slot : _slots) {
+    slot = snapshot_t{};
+    slot._valid = false;
+  }
+}
+
+LaserMonitor::~LaserMonitor() { stop(); }
+
+void LaserMonitor::set_fault_callback(fault_callback_t callback) {
+  _callback = callback;
+}
+
+void LaserMonitor::start() {
+  if (_thread.joinable()) {
+    return;
+  }
+  _stop = false;
+  _thread = std::thread(&LaserMonitor::run, this);
+}
+
+void LaserMonitor::stop() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _wake.notify_all();
+  if (_thread.joinable()) {
+    _thread.join();
+  }
+}
+
+void LaserMonitor::run() {
+  Logger &log = Logger::instance();
+  unsigned long sequence = 0;
+  FaultCode last_fault = 0;
+  auto next = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_stop) {
+    lock.unlock();
+    try {
+      snapshot_t s;
+      s._telemetry = _laser.telemetry();
+      s._valid = true;
+      s._sequence = ++sequence;
+      s._time = std::chrono::steady_clock::now();
+      _fault = s._telemetry._fault;
+      publish(s);
+      if (s._telemetry._fault != last_fault) {
+        last_fault = s._telemetry._fault;
+        if (_callback) {
+          _callback(last_fault, s);
+        }
+      }
+    } catch (const SerialCancelled &ex) {
+      // shutting down
+    } catch (const std::exception &ex) {
+      _errors++;
+      log.exception(ex) << "Failed to read laser telemetry." << std::endl;
+    }
+    lock.lock();
+    // fixed rate, a slow poll shortens the next wait instead of delaying it
+    next += _period;
+    auto now = std::chrono::steady_clock::now();
+    if (next < now) {
+      next = now;
+    }
+    _wake.wait_until(lock, next, [this]() { return _stop; });
+  }
+}
+
+void LaserMonitor::publish(const snapshot_t &snapshot) {
+  _slots[_back] = snapshot;
+  _back = _middle.exchange(_back | HAPI_SNAPSHOT_FRESH) & HAPI_SNAPSHOT_INDEX;
+}
+
+const LaserMonitor::snapshot_t &LaserMonitor::snapshot() {
+  if (_middle.load() & HAPI_SNAPSHOT_FRESH) {
+    _front = _middle.exchange(_front) & HAPI_SNAPSHOT_INDEX;
+  }
+  return _slots[_front];
+}
+
+FaultCode LaserMonitor::fault() { return _fault; }
+
+unsigned long LaserMonitor::errors() { return _errors; }
@@ -1,67 +1,193 @@
 #include "logger.h"
 
-#include "routines/str_utils.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <stdexcept>
 
 using namespace hapi;
 
-Logger::Logger()
-    : _debug(nullptr),
-      _info(nullptr),
-      _warning(nullptr),
-      _error(nullptr),
-      _critical(nullptr),
-      _last(nullptr){};
+// characters a message can have, longer ones are cut short
+#define HAPI_LOG_RECORD_SIZE 512
+
+// records the ring buffer holds, a power of two
+#define HAPI_LOG_CAPACITY 1024
+
+// longest the background thread sleeps before looking for new records
+#define HAPI_LOG_PERIOD std::chrono::milliseconds(5)
+
+struct Logger::record_t {
+  LogLevel _level;
+  // without timestamp and level, see append()
+  bool _bare;
+  // the message didn't fit
+  bool _truncated;
+  std::streambuf *_out;
+  // ms since the epoch
+  int64_t _time;
+  std::size_t _length;
+  char _text[HAPI_LOG_RECORD_SIZE];
+};
+
+struct Logger::slot_t {
+  // the position the slot is filled at next, one more once it's filled
+  std::atomic<std::size_t> _sequence;
+  record_t _record;
+};
+
+// formats a thread's message straight into its record, std::endl or the next
+// message queues it
+class Logger::buffer_t : public std::streambuf {
+ public:
+  buffer_t(Logger &logger) : _logger(logger) {
+    _record._level = INFO;
+    _record._bare = false;
+    _record._truncated = false;
+    _record._out = nullptr;
+    reset();
+  }
+  ~buffer_t() { commit(); }
+
+  void begin(LogLevel level, std::streambuf *out, bool bare) {
+    commit();
+    _record._level = level;
+    _record._out = out;
+    _record._bare = bare;
+  }
+
+  void commit() {
+    _record._length = pptr() - pbase();
+    if (_record._length == 0 && !_record._truncated) {
+      return;
+    }
+    // a stream set to nothing takes no room in the ring buffer
+    if (_record._out != nullptr) {
+      _record._time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+      _logger.push(_record);
+    }
+    reset();
+  }
+
+  bool pending() { return pptr() != pbase() || _record._truncated; }
+
+  LogLevel level() { return _record._level; }
+
+ protected:
+  int overflow(int c) {
+    _record._truncated = true;
+    return traits_type::not_eof(c);
+  }
+
+  int sync() {
+    commit();
+    return 0;
+  }
+
+ private:
+  Logger &_logger;
+  record_t _record;
+
+  void reset() {
+    _record._truncated = false;
+    setp(_record._text, _record._text + HAPI_LOG_RECORD_SIZE);
+  }
+};
+
+struct Logger::stream_t {
+  stream_t(Logger &logger)
+      : _buffer(logger), _stream(&_buffer), _filtered(nullptr) {}
+
+  buffer_t _buffer;
+  std::ostream _stream;
+  // has no buffer, so everything streamed into it is skipped unformatted
+  std::ostream _filtered;
+  // the last message was below the level, so is what's appended to it
+  bool _skipping{false};
+};
+
+Logger::Logger() : _ring(new slot_t[HAPI_LOG_CAPACITY]) {
+  for (auto &out : _outs) {
+    out.store(nullptr);
+  }
+  for (std::size_t i = 0; i < HAPI_LOG_CAPACITY; i++) {
+    _ring[i]._sequence.store(i, std::memory_order_relaxed);
+  }
+  _thread = std::thread(&Logger::run, this);
+}
 
 Logger::~Logger() {
-  _debug.flush();
-  _info.flush();
-  _warning.flush();
-  _error.flush();
-  _critical.flush();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _wake.notify_one();
+  _thread.join();
 }
 
 void Logger::set_stream(std::ostream &out) {
-  _debug.rdbuf(out.rdbuf());
-  _info.rdbuf(out.rdbuf());
-  _warning.rdbuf(out.rdbuf());
-  _error.rdbuf(out.rdbuf());
-  _critical.rdbuf(out.rdbuf());
+  for (auto &o : _outs) {
+    o.store(out.rdbuf());
+  }
 }
 
 void Logger::set_streams(std::ostream &debug, std::ostream &info,
                          std::ostream &warn, std::ostream &error,
                          std::ostream &critical) {
-  _debug.rdbuf(debug.rdbuf());
-  _info.rdbuf(info.rdbuf());
-  _warning.rdbuf(warn.rdbuf());
-  _error.rdbuf(error.rdbuf());
-  _critical.rdbuf(critical.rdbuf());
+  _outs[DEBUG].store(debug.rdbuf());
+  _outs[INFO].store(info.rdbuf());
+  _outs[WARNING].store(warn.rdbuf());
+  _outs[ERROR].store(error.rdbuf());
+  _outs[CRITICAL].store(critical.rdbuf());
+}
+
+void Logger::set_drop_policy(DropPolicy policy) { _policy.store(policy); }
+
+void Logger::set_level(LogLevel level) { _level.store(level); }
+
+Logger::LogLevel Logger::level() { return (LogLevel)_level.load(); }
+
+Logger::LogLevel Logger::parse_level(std::string name) {
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  if (name == "debug") {
+    return DEBUG;
+  } else if (name == "info") {
+    return INFO;
+  } else if (name == "warning") {
+    return WARNING;
+  } else if (name == "error") {
+    return ERROR;
+  } else if (name == "critical") {
+    return CRITICAL;
+  }
+  throw std::invalid_argument("Unknown log level: " + name);
+}
+
+unsigned long Logger::dropped() { return _dropped.load(); }
+
+void Logger::flush() {
+  local()._buffer.commit();
+  std::size_t head = _head.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(_mutex);
+  _wake.notify_one();
+  _flushed.wait(lock, [&]() {
+    return _tail.load(std::memory_order_acquire) >= head;
+  });
 }
 
 std::ostream &Logger::log(Logger::LogLevel l) {
-  switch (l) {
-    case Logger::LogLevel::DEBUG:
-      _debug << str_time() << " | DEBUG    | ";
-      _last.rdbuf(_debug.rdbuf());
-      return _debug;
-    case Logger::LogLevel::INFO:
-      _info << str_time() << " | INFO     | ";
-      _last.rdbuf(_info.rdbuf());
-      return _info;
-    case Logger::LogLevel::WARNING:
-      _warning << str_time() << " | WARNING  | ";
-      _last.rdbuf(_warning.rdbuf());
-      return _warning;
-    case Logger::LogLevel::ERROR:
-      _error << str_time() << " | ERROR    | ";
-      _last.rdbuf(_error.rdbuf());
-      return _error;
-    case Logger::LogLevel::CRITICAL:
-      _critical << str_time() << " | CRITICAL | ";
-      _last.rdbuf(_critical.rdbuf());
-      return _critical;
-  }
-  return _last;
+  stream_t &s = local();
+  s._skipping = !enabled(l);
+  if (s._skipping) {
+    return s._filtered;
+  }
+  s._buffer.begin(l, _outs[l].load(std::memory_order_relaxed), false);
+  return s._stream;
 }
 
 std::ostream &Logger::debug() { return log(LogLevel::DEBUG); }
@@ -75,4 +201,177 @@ std::ostream &Logger::exception(const std::exception &ex) {
   return log(LogLevel::ERROR);
 }
 
-std::ostream &Logger::append() { return _last; }
+std::ostream &Logger::append() {
+  stream_t &s = local();
+  if (s._skipping) {
+    return s._filtered;
+  }
+  // continues the message being written, or the last one on a line of its
+  // own
+  if (!s._buffer.pending()) {
+    LogLevel l = s._buffer.level();
+    s._buffer.begin(l, _outs[l].load(std::memory_order_relaxed), true);
+  }
+  return s._stream;
+}
+
+Logger::stream_t &Logger::local() {
+  static thread_local stream_t stream(*this);
+  return stream;
+}
+
+bool Logger::push(const record_t &record) {
+  std::size_t pos = _head.load(std::memory_order_relaxed);
+  while (true) {
+    slot_t &slot = _ring[pos & (HAPI_LOG_CAPACITY - 1)];
+    std::size_t sequence = slot._sequence.load(std::memory_order_acquire);
+    std::ptrdiff_t diff = (std::ptrdiff_t)(sequence - pos);
+    if (diff == 0) {
+      // claim the slot, another thread may have been faster
+      if (_head.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed)) {
+        record_t &r = slot._record;
+        r._level = record._level;
+        r._bare = record._bare;
+        r._truncated = record._truncated;
+        r._out = record._out;
+        r._time = record._time;
+        r._length = record._length;
+        std::memcpy(r._text, record._text, record._length);
+        slot._sequence.store(pos + 1, std::memory_order_release);
+        if (record._level >= ERROR) {
+          _wake.notify_one();
+        }
+        return true;
+      }
+    } else if (diff < 0) {
+      // full, the background thread hasn't written this slot out yet
+      int policy = _policy.load(std::memory_order_relaxed);
+      if (policy == DROP || (policy == DROP_INFO && record._level <= INFO)) {
+        _dropped++;
+        return false;
+      }
+      _wake.notify_one();
+      std::this_thread::yield();
+      pos = _head.load(std::memory_order_relaxed);
+    } else {
+      pos = _head.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+void Logger::run() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (!_stop) {
+    lock.unlock();
+    bool written = drain();
+    lock.lock();
+    if (!written && !_stop) {
+      _wake.wait_for(lock, HAPI_LOG_PERIOD);
+    }
+  }
+  lock.unlock();
+  // what was logged while stopping
+  drain();
+}
+
+bool Logger::drain() {
+  std::streambuf *touched[CRITICAL + 2] = {nullptr};
+  std::size_t count = 0;
+  auto touch = [&](std::streambuf *out) {
+    for (std::size_t i = 0; i < count; i++) {
+      if (touched[i] == out) {
+        return;
+      }
+    }
+    touched[count++] = out;
+  };
+
+  std::size_t tail = _tail.load(std::memory_order_relaxed);
+  bool written = false;
+  while (true) {
+    slot_t &slot = _ring[tail & (HAPI_LOG_CAPACITY - 1)];
+    if (slot._sequence.load(std::memory_order_acquire) != tail + 1) {
+      break;
+    }
+    write(slot._record);
+    touch(slot._record._out);
+    slot._sequence.store(tail + HAPI_LOG_CAPACITY, std::memory_order_release);
+    tail++;
+    _tail.store(tail, std::memory_order_release);
+    written = true;
+  }
+
+  unsigned long dropped = _dropped.load();
+  std::streambuf *out = _outs[WARNING].load();
+  if (dropped != _dropped_reported && out != nullptr) {
+    record_t record;
+    record._level = WARNING;
+    record._bare = false;
+    record._truncated = false;
+    record._out = out;
+    record._time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+    record._length = std::snprintf(
+        record._text, HAPI_LOG_RECORD_SIZE, "%lu log message(s) dropped.\n",
+        dropped - _dropped_reported);
+    write(record);
+    touch(out);
+    _dropped_reported = dropped;
+  }
+
+  for (std::size_t i = 0; i < count; i++) {
+    touched[i]->pubsync();
+  }
+  if (written) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _flushed.notify_all();
+  }
+  return written;
+}
+
+void Logger::write(const record_t &record) {
+  static const char *const levels[] = {" | DEBUG    | ", " | INFO     | ",
+                                       " | WARNING  | ", " | ERROR    | ",
+                                       " | CRITICAL | "};
+  std::streambuf *out = record._out;
+  if (!record._bare) {
+    const char *time = stamp(record._time);
+    out->sputn(time, std::strlen(time));
+    out->sputn(levels[record._level], std::strlen(levels[record._level]));
+  }
+  out->sputn(record._text, record._length);
+  if (record._truncated) {
+    out->sputn("...\n", 4);
+  } else if (record._length == 0 || record._text[record._length - 1] != '\n') {
+    out->sputc('\n');
+  }
+}
+
+const char *Logger::stamp(int64_t ms) {
+  // most records come in the same second as the one before, often the same
+  // millisecond
+  if (ms == _stamp_ms) {
+    return _stamp;
+  }
+  int64_t s = ms / 1000;
+  if (s != _stamp_s) {
+    std::time_t t = s;
+    std::tm tm;
+    gmtime_r(&t, &tm);
+    if (!std::strftime(_stamp, sizeof(_stamp), "%Y_%m_%d-%H_%M_%S", &tm)) {
+      std::strcpy(_stamp, "unknown");
+    }
+    _stamp_s = s;
+  }
+  std::size_t length = std::strlen(_stamp);
+  // the seconds stay, only the milliseconds change
+  if (length > 4 && _stamp[length - 4] == '.') {
+    length -= 4;
+  }
+  std::snprintf(_stamp + length, sizeof(_stamp) - length, ".%03d",
+                (int)(ms % 1000));
+  _stamp_ms = ms;
+  return _stamp;
+}
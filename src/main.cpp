@@ -2,10 +2,13 @@
 #include <array>
 #include <atomic>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <exception>
 #include <fstream>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -13,6 +16,7 @@
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <unistd.h>
 
@@ -20,28 +24,63 @@
 
 #include "argparse.h"
 #include "board.h"
+#include "camera_group.h"
 #include "config.h"
+#include "laser_group.h"
 #include "logger.h"
 #include "obis.h"
+#include "pmt_map.h"
 #include "routines/acquisition.h"
 #include "routines/get_config.h"
 #include "routines/os_utils.h"
 #include "routines/pmt_calibrate.h"
 #include "routines/str_utils.h"
+#include "task_graph.h"
 #include "usb_camera.h"
 
 using namespace hapi;
 
+// how long to wait for Spinnaker to see a camera, e.g. right after power on
+#define HAPI_CAMERA_WAIT std::chrono::seconds(5)
+#define HAPI_CAMERA_REFRESH std::chrono::milliseconds(200)
+
+#define HAPI_CAMERA_EXPOSURE 20000
+// where the hash of the settings stored on each camera is kept
+#define HAPI_CAMERA_HASH_DIR "/etc/hapi/"
+
 void initialize_board(Config &config, HAPIMode mode);
+// sets the camera up, from its stored user set when hapi.conf hasn't changed
 void initialize_camera(std::shared_ptr<USBCamera> &camera, Config &config);
+// identifies the camera settings in hapi.conf
+std::string camera_settings_hash(Config &config);
+// the camera_pixel_format config key as a Spinnaker pixel format
+Spinnaker::PixelFormatEnums camera_pixel_format(Config &config);
+// the cameras Spinnaker sees, waiting a little for them to show up
+Spinnaker::CameraList find_cameras(Spinnaker::SystemPtr &system);
+// the configured cameras, or every camera found when none are configured
+std::vector<std::shared_ptr<USBCamera>> select_cameras(
+    Spinnaker::CameraList &clist, Config &config);
+// adds the selected cameras to the group and initializes them in parallel
+void initialize_cameras(CameraGroup &cameras, Spinnaker::CameraList &clist,
+                        Config &config);
+// runs every camera free for the given time at once and reports the frame
+// rate they keep up, to tell a saturated usb bus from a slow pipeline
+void probe_cameras(CameraGroup &cameras, std::chrono::milliseconds duration);
+// the devices matching the configured usb ids, in the order to try them
+std::vector<std::string> laser_devices(Config &config);
+// opens the configured number of lasers, each on its own thread
+void open_lasers(LaserGroup &lasers, Config &config);
+// initializes every laser in parallel and prints their info
+void setup_lasers(LaserGroup &lasers, HAPIMode mode);
 void initialize_laser(OBISLaser &laser, HAPIMode mode);
+void print_laser(OBISLaser &laser);
 // resets board and frees spinnaker system
 void cleanup(Spinnaker::CameraList &clist, Spinnaker::SystemPtr &system,
-             std::shared_ptr<USBCamera> &camera, HAPIMode mode,
-             OBISLaser &laser);
+             CameraGroup &cameras, HAPIMode mode, LaserGroup &lasers);
 
 int main(int argc, char *argv[]) {
   std::string start_time = str_time();
+  auto launched = std::chrono::steady_clock::now();
 
   Logger &log = Logger::instance();
   log.set_stream(std::cout);
@@ -68,6 +107,14 @@ int main(int argc, char *argv[]) {
                       "--calibrate [interval ms] Runs the PMT calibration code "
                       "with the given test interval.",
                       false);
+  parser.add_argument("-r", "--rate",
+                      "--rate [Hz] Calibrates by measuring the false trigger "
+                      "rate, aiming for the given rate.",
+                      false);
+  parser.add_argument("-l", "--log-level",
+                      "--log-level [level] Lowest level logged (debug, info, "
+                      "warning, error, critical), overrides hapi.conf.",
+                      false);
   try {
     parser.parse(argc, argv);
   } catch (const ArgumentParser::ArgumentNotFound &ex) {
@@ -78,6 +125,18 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
+  // applies from here on, before hapi.conf is read
+  std::string log_level;
+  if (parser.exists("l")) {
+    log_level = parser.get<std::string>("l");
+    try {
+      log.set_level(Logger::parse_level(log_level));
+    } catch (const std::invalid_argument &ex) {
+      log.exception(ex) << "Exiting (-1)..." << std::endl;
+      return -1;
+    }
+  }
+
   std::string mode_str = "trigger";
   if (parser.exists("m")) {
     mode_str = parser.get<std::string>("m");
@@ -102,205 +161,551 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
-  if (!set_usbfs_mb()) {
-    log.critical() << "Failed to set usbfs memory." << std::endl;
-    log.critical() << "Exiting (-1)..." << std::endl;
-    return -1;
+  // the calibration options are checked before any hardware is touched
+  bool calibrate = parser.exists("c");
+  bool rate = parser.exists("r");
+  long long calibrate_ms = rate ? 1000 : 5000;
+  double target_rate = 0;
+  if (calibrate) {
+    // without a value the default interval is used
+    std::string c = parser.get<std::string>("c");
+    if (!c.empty()) {
+      std::istringstream in(c);
+      if (!(in >> calibrate_ms) || !(in >> std::ws).eof() ||
+          calibrate_ms <= 0) {
+        log.critical() << "Calibration interval must be a positive number of "
+                       << "milliseconds, got: " << c << std::endl;
+        log.critical() << "Exiting (-1)..." << std::endl;
+        return -1;
+      }
+    }
+  }
+  if (calibrate && rate) {
+    std::string r = parser.get<std::string>("r");
+    std::istringstream in(r);
+    if (!(in >> target_rate) || !(in >> std::ws).eof() || target_rate <= 0) {
+      log.critical() << "False trigger rate must be a positive number of Hz, "
+                     << "got: " << r << std::endl;
+      log.critical() << "Exiting (-1)..." << std::endl;
+      return -1;
+    }
   }
 
   Config config = get_config();
+  if (!log_level.empty()) {
+    config["log_level"] = log_level;
+  }
+  configure_logger(config);
   std::string image_type = get_image_type(config);
   std::filesystem::path out_dir = get_out_dir(start_time, config);
+  // the real-time cpu is kept for the control thread, before the startup
+  // threads are created
+  set_non_realtime(config.get<int>("rt_cpu"));
 
+  // the board, lasers and cameras don't depend on each other and come up at
+  // the same time, only the cameras have to wait for the usbfs memory
+  LaserGroup lasers;
+  Spinnaker::SystemPtr system;
+  Spinnaker::CameraList clist;
+  CameraGroup cameras;
+  TaskGraph startup;
+  startup.add("usbfs", {}, []() {
+    if (!set_usbfs_mb()) {
+      throw std::runtime_error("Failed to set usbfs memory.");
+    }
+  });
+  startup.add("board", {}, [&]() { initialize_board(config, mode); });
+  // the lasers start off, so the pmt can be calibrated before they are turned
+  // on
+  startup.add("lasers", {}, [&]() { open_lasers(lasers, config); });
+  if (!calibrate) {
+    startup.add("laser setup", {"lasers"},
+                [&]() { setup_lasers(lasers, mode); });
+  }
+  if (use_camera(mode)) {
+    startup.add("spinnaker", {"usbfs"}, [&]() {
+      HAPI_INFO(log) << "Initializing Spinnaker system." << std::endl;
+      system = Spinnaker::System::GetInstance();
+      clist = find_cameras(system);
+    });
+    startup.add("cameras", {"spinnaker"},
+                [&]() { initialize_cameras(cameras, clist, config); });
+    std::chrono::milliseconds probe(config.get<unsigned int>("camera_probe"));
+    if (probe.count() > 0) {
+      startup.add("camera probe", {"cameras"},
+                  [&cameras, probe]() { probe_cameras(cameras, probe); });
+    }
+  }
   try {
-    initialize_board(config, mode);
+    startup.run();
   } catch (const std::exception &ex) {
-    log.exception(ex) << "Failed to initialize the HAPI-E board." << std::endl;
+    log.exception(ex) << "Startup failed." << std::endl;
+    cleanup(clist, system, cameras, mode, lasers);
     log.critical() << "Exiting (-1)..." << std::endl;
     return -1;
   }
 
-  if (parser.exists("c")) {
+  if (calibrate) {
+    PMTMap map;
+    map.load("/etc/hapi/pmt.map");
     try {
-      long long ms = 5000;
-      try {
-        ms = parser.get<long long>("c");
-      } catch (const std::exception &ex) {
-        if (parser.get<std::string>("c").size() > 0) {
-          log.exception(ex)
-              << "Failed to get interval time. Defaulting to 5000 ms."
-              << std::endl;
-        }
+      // the map is kept against the first laser's temperature
+      map.set_temperature(lasers.laser(0).baseplate_temp());
+      HAPI_INFO(log) << "Laser baseplate temperature: " << map.temperature()
+                     << " C" << std::endl;
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Failed to read the laser temperature."
+                        << std::endl;
+    }
+    try {
+      HAPI_INFO(log) << "Calibrating with interval: " << calibrate_ms
+                     << " milliseconds." << std::endl;
+      pmt_calibration_t cal;
+      if (rate) {
+        cal = pmt_calibrate_rate(target_rate, 0.95, calibrate_ms, map);
+        HAPI_INFO(log) << "Predicted false trigger rate: " << cal._rate
+                       << " Hz (upper bound " << cal._rate_upper << " Hz)"
+                       << std::endl;
+      } else {
+        cal = pmt_calibrate(calibrate_ms, 0.95, map);
       }
-      log.info() << "Calibrating with interval: " << ms << " milliseconds."
-                 << std::endl;
-      auto vals = pmt_calibrate(ms);
-      auto gain = vals.first;
-      auto threshold = vals.second;
-      log.info() << "Calibration success!" << std::endl;
+      unsigned int gain = cal._gain;
+      unsigned int threshold = cal._threshold;
+      HAPI_INFO(log) << "Calibration success!" << std::endl;
+      HAPI_INFO(log) << "Probes: " << cal._probes << std::endl;
+      HAPI_INFO(log) << "Calibration time: " << cal._duration.count() << " ms"
+                     << std::endl;
       Board &board = Board::instance();
       board.set_pmt_gain(gain);
       board.set_pmt_threshold(threshold);
-      log.info() << std::hex << "Gain:      " << gain << std::endl;
-      log.info() << std::hex << "Threshold: " << threshold << std::endl;
+      HAPI_INFO(log) << std::hex << "Gain:      " << gain << std::endl;
+      HAPI_INFO(log) << std::hex << "Threshold: " << threshold << std::dec
+                     << std::endl;
     } catch (const PMTCalibrationError &ex) {
+      map.save("/etc/hapi/pmt.map");
       log.exception(ex) << "Failed to calibrate the PMT." << std::endl;
+      cleanup(clist, system, cameras, mode, lasers);
       log.critical() << "Exiting (-1)..." << std::endl;
       return -1;
     }
+    HAPI_INFO(log) << "Saving PMT noise map to /etc/hapi/pmt.map" << std::endl;
+    map.save("/etc/hapi/pmt.map");
   }
 
-  log.info() << "Initializing laser." << std::endl;
-  std::string device = "/dev/" + hapi::exec("ls /dev | grep ttyACM");
-  OBISLaser laser(device);
-  try {
-    initialize_laser(laser, mode);
-  } catch (const std::exception &ex) {
-    log.exception(ex) << "Failed to initialize the laser." << std::endl;
-    log.critical() << "Exiting (-1)..." << std::endl;
-    return -1;
-  }
-
-  Spinnaker::SystemPtr system;
-  Spinnaker::CameraList clist;
-  std::shared_ptr<USBCamera> camera;
-  if (use_camera(mode)) {
-    log.info() << "Initializing Spinnaker system." << std::endl;
-    system = Spinnaker::System::GetInstance();
-    log.info() << "Getting list of cameras." << std::endl;
-    clist = system->GetCameras();
-
-    if (clist.GetSize() == 0) {
-      // attempt to refresh cameras 5 times if none detected initially
-      log.error() << "No cameras detected." << std::endl;
-      log.info() << "Attempting to refresh camera list." << std::endl;
-      for (unsigned int i = 0; i < 5 && clist.GetSize() == 0; i++) {
-        log.info() << "Refreshing..." << std::endl;
-        system->UpdateCameras();
-        clist = system->GetCameras();
-        std::this_thread::sleep_for(std::chrono::seconds(1));
-      }
-    }
-
-    // if no cameras detected exit
-    if (clist.GetSize() == 0) {
-      log.critical() << "No cameras detected." << std::endl;
-      cleanup(clist, system, camera, mode, laser);
-      log.critical() << "Exiting (-1)..." << std::endl;
-      return -1;
-    }
-    log.info() << "Number of cameras detected " << clist.GetSize() << "."
-               << std::endl;
-
-    // initialize the camera
-    log.info() << "Getting camera object." << std::endl;
-    camera = std::make_shared<USBCamera>(clist.GetByIndex(0));
-
+  if (calibrate) {
     try {
-      initialize_camera(camera, config);
+      setup_lasers(lasers, mode);
     } catch (const std::exception &ex) {
-      log.exception(ex) << std::endl;
-      cleanup(clist, system, camera, mode, laser);
+      log.exception(ex) << "Failed to initialize the laser." << std::endl;
+      cleanup(clist, system, cameras, mode, lasers);
       log.critical() << "Exiting (-1)..." << std::endl;
       return -1;
     }
   }
+  HAPI_INFO(log) << "Ready "
+                 << std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - launched)
+                        .count()
+                 << " ms after launch." << std::endl;
 
   std::chrono::milliseconds interval_time(config.get<unsigned int>("interval"));
+  // aligning wants feedback as fast as the board can take images
+  if (mode == HAPIMode::ALIGN) {
+    interval_time =
+        std::chrono::milliseconds(config.get<unsigned int>("preview_interval"));
+  }
 
   try {
-    acquisition_loop(camera, laser, out_dir, image_type, interval_time, mode);
+    acquisition_loop(cameras, lasers, out_dir, image_type, interval_time, mode,
+                     config);
   } catch (const std::exception &ex) {
     log.exception(ex) << std::endl;
-    cleanup(clist, system, camera, mode, laser);
+    cleanup(clist, system, cameras, mode, lasers);
     log.critical() << "Exiting (-1)..." << std::endl;
     return -1;
   }
 
-  cleanup(clist, system, camera, mode, laser);
-  log.info() << "Exiting (0)..." << std::endl;
+  cleanup(clist, system, cameras, mode, lasers);
+  HAPI_INFO(log) << "Exiting (0)..." << std::endl;
   return 0;
 }
 
 void initialize_board(Config &config, HAPIMode mode) {
   Logger &log = Logger::instance();
   // initialize the board
-  log.info() << "Initializing the HAPI-E board." << std::endl;
+  HAPI_INFO(log) << "Initializing the HAPI-E board." << std::endl;
   Board &board = Board::instance();
-  log.info() << "Setting delay, exposure, and pulse width." << std::endl;
+  HAPI_INFO(log) << "Setting delay, exposure, and pulse width." << std::endl;
   board.set_delay(config.get<unsigned int>("delay"));
   board.set_exp(config.get<unsigned int>("exp"));
   board.set_pulse(config.get<unsigned int>("pulse"));
+  board.set_trigger_width(
+      std::chrono::microseconds(config.get<unsigned int>("trigger_width")));
 
-  log.info() << "Setting PMT gain and threshold." << std::endl;
+  HAPI_INFO(log) << "Setting PMT gain and threshold." << std::endl;
   board.set_pmt_gain(config.get<unsigned int>("pmt_gain"));
   board.set_pmt_threshold(config.get<unsigned int>("pmt_threshold"));
 
   if (mode == HAPIMode::INTERVAL) {
     board.set_trigger_source(Board::TriggerSource::PI);
-    log.info() << "Using PI as trigger source." << std::endl;
+    HAPI_INFO(log) << "Using PI as trigger source." << std::endl;
   } else {
     board.set_trigger_source(Board::TriggerSource::PMT);
-    log.info() << "Using PMT as trigger source." << std::endl;
+    HAPI_INFO(log) << "Using PMT as trigger source." << std::endl;
   }
 
-  log.info() << "Resetting board." << std::endl;
+  HAPI_INFO(log) << "Resetting board." << std::endl;
   board.reset();
 }
 
 void initialize_camera(std::shared_ptr<USBCamera> &camera, Config &config) {
   Logger &log = Logger::instance();
-  log.info() << "Initializing camera." << std::endl;
+  auto start = std::chrono::steady_clock::now();
+  std::string serial = camera->serial();
+  HAPI_INFO(log) << "Initializing camera " << serial << "." << std::endl;
   camera->init();
   // wait until camera is initialized
   while (!camera->is_initialized()) {
     std::this_thread::yield();
   }
 
-  log.info() << "Disabling auto exposure." << std::endl;
-  camera->set_auto_exposure(Spinnaker::ExposureAutoEnums::ExposureAuto_Off);
-
-  log.info() << "Setting exposure mode to timed." << std::endl;
-  camera->set_exposure_mode(Spinnaker::ExposureModeEnums::ExposureMode_Timed);
-
-  log.info() << "Setting camera exposure time to 20,000 microseconds."
-             << std::endl;
-  camera->set_exposure(20000);
-
-  log.info() << "Disabling auto gain." << std::endl;
-  camera->set_auto_gain(Spinnaker::GainAutoEnums::GainAuto_Off);
-
   float gain = config.get<float>("camera_gain");  // 1.0 <= gain <= 47.994267
   if (gain < 1.0f || gain > 47.994267f) {
     throw std::out_of_range("Gain must be between 1.0 and 47.994267");
   }
+  Spinnaker::PixelFormatEnums pixel_format = camera_pixel_format(config);
+  USBCamera::TriggerType trigger_type = USBCamera::TriggerType::SOFTWARE;
+  if (config["camera_trigger"] == "1") {
+    trigger_type = USBCamera::TriggerType::HARDWARE;
+  }
+
+  // the settings are kept in a user set on the camera and only written node
+  // by node when hapi.conf changed since they were stored
+  std::string hash = camera_settings_hash(config);
+  std::filesystem::path hash_path =
+      HAPI_CAMERA_HASH_DIR "camera_" + serial + ".userset";
+  std::string stored;
+  std::ifstream(hash_path.string()) >> stored;
+  bool cached = false;
+  if (stored == hash) {
+    try {
+      camera->load_user_set();
+      camera->set_trigger_type(trigger_type);
+      cached = true;
+      HAPI_INFO(log) << "Loaded the stored settings of camera " << serial << "."
+                     << std::endl;
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Failed to load the stored camera settings."
+                        << std::endl;
+    }
+  }
 
-  log.info() << "Setting gain to " << gain << " dB." << std::endl;
-  camera->set_gain(gain);
+  if (!cached) {
+    HAPI_INFO(log) << "Disabling auto exposure." << std::endl;
+    camera->set_auto_exposure(Spinnaker::ExposureAutoEnums::ExposureAuto_Off);
 
-  log.info() << "Camera info:" << std::endl;
-  try {
-    for (auto i : camera->get_device_info()) {
-      log.info() << "    " << i.first << ": " << i.second << std::endl;
+    HAPI_INFO(log) << "Setting exposure mode to timed." << std::endl;
+    camera->set_exposure_mode(
+        Spinnaker::ExposureModeEnums::ExposureMode_Timed);
+
+    HAPI_INFO(log) << "Setting camera exposure time to " << HAPI_CAMERA_EXPOSURE
+                   << " microseconds." << std::endl;
+    camera->set_exposure(HAPI_CAMERA_EXPOSURE);
+
+    HAPI_INFO(log) << "Disabling auto gain." << std::endl;
+    camera->set_auto_gain(Spinnaker::GainAutoEnums::GainAuto_Off);
+
+    HAPI_INFO(log) << "Setting gain to " << gain << " dB." << std::endl;
+    camera->set_gain(gain);
+
+    HAPI_INFO(log) << "Setting pixel format to "
+                   << config["camera_pixel_format"] << "." << std::endl;
+    camera->set_pixel_format(pixel_format);
+
+    HAPI_INFO(log) << "Camera info:" << std::endl;
+    try {
+      for (auto i : camera->get_device_info()) {
+        HAPI_INFO(log) << "    " << i.first << ": " << i.second << std::endl;
+      }
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Failed to print device info." << std::endl;
+    }
+
+    // configure trigger
+    HAPI_INFO(log) << "Configuring trigger." << std::endl;
+    if (trigger_type == USBCamera::TriggerType::HARDWARE) {
+      HAPI_INFO(log) << "Camera using hardware trigger." << std::endl;
+    } else {
+      HAPI_INFO(log) << "Camera using software trigger." << std::endl;
+    }
+    camera->configure_trigger(trigger_type);
+
+    HAPI_INFO(log) << "Setting acquisition mode to continuous." << std::endl;
+    camera->set_acquisition_mode(
+        Spinnaker::AcquisitionModeEnums::AcquisitionMode_Continuous);
+
+    // several cameras on one bus have to share it
+    unsigned int limit = config.get<unsigned int>("camera_throughput_limit");
+    HAPI_INFO(log) << "Setting usb throughput limit to "
+                   << (limit > 0 ? std::to_string(limit) + " bytes/s" : "off")
+                   << "." << std::endl;
+    camera->set_throughput_limit(limit);
+
+    // only settings the camera actually took are stored
+    if (std::abs(camera->get_gain() - gain) > 0.01 ||
+        std::abs(camera->get_exposure() - HAPI_CAMERA_EXPOSURE) >
+            HAPI_CAMERA_EXPOSURE * 0.01) {
+      throw std::runtime_error("Camera " + serial +
+                               " did not take its settings.");
+    }
+    try {
+      camera->save_user_set();
+      std::ofstream out(hash_path.string());
+      out << hash << std::endl;
+      HAPI_INFO(log) << "Stored the settings of camera " << serial << "."
+                     << std::endl;
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Failed to store the camera settings."
+                        << std::endl;
     }
+  }
+  try {
+    USBCamera::link_t link = camera->link();
+    HAPI_INFO(log) << "Camera " << serial << " usb link: "
+                   << link._speed / 1000000.0 << " MB/s, limit "
+                   << link._throughput_limit / 1000000.0 << " MB/s, using "
+                   << link._throughput / 1000000.0 << " MB/s for up to "
+                   << link._resulting_fps << " fps." << std::endl;
   } catch (const std::exception &ex) {
-    log.exception(ex) << "Failed to print device info." << std::endl;
+    log.exception(ex) << "Failed to read the usb link." << std::endl;
   }
+  HAPI_INFO(log) << "Camera " << serial << " ready in "
+                 << std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - start)
+                        .count()
+                 << " ms" << (cached ? " from its stored settings." : ".")
+                 << std::endl;
+}
 
-  // configure trigger
-  log.info() << "Configuring trigger." << std::endl;
-  USBCamera::TriggerType trigger_type = USBCamera::TriggerType::SOFTWARE;
-  if (config["camera_trigger"] == "1") {
-    trigger_type = USBCamera::TriggerType::HARDWARE;
-    log.info() << "Camera using hardware trigger." << std::endl;
-  } else {
-    log.info() << "Camera using software trigger." << std::endl;
+std::string camera_settings_hash(Config &config) {
+  // everything initialize_camera writes, so any change is written out again
+  std::ostringstream settings;
+  settings << "exposure_auto=off;exposure_mode=timed;exposure="
+           << HAPI_CAMERA_EXPOSURE << ";gain_auto=off;gain="
+           << config["camera_gain"] << ";trigger=" << config["camera_trigger"]
+           << ";acquisition_mode=continuous;throughput_limit="
+           << config["camera_throughput_limit"]
+           << ";pixel_format=" << config["camera_pixel_format"];
+  std::ostringstream hash;
+  hash << std::hex << std::setfill('0') << std::setw(16)
+       << fnv1a(settings.str());
+  return hash.str();
+}
+
+Spinnaker::PixelFormatEnums camera_pixel_format(Config &config) {
+  std::string format = config["camera_pixel_format"];
+  lower(format);
+  if (format == "mono8") {
+    return Spinnaker::PixelFormat_Mono8;
+  } else if (format == "mono12p") {
+    return Spinnaker::PixelFormat_Mono12p;
+  } else if (format == "mono16") {
+    return Spinnaker::PixelFormat_Mono16;
+  }
+  throw std::invalid_argument("Unsupported camera pixel format: " +
+                              config["camera_pixel_format"]);
+}
+
+Spinnaker::CameraList find_cameras(Spinnaker::SystemPtr &system) {
+  Logger &log = Logger::instance();
+  HAPI_INFO(log) << "Getting list of cameras." << std::endl;
+  Spinnaker::CameraList clist = system->GetCameras();
+  // a camera still enumerating shows up within a few refreshes
+  auto end = std::chrono::steady_clock::now() + HAPI_CAMERA_WAIT;
+  if (clist.GetSize() == 0) {
+    HAPI_INFO(log) << "No cameras detected yet, refreshing camera list."
+                   << std::endl;
+  }
+  while (clist.GetSize() == 0 && running &&
+         std::chrono::steady_clock::now() < end) {
+    std::this_thread::sleep_for(HAPI_CAMERA_REFRESH);
+    system->UpdateCameras();
+    clist = system->GetCameras();
+  }
+  if (clist.GetSize() == 0) {
+    throw std::runtime_error("No cameras detected.");
+  }
+  HAPI_INFO(log) << "Number of cameras detected " << clist.GetSize() << "."
+                 << std::endl;
+  return clist;
+}
+
+void initialize_cameras(CameraGroup &cameras, Spinnaker::CameraList &clist,
+                        Config &config) {
+  Logger &log = Logger::instance();
+  HAPI_INFO(log) << "Getting camera objects." << std::endl;
+  std::vector<std::shared_ptr<USBCamera>> selected =
+      select_cameras(clist, config);
+  for (auto &camera : selected) {
+    cameras.add(camera);
+  }
+  if (cameras.size() == 0) {
+    throw std::runtime_error("None of the configured cameras found.");
+  }
+  // every camera has its own node maps, they can be set up at once
+  std::vector<std::future<void>> done;
+  for (auto camera : selected) {
+    done.push_back(std::async(std::launch::async, [camera, &config]() mutable {
+      initialize_camera(camera, config);
+    }));
+  }
+  std::exception_ptr error;
+  for (auto &d : done) {
+    try {
+      d.get();
+    } catch (...) {
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  HAPI_INFO(log) << "Using " << cameras.size() << " camera(s)." << std::endl;
+}
+
+void probe_cameras(CameraGroup &cameras, std::chrono::milliseconds duration) {
+  Logger &log = Logger::instance();
+  HAPI_INFO(log) << "Probing the frame rate of " << cameras.size()
+                 << " camera(s) for " << duration.count() << " ms."
+                 << std::endl;
+  std::vector<std::future<USBCamera::probe_t>> probes;
+  for (std::size_t i = 0; i < cameras.size(); i++) {
+    USBCamera *camera = &cameras.camera(i);
+    probes.push_back(std::async(std::launch::async, [camera, duration]() {
+      return camera->probe(duration);
+    }));
+  }
+  for (std::size_t i = 0; i < cameras.size(); i++) {
+    try {
+      USBCamera::probe_t probe = probes[i].get();
+      double expected = cameras.camera(i).link()._resulting_fps;
+      HAPI_INFO(log) << "Camera " << cameras.serial(i) << ": " << probe._fps
+                     << " fps sustained (" << probe._bytes_per_s / 1000000.0
+                     << " MB/s, " << probe._incomplete << " of "
+                     << probe._frames << " incomplete), the camera expects "
+                     << expected
+                     << " fps." << std::endl;
+      // the camera could send more than arrived, the link or host is short
+      if (probe._fps < expected * 0.95 || probe._incomplete > 0) {
+        log.warning() << "Camera " << cameras.serial(i)
+                      << " is limited by the usb link." << std::endl;
+      }
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Failed to probe camera " << cameras.serial(i)
+                        << "." << std::endl;
+    }
+  }
+}
+
+std::vector<std::shared_ptr<USBCamera>> select_cameras(
+    Spinnaker::CameraList &clist, Config &config) {
+  Logger &log = Logger::instance();
+  std::vector<std::shared_ptr<USBCamera>> cameras;
+  // serial numbers in the order the cameras' images are named and matched
+  std::vector<std::string> serials =
+      split_list(config.get<std::string>("camera_serial"));
+  if (serials.empty()) {
+    for (unsigned int i = 0; i < clist.GetSize(); i++) {
+      cameras.push_back(std::make_shared<USBCamera>(clist.GetByIndex(i)));
+    }
+  }
+  for (auto const &serial : serials) {
+    Spinnaker::CameraPtr ptr = clist.GetBySerial(serial);
+    if (ptr.IsValid()) {
+      cameras.push_back(std::make_shared<USBCamera>(ptr));
+    } else {
+      log.warning() << "Camera " << serial << " not found." << std::endl;
+    }
+  }
+  return cameras;
+}
+
+std::vector<std::string> laser_devices(Config &config) {
+  Logger &log = Logger::instance();
+  unsigned int vid = config.get<unsigned int>("laser_vid");
+  unsigned int pid = config.get<unsigned int>("laser_pid");
+  std::vector<usb_serial_t> devices;
+  // several serial numbers give the order of the lasers, e.g. by wavelength
+  std::vector<std::string> serials =
+      split_list(config.get<std::string>("laser_serial"));
+  bool any = serials.empty();
+  for (auto const &serial : serials) {
+    std::vector<usb_serial_t> d = find_usb_serial(vid, pid, serial);
+    devices.insert(devices.end(), d.begin(), d.end());
+  }
+  if (any) {
+    devices = find_usb_serial(vid, pid);
+  }
+  if (devices.empty()) {
+    std::vector<usb_serial_t> all = find_usb_serial();
+    for (auto const &d : all) {
+      log.warning() << "Found " << d._device << " " << std::hex
+                    << std::setfill('0') << std::setw(4) << d._vid << ":"
+                    << std::setw(4) << d._pid << std::dec << std::setfill(' ')
+                    << " serial " << d._serial << " on port " << d._port
+                    << std::endl;
+    }
+    // a laser reporting other ids is still the laser if it is the only one
+    if (all.size() == 1 && any) {
+      log.warning() << "No device matches laser_vid and laser_pid, using the "
+                    << "only usb serial device." << std::endl;
+      devices = all;
+    }
+  }
+  std::vector<std::string> paths;
+  for (auto const &d : devices) {
+    HAPI_INFO(log) << "Found laser " << d._device << " (serial " << d._serial
+                   << ", port " << d._port << ")." << std::endl;
+    paths.push_back(d._device);
+  }
+  return paths;
+}
+
+void open_lasers(LaserGroup &lasers, Config &config) {
+  Logger &log = Logger::instance();
+  std::chrono::milliseconds laser_timeout(
+      config.get<unsigned int>("laser_timeout"));
+  unsigned int laser_retries = config.get<unsigned int>("laser_retries");
+  std::size_t laser_count = config.get<unsigned int>("laser_count");
+  lasers.open(laser_devices(config), laser_count, [&](OBISLaser &laser) {
+    laser.set_timeout(laser_timeout);
+    laser.set_retries(laser_retries);
+    // stop waiting on the laser when asked to exit
+    laser.set_cancel([]() { return !running; });
+  });
+  if (lasers.size() == 0) {
+    throw std::runtime_error("No free laser found.");
+  }
+  if (lasers.size() < laser_count) {
+    log.warning() << "Only " << lasers.size() << " of " << laser_count
+                  << " lasers found." << std::endl;
   }
-  camera->configure_trigger(trigger_type);
+}
 
-  log.info() << "Setting acquisition mode to continuous." << std::endl;
-  camera->set_acquisition_mode(
-      Spinnaker::AcquisitionModeEnums::AcquisitionMode_Continuous);
+void setup_lasers(LaserGroup &lasers, HAPIMode mode) {
+  Logger &log = Logger::instance();
+  HAPI_INFO(log) << "Initializing " << lasers.size() << " laser(s)."
+                 << std::endl;
+  lasers.each([mode](std::size_t index, OBISLaser &laser) {
+    initialize_laser(laser, mode);
+  });
+  for (std::size_t i = 0; i < lasers.size(); i++) {
+    HAPI_INFO(log) << "Laser " << i << " on " << lasers.device(i) << ":"
+                   << std::endl;
+    print_laser(lasers.laser(i));
+  }
 }
 
 void initialize_laser(OBISLaser &laser, HAPIMode mode) {
@@ -315,16 +720,6 @@ void initialize_laser(OBISLaser &laser, HAPIMode mode) {
   laser.auto_start(OBISLaser::State::On);
   laser.state(OBISLaser::State::On);
 
-  log.info() << "Laser info:" << std::endl;
-  log.info() << "    IDN: " << laser.sys_info()._idn;
-  log.info() << "    Model: " << laser.sys_info()._model;
-  log.info() << "    Serial Number: " << laser.sys_info()._snumber;
-  log.info() << "    Firmware: " << laser.sys_info()._firmware;
-  log.info() << "    Wavelength: " << laser.sys_info()._wavelength << std::endl;
-  log.info() << "    Laser cycles: " << laser.cycles() << std::endl;
-  log.info() << "    Laser hours: " << laser.hours() << std::endl;
-  log.info() << "    Laser diode hours: " << laser.diode_hours() << std::endl;
-
   FaultCode fault = laser.fault();
   if (fault != 0) {
     for (std::string f : laser.fault(fault)) {
@@ -334,42 +729,77 @@ void initialize_laser(OBISLaser &laser, HAPIMode mode) {
   }
 }
 
+void print_laser(OBISLaser &laser) {
+  Logger &log = Logger::instance();
+  HAPI_INFO(log) << "Laser info:" << std::endl;
+  HAPI_INFO(log) << "    IDN: " << laser.sys_info()._idn;
+  HAPI_INFO(log) << "    Model: " << laser.sys_info()._model;
+  HAPI_INFO(log) << "    Serial Number: " << laser.sys_info()._snumber;
+  HAPI_INFO(log) << "    Firmware: " << laser.sys_info()._firmware;
+  HAPI_INFO(log) << "    Wavelength: " << laser.sys_info()._wavelength
+                 << std::endl;
+  HAPI_INFO(log) << "    Laser cycles: " << laser.sys_info()._cycles
+                 << std::endl;
+  HAPI_INFO(log) << "    Laser hours: " << laser.sys_info()._hours << std::endl;
+  HAPI_INFO(log) << "    Laser diode hours: " << laser.sys_info()._diodeHours
+                 << std::endl;
+}
+
 void cleanup(Spinnaker::CameraList &clist, Spinnaker::SystemPtr &system,
-             std::shared_ptr<USBCamera> &camera, HAPIMode mode,
-             OBISLaser &laser) {
-  laser.mode(OBISLaser::SourceType::Digital);
-  laser.state(OBISLaser::State::Off);
+             CameraGroup &cameras, HAPIMode mode, LaserGroup &lasers) {
   Board &board = Board::instance();
   Logger &log = Logger::instance();
-  log.info() << "Cleaning up..." << std::endl;
-  if (camera != nullptr) {
-    if (camera->is_initialized()) {
-      log.info() << "Resetting camera trigger." << std::endl;
+  // running may already be false, the lasers have to be turned off anyway
+  lasers.each([&log](std::size_t index, OBISLaser &laser) {
+    laser.set_cancel(nullptr);
+    try {
+      laser.mode(OBISLaser::SourceType::Digital);
+      laser.state(OBISLaser::State::Off);
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Failed to turn the laser off." << std::endl;
+    }
+  });
+  for (std::size_t i = 0; i < lasers.size(); i++) {
+    HAPI_INFO(log) << "Laser " << i << " serial: " << lasers.laser(i).timeouts()
+                   << " timeouts, " << lasers.laser(i).retries() << " retries."
+                   << std::endl;
+  }
+  HAPI_INFO(log) << "Cleaning up..." << std::endl;
+  cameras.end();
+  for (std::size_t i = 0; i < cameras.size(); i++) {
+    USBCamera &camera = cameras.camera(i);
+    if (camera.is_initialized()) {
+      HAPI_INFO(log) << "Resetting trigger of camera " << cameras.serial(i)
+                     << "." << std::endl;
       try {
-        camera->reset_trigger();
+        camera.reset_trigger();
       } catch (const std::exception &ex) {
         log.exception(ex) << "Failed to reset camera trigger." << std::endl;
       }
-      log.info() << "De-initializing camera." << std::endl;
+      HAPI_INFO(log) << "De-initializing camera " << cameras.serial(i) << "."
+                     << std::endl;
       try {
-        camera->deinit();
+        camera.deinit();
       } catch (const std::exception &ex) {
         log.exception(ex) << "Failed to de-initialize camera." << std::endl;
       }
     }
-    log.info() << "Releasing camera." << std::endl;
-    camera.reset();
   }
-  log.info() << "Disarming HAPI-E board." << std::endl;
+  if (cameras.size() > 0) {
+    HAPI_INFO(log) << "Releasing cameras." << std::endl;
+    cameras.clear();
+  }
+  HAPI_INFO(log) << "Disarming HAPI-E board." << std::endl;
   board.disarm();
-  if (use_camera(mode)) {
-    log.info() << "Clearing camera list." << std::endl;
+  // the Spinnaker system may not have come up
+  if (use_camera(mode) && system.IsValid()) {
+    HAPI_INFO(log) << "Clearing camera list." << std::endl;
     try {
       clist.Clear();
     } catch (const std::exception &ex) {
       log.exception(ex) << "Failed to clear camera list." << std::endl;
     }
-    log.info() << "Releasing Spinnaker system." << std::endl;
+    HAPI_INFO(log) << "Releasing Spinnaker system." << std::endl;
     try {
       system->ReleaseInstance();
     } catch (const std::exception &ex) {
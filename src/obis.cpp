@@ -1,7 +1,85 @@
 #include "obis.h"
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 
+// most queries batch() has waiting for a reply at once
+#define HAPI_OBIS_PIPELINE 8
+
+namespace {
+// the queries sys_info() and telemetry() send, in the order they are parsed
+const char *const sys_info_queries[] = {
+    "*IDN?", "syst:inf:mod?", "syst:inf:mdat?", "syst:inf:cdat?",
+    "syst:inf:fver?", "syst:inf:snum?", "syst:inf:pnum?", "syst:inf:pver?",
+    "syst:inf:wav?", "syst:inf:pow?", "syst:inf:type?", "sour:pow:nom?",
+    "sour:pow:lim:low?", "sour:pow:lim:high?", "sour:temp:prot:bas:high?",
+    "sour:temp:prot:bas:low?", "sour:temp:prot:diod:high?",
+    "sour:temp:prot:diod:low?", "sour:temp:prot:int:high?",
+    "sour:temp:prot:int:low?", "sour:curr:lim:low?", "sour:curr:lim:high?",
+    "syst:cycl?", "syst:hour?", "syst:diod:hour?"};
+
+const char *const telemetry_queries[] = {
+    "syst:stat?",     "syst:faul?",     "sour:am:stat?",   "sour:pow:lev?",
+    "sour:pow:curr?", "sour:temp:bas?", "sour:temp:diod?", "sour:temp:int?"};
+
+// reply prefixes of the enum values, checked in order
+struct name_t {
+  const char *_name;
+  int _value;
+};
+
+const name_t device_types[] = {{"DDL", OBISLaser::DeviceType::DDL},
+                               {"OPSL", OBISLaser::DeviceType::OPSL},
+                               {"MINI", OBISLaser::DeviceType::Mini},
+                               {"MASTER", OBISLaser::DeviceType::Master}};
+
+const name_t source_types[] = {
+    {"CWP", OBISLaser::SourceType::ConstantPower},
+    {"CWC", OBISLaser::SourceType::ConstantCurrent},
+    {"DIGITAL", OBISLaser::SourceType::Digital},
+    {"ANALOG", OBISLaser::SourceType::Analog},
+    {"MIXED", OBISLaser::SourceType::Mixed},
+    {"DIGSO", OBISLaser::SourceType::DIGSO},
+    {"MIXSO", OBISLaser::SourceType::MIXSO}};
+
+template <std::size_t N>
+int lookup(const name_t (&names)[N], const char *line, std::size_t length,
+           int otherwise) {
+  for (auto const &n : names) {
+    std::size_t l = std::strlen(n._name);
+    if (length >= l && std::memcmp(line, n._name, l) == 0) {
+      return n._value;
+    }
+  }
+  return otherwise;
+}
+
+// copies cmd and the line ending to out, returns the bytes written
+std::size_t append_command(char *out, std::size_t size, const char *cmd) {
+  std::size_t length = std::strlen(cmd);
+  if (length + 2 > size) {
+    throw std::length_error(std::string("Command too long: ").append(cmd));
+  }
+  std::memcpy(out, cmd, length);
+  out[length] = '\r';
+  out[length + 1] = '\n';
+  return length + 2;
+}
+
+// copies a reply null terminated so a number is never read past its end
+template <std::size_t N>
+const char *terminated(const char *line, std::size_t length, char (&out)[N]) {
+  std::size_t n = std::min(length, N - 1);
+  std::memcpy(out, line, n);
+  out[n] = '\0';
+  return out;
+}
+}  // namespace
+
+const std::size_t OBISLaser::max_line;
+const std::size_t OBISLaser::max_batch;
+
 std::exception_ptr safe_stoi(int &i, const std::string &str,
                              std::size_t *pos = 0, int base = 10) {
   try {
@@ -20,12 +98,22 @@ OBISLaser::OBISLaser(std::string device) {
 }
 
 OBISLaser::~OBISLaser(void) {
-  state(OBISLaser::State::Off);
+  // always try to turn the laser off, even when shutting down
+  _serial.set_cancel(nullptr);
+  try {
+    state(OBISLaser::State::Off);
+  } catch (const std::exception &ex) {
+    std::cout << "Could not turn the laser off: " << ex.what() << std::endl;
+  }
   _serial.close();
 }
 
 void OBISLaser::send(std::string cmd) {
-  _serial.write(cmd + "\r\n");
+  std::lock_guard<std::mutex> lock(_mutex);
+  char out[max_line];
+  std::size_t length = append_command(out, sizeof out, cmd.c_str());
+  _serial.write(out, length,
+                SerialInterface::clock::now() + _serial.timeout());
   complete_handshake();
 }
 
@@ -44,6 +132,20 @@ void OBISLaser::complete_handshake(void) {
   }
 }
 
+void OBISLaser::set_timeout(std::chrono::milliseconds timeout) {
+  _serial.set_timeout(timeout);
+}
+
+void OBISLaser::set_retries(unsigned int retries) { _max_retries = retries; }
+
+void OBISLaser::set_cancel(std::function<bool()> cancel) {
+  _serial.set_cancel(cancel);
+}
+
+unsigned long OBISLaser::timeouts(void) { return _serial.timeouts(); }
+
+unsigned long OBISLaser::retries(void) { return _retries; }
+
 void OBISLaser::reset(void) { send("*RST"); }
 
 FaultCode OBISLaser::test(void) { return query<FaultCode>("*TST?"); }
@@ -105,40 +207,54 @@ void OBISLaser::clear_error(void) { send("syst:err:cle"); }
 
 const OBISLaser::sys_info_t OBISLaser::sys_info(bool q) {
   if (q) {
-    _info._idn = query<decltype(_info._idn)>("*IDN?");
-    _info._model = query<decltype(_info._model)>("syst:inf:mod?");
-    _info._mdate = query<decltype(_info._mdate)>("syst:inf:mdat?");
-    _info._cdate = query<decltype(_info._cdate)>("syst:inf:cdat?");
-    _info._firmware = query<decltype(_info._firmware)>("syst:inf:fver?");
-    _info._snumber = query<decltype(_info._snumber)>("syst:inf:snum?");
-    _info._pnumber = query<decltype(_info._pnumber)>("syst:inf:pnum?");
-    _info._protocol = query<decltype(_info._protocol)>("syst:inf:pver?");
-    _info._wavelength = query<decltype(_info._wavelength)>("syst:inf:wav?");
-    _info._power = query<decltype(_info._power)>("syst:inf:pow?");
-    _info._dtype = query<decltype(_info._dtype)>("syst:inf:type?");
-    _info._powerNominal = query<decltype(_info._powerNominal)>("sour:pow:nom?");
-    _info._powerMin = query<decltype(_info._powerMin)>("sour:pow:lim:low?");
-    _info._powerMax = query<decltype(_info._powerMax)>("sour:pow:lim:high?");
-    _info._baseplateMaxTemp =
-        query<decltype(_info._baseplateMaxTemp)>("sour:temp:prot:bas:high?");
-    _info._baseplateMinTemp =
-        query<decltype(_info._baseplateMinTemp)>("sour:temp:prot:bas:low?");
-    _info._diodeMaxTemp =
-        query<decltype(_info._diodeMaxTemp)>("sour:temp:prot:diod:high?");
-    _info._diodeMinTemp =
-        query<decltype(_info._diodeMinTemp)>("sour:temp:prot:diod:low?");
-    _info._internalTempMax =
-        query<decltype(_info._internalTempMax)>("sour:temp:prot:int:high?");
-    _info._internalTempMin =
-        query<decltype(_info._internalTempMin)>("sour:temp:prot:int:low?");
-    _info._currentMin =
-        query<decltype(_info._currentMin)>("sour:curr:lim:low?");
-    _info._currentMax =
-        query<decltype(_info._currentMax)>("sour:curr:lim:high?");
+    std::lock_guard<std::mutex> lock(_mutex);
+    batch(sys_info_queries, sizeof sys_info_queries / sizeof(const char *));
+    auto r = [this](std::size_t i) { return std::string(_lines[i]); };
+    _info._idn = parse<decltype(_info._idn)>(r(0));
+    _info._model = parse<decltype(_info._model)>(r(1));
+    _info._mdate = parse<decltype(_info._mdate)>(r(2));
+    _info._cdate = parse<decltype(_info._cdate)>(r(3));
+    _info._firmware = parse<decltype(_info._firmware)>(r(4));
+    _info._snumber = parse<decltype(_info._snumber)>(r(5));
+    _info._pnumber = parse<decltype(_info._pnumber)>(r(6));
+    _info._protocol = parse<decltype(_info._protocol)>(r(7));
+    _info._wavelength = parse<decltype(_info._wavelength)>(r(8));
+    _info._power = parse<decltype(_info._power)>(r(9));
+    _info._dtype = parse<decltype(_info._dtype)>(r(10));
+    _info._powerNominal = parse<decltype(_info._powerNominal)>(r(11));
+    _info._powerMin = parse<decltype(_info._powerMin)>(r(12));
+    _info._powerMax = parse<decltype(_info._powerMax)>(r(13));
+    _info._baseplateMaxTemp = parse<decltype(_info._baseplateMaxTemp)>(r(14));
+    _info._baseplateMinTemp = parse<decltype(_info._baseplateMinTemp)>(r(15));
+    _info._diodeMaxTemp = parse<decltype(_info._diodeMaxTemp)>(r(16));
+    _info._diodeMinTemp = parse<decltype(_info._diodeMinTemp)>(r(17));
+    _info._internalTempMax = parse<decltype(_info._internalTempMax)>(r(18));
+    _info._internalTempMin = parse<decltype(_info._internalTempMin)>(r(19));
+    _info._currentMin = parse<decltype(_info._currentMin)>(r(20));
+    _info._currentMax = parse<decltype(_info._currentMax)>(r(21));
+    _info._cycles = parse<decltype(_info._cycles)>(r(22));
+    _info._hours = parse<decltype(_info._hours)>(r(23));
+    _info._diodeHours = parse<decltype(_info._diodeHours)>(r(24));
   }
   return _info;
 }
 
+const OBISLaser::telemetry_t OBISLaser::telemetry(void) {
+  // polled all the time, so read straight from the reply buffer
+  std::lock_guard<std::mutex> lock(_mutex);
+  batch(telemetry_queries, sizeof telemetry_queries / sizeof(const char *));
+  telemetry_t t;
+  t._status = parse<StatusCode>(_lines[0], _lengths[0]);
+  t._fault = parse<FaultCode>(_lines[1], _lengths[1]);
+  t._state = parse<State>(_lines[2], _lengths[2]);
+  t._power = parse<double>(_lines[3], _lengths[3]);
+  t._current = parse<double>(_lines[4], _lengths[4]);
+  t._baseplateTemp = parse<double>(_lines[5], _lengths[5]);
+  t._diodeTemp = parse<double>(_lines[6], _lengths[6]);
+  t._internalTemp = parse<double>(_lines[7], _lengths[7]);
+  return t;
+}
+
 void OBISLaser::user(const unsigned short index, const std::string data) {
   std::string str = (data.length() > 31 ? data.substr(0, 31) : data);
   send("syst:inf:user " + std::to_string(index) + ", " + str);
@@ -458,71 +574,112 @@ const std::string OBISLaser::error_str(const unsigned int err) {
 }
 
 const std::string OBISLaser::result(const std::string str) {
-  _serial.write(str + "\r\n");
-  std::string line = _serial.getline();
-  if (line.length() >= 3) {
-    if (line.substr(0, 3).compare("ERR") == 0) {
+  return query_batch({str})[0];
+}
+
+const std::vector<std::string> OBISLaser::query_batch(
+    const std::vector<std::string> &cmds) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::vector<const char *> ptrs;
+  for (auto const &cmd : cmds) {
+    ptrs.push_back(cmd.c_str());
+  }
+  std::vector<std::string> lines;
+  for (std::size_t i = 0; i < ptrs.size(); i += max_batch) {
+    std::size_t count = std::min(ptrs.size() - i, max_batch);
+    batch(ptrs.data() + i, count);
+    for (std::size_t j = 0; j < count; j++) {
+      lines.emplace_back(_lines[j], _lengths[j]);
+    }
+  }
+  return lines;
+}
+
+void OBISLaser::batch(const char *const *cmds, std::size_t count) {
+  if (count > max_batch) {
+    throw std::length_error("Too many queries in one batch!");
+  }
+  char out[HAPI_OBIS_PIPELINE * max_line];
+  std::size_t sent = 0, received = 0;
+  unsigned int attempt = 0;
+  while (received < count) {
+    // keep a few queries in flight, enough to hide the round trip without
+    // overflowing the laser's input buffer
+    std::size_t length = 0;
+    for (; sent < count && sent < received + HAPI_OBIS_PIPELINE; sent++) {
+      length += append_command(out + length, sizeof out - length, cmds[sent]);
+    }
+    try {
+      auto now = SerialInterface::clock::now();
+      if (length > 0) {
+        _serial.write(out, length, now + _serial.timeout());
+      }
+      _lengths[received] =
+          _serial.getline(_lines[received], max_line, '\n',
+                          SerialInterface::clock::now() + _serial.timeout());
+      complete_handshake();
+      received++;
+      attempt = 0;
+    } catch (const SerialTimeout &ex) {
+      if (attempt >= _max_retries) {
+        throw;
+      }
+      // a late reply must not be taken as the reply to a later query, drop
+      // it and ask again for everything not answered yet
+      _serial.discard();
+      sent = received;
+      attempt++;
+      _retries++;
+    }
+  }
+  // errors are only raised once every reply is in so the next query doesn't
+  // get one of these replies
+  for (std::size_t i = 0; i < count; i++) {
+    if (_lengths[i] >= 3 && std::memcmp(_lines[i], "ERR", 3) == 0) {
+      std::string line(_lines[i], _lengths[i]);
       std::string error =
           error_str(error_no(line.substr(0, line.length() - 2)));
-      throw std::runtime_error("Query error: " + str + " " + error);
+      throw std::runtime_error(std::string("Query error: ") + cmds[i] + " " +
+                               error);
     }
   }
-  complete_handshake();
-  return line;
+}
+
+double OBISLaser::number(const char *line, std::size_t length,
+                         std::true_type) {
+  char copy[max_line];
+  return std::strtod(terminated(line, length, copy), nullptr);
+}
+
+unsigned long OBISLaser::number(const char *line, std::size_t length,
+                                std::false_type) {
+  char copy[max_line];
+  return std::strtoul(terminated(line, length, copy), nullptr, 10);
 }
 
 template <>
-const std::string OBISLaser::query(const std::string str) {
-  return result(str);
+const std::string OBISLaser::parse(const char *line, std::size_t length) {
+  return std::string(line, length);
 }
 
 template <>
-const OBISLaser::State OBISLaser::query(const std::string str) {
-  if (result(str).compare("ON\r\n") == 0) return OBISLaser::State::On;
+const OBISLaser::State OBISLaser::parse(const char *line, std::size_t length) {
+  if (length == 4 && std::memcmp(line, "ON\r\n", 4) == 0) {
+    return OBISLaser::State::On;
+  }
   return OBISLaser::State::Off;
 }
 
 template <>
-const OBISLaser::DeviceType OBISLaser::query(const std::string str) {
-  std::string line = result(str);
-  if (line.substr(0, 3).compare("DDL") == 0) {
-    return OBISLaser::DeviceType::DDL;
-  }
-  if (line.substr(0, 4).compare("OPSL") == 0) {
-    return OBISLaser::DeviceType::OPSL;
-  }
-  if (line.substr(0, 4).compare("MINI") == 0) {
-    return OBISLaser::DeviceType::Mini;
-  }
-  if (line.substr(0, 6).compare("MASTER") == 0) {
-    return OBISLaser::DeviceType::Master;
-  }
-  return OBISLaser::DeviceType::Other;
+const OBISLaser::DeviceType OBISLaser::parse(const char *line,
+                                             std::size_t length) {
+  return static_cast<OBISLaser::DeviceType>(
+      lookup(device_types, line, length, OBISLaser::DeviceType::Other));
 }
 
 template <>
-const OBISLaser::SourceType OBISLaser::query(const std::string str) {
-  std::string line = result(str);
-  if (line.substr(0, 3).compare("CWP") == 0) {
-    return OBISLaser::SourceType::ConstantPower;
-  }
-  if (line.substr(0, 3).compare("CWC") == 0) {
-    return OBISLaser::SourceType::ConstantCurrent;
-  }
-  if (line.substr(0, 7).compare("DIGITAL") == 0) {
-    return OBISLaser::SourceType::Digital;
-  }
-  if (line.substr(0, 6).compare("ANALOG") == 0) {
-    return OBISLaser::SourceType::Analog;
-  }
-  if (line.substr(0, 5).compare("MIXED") == 0) {
-    return OBISLaser::SourceType::Mixed;
-  }
-  if (line.substr(0, 5).compare("DIGSO") == 0) {
-    return OBISLaser::SourceType::DIGSO;
-  }
-  if (line.substr(0, 5).compare("MIXSO") == 0) {
-    return OBISLaser::SourceType::MIXSO;
-  }
-  return OBISLaser::SourceType::ConstantPower;
+const OBISLaser::SourceType OBISLaser::parse(const char *line,
+                                             std::size_t length) {
+  return static_cast<OBISLaser::SourceType>(lookup(
+      source_types, line, length, OBISLaser::SourceType::ConstantPower));
 }
@@ -0,0 +1,75 @@
+#include "pack12.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAPI_NEON 1
+#endif
+
+namespace hapi {
+void pack12(const uint16_t *src, uint8_t *dst, std::size_t n,
+            unsigned int shift) {
+  std::size_t i = 0;
+#ifdef HAPI_NEON
+  const int16x8_t right = vdupq_n_s16(-(int16_t)shift);
+  const uint16x8_t mask = vdupq_n_u16(0xfff);
+  const uint16x8_t nibble = vdupq_n_u16(0xf);
+  for (; i + 16 <= n; i += 16) {
+    // even pixels in val[0], odd ones in val[1]
+    uint16x8x2_t p = vld2q_u16(src + i);
+    uint16x8_t a = vandq_u16(vshlq_u16(p.val[0], right), mask);
+    uint16x8_t b = vandq_u16(vshlq_u16(p.val[1], right), mask);
+    uint8x8x3_t out;
+    out.val[0] = vmovn_u16(a);
+    out.val[1] = vmovn_u16(
+        vorrq_u16(vandq_u16(vshrq_n_u16(a, 8), nibble), vshlq_n_u16(b, 4)));
+    out.val[2] = vmovn_u16(vshrq_n_u16(b, 4));
+    vst3_u8(dst + i / 2 * 3, out);
+  }
+#endif
+  for (; i + 2 <= n; i += 2) {
+    uint16_t a = (src[i] >> shift) & 0xfff;
+    uint16_t b = (src[i + 1] >> shift) & 0xfff;
+    uint8_t *d = dst + i / 2 * 3;
+    d[0] = a & 0xff;
+    d[1] = (a >> 8) | ((b & 0xf) << 4);
+    d[2] = b >> 4;
+  }
+  if (i < n) {
+    // an odd pixel out takes two bytes
+    uint16_t a = (src[i] >> shift) & 0xfff;
+    uint8_t *d = dst + i / 2 * 3;
+    d[0] = a & 0xff;
+    d[1] = a >> 8;
+  }
+}
+
+void unpack12(const uint8_t *src, uint16_t *dst, std::size_t n,
+              unsigned int shift) {
+  std::size_t i = 0;
+#ifdef HAPI_NEON
+  const int16x8_t left = vdupq_n_s16((int16_t)shift);
+  const uint16x8_t nibble = vdupq_n_u16(0xf);
+  for (; i + 16 <= n; i += 16) {
+    uint8x8x3_t p = vld3_u8(src + i / 2 * 3);
+    uint16x8_t b0 = vmovl_u8(p.val[0]);
+    uint16x8_t b1 = vmovl_u8(p.val[1]);
+    uint16x8_t b2 = vmovl_u8(p.val[2]);
+    uint16x8x2_t out;
+    out.val[0] = vshlq_u16(
+        vorrq_u16(b0, vshlq_n_u16(vandq_u16(b1, nibble), 8)), left);
+    out.val[1] =
+        vshlq_u16(vorrq_u16(vshrq_n_u16(b1, 4), vshlq_n_u16(b2, 4)), left);
+    vst2q_u16(dst + i, out);
+  }
+#endif
+  for (; i + 2 <= n; i += 2) {
+    const uint8_t *s = src + i / 2 * 3;
+    dst[i] = (s[0] | ((s[1] & 0xf) << 8)) << shift;
+    dst[i + 1] = ((s[1] >> 4) | (s[2] << 4)) << shift;
+  }
+  if (i < n) {
+    const uint8_t *s = src + i / 2 * 3;
+    dst[i] = (s[0] | ((s[1] & 0xf) << 8)) << shift;
+  }
+}
+}  // namespace hapi
@@ -0,0 +1,161 @@
+#include "pmt_controller.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+
+#include "board.h"
+#include "logger.h"
+
+using namespace hapi;
+
+// spacing in pixels of the grid sampled to compare a frame to the background
+#define HAPI_EMPTY_STEP 16
+// weight of each new empty frame in the running background
+#define HAPI_BACKGROUND_WEIGHT 0.1f
+// frames in a row with something in them after which the background is taken
+// again, in case it was taken from a frame with a particle in it
+#define HAPI_BACKGROUND_RESET 50
+
+PMTController::PMTController(Config &config) {
+  // start from what the board is set to, a calibration at startup may have
+  // replaced the configured values
+  Board &board = Board::instance();
+  _gain = board.pmt_gain() < 0 ? config.get<unsigned int>("pmt_gain")
+                               : board.pmt_gain();
+  _threshold = board.pmt_threshold() < 0
+                   ? config.get<unsigned int>("pmt_threshold")
+                   : board.pmt_threshold();
+  _gain_min = config.get<unsigned int>("pmt_gain_min");
+  _gain_max = config.get<unsigned int>("pmt_gain_max");
+  _threshold_min = config.get<unsigned int>("pmt_threshold_min");
+  _threshold_max = config.get<unsigned int>("pmt_threshold_max");
+  _step = std::max(config.get<int>("pmt_control_step"), 1);
+  _window = std::max(config.get<unsigned int>("pmt_control_window"), 1u);
+  _rate_max = config.get<double>("pmt_rate_max");
+  _empty_high = config.get<double>("pmt_empty_high");
+  _empty_low = config.get<double>("pmt_empty_low");
+  _empty_diff = config.get<double>("pmt_empty_diff");
+  _window_start = std::chrono::steady_clock::now();
+}
+
+bool PMTController::sample(Spinnaker::ImagePtr &image) {
+  Spinnaker::ImagePtr mono = image;
+  size_t bpp = image->GetBitsPerPixel();
+  if (bpp != 8 && bpp != 16) {
+    mono = image->Convert(Spinnaker::PixelFormat_Mono8,
+                          Spinnaker::NO_COLOR_PROCESSING);
+    bpp = 8;
+  }
+  size_t width = mono->GetWidth();
+  size_t height = mono->GetHeight();
+  size_t stride = mono->GetStride();
+  const std::uint8_t *data =
+      static_cast<const std::uint8_t *>(mono->GetData());
+  if (data == nullptr || width == 0 || height == 0) {
+    return false;
+  }
+  if (stride == 0) {
+    stride = width * bpp / 8;
+  }
+  _sample.clear();
+  for (size_t y = HAPI_EMPTY_STEP / 2; y < height; y += HAPI_EMPTY_STEP) {
+    const std::uint8_t *row = data + y * stride;
+    for (size_t x = HAPI_EMPTY_STEP / 2; x < width; x += HAPI_EMPTY_STEP) {
+      if (bpp == 8) {
+        _sample.push_back(row[x]);
+      } else {
+        _sample.push_back(row[2 * x] | (row[2 * x + 1] << 8));
+      }
+    }
+  }
+  return !_sample.empty();
+}
+
+void PMTController::classify(Spinnaker::ImagePtr &image) {
+  if (image->IsIncomplete() || !sample(image)) {
+    return;
+  }
+  // the first frame becomes the background
+  if (_background.size() != _sample.size() ||
+      _since_empty >= HAPI_BACKGROUND_RESET) {
+    _background = _sample;
+    _since_empty = 0;
+    return;
+  }
+  double diff = 0;
+  double level = 0;
+  for (size_t i = 0; i < _sample.size(); i++) {
+    diff += std::abs(_sample[i] - _background[i]);
+    level += _background[i];
+  }
+  bool empty = diff <= _empty_diff * std::max(level, 1.0);
+  if (empty) {
+    // follow slow changes in the background, e.g. laser power or window
+    // contamination, using only frames without particles
+    for (size_t i = 0; i < _sample.size(); i++) {
+      _background[i] += HAPI_BACKGROUND_WEIGHT * (_sample[i] - _background[i]);
+    }
+    _empty++;
+    _since_empty = 0;
+  } else {
+    _since_empty++;
+  }
+  _frames++;
+}
+
+void PMTController::update() {
+  if (++_triggers < _window) {
+    return;
+  }
+  Logger &log = Logger::instance();
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - _window_start;
+  double rate = _triggers / std::max(elapsed.count(), 1e-3);
+  // the writer may not have classified every frame of the window yet, those
+  // count towards the next one
+  unsigned int frames = _frames.load();
+  unsigned int empty = _empty.load();
+  unsigned int window_frames = frames - _window_frames;
+  unsigned int window_empty = empty - _window_empty;
+  double empty_frac =
+      window_frames > 0 ? (double)window_empty / window_frames : 0;
+
+  int gain = _gain;
+  int threshold = _threshold;
+  // larger values trigger more easily, the threshold moves first and the
+  // gain only once the threshold is at its limit
+  if (rate > _rate_max || (window_frames > 0 && empty_frac > _empty_high)) {
+    if (threshold > _threshold_min) {
+      threshold = std::max(threshold - _step, _threshold_min);
+    } else {
+      gain = std::max(gain - _step, _gain_min);
+    }
+  } else if (window_frames > 0 && empty_frac < _empty_low) {
+    if (threshold < _threshold_max) {
+      threshold = std::min(threshold + _step, _threshold_max);
+    } else {
+      gain = std::min(gain + _step, _gain_max);
+    }
+  }
+
+  if (gain != _gain || threshold != _threshold) {
+    HAPI_INFO(log) << std::hex << std::setfill('0') << "PMT control: gain 0x"
+                   << std::setw(2) << _gain << " -> 0x" << std::setw(2) << gain
+                   << ", threshold 0x" << std::setw(2) << _threshold << " -> 0x"
+                   << std::setw(2) << threshold << std::dec << std::setfill(' ')
+                   << " (" << rate << " Hz, " << window_empty << "/"
+                   << window_frames << " frames empty)" << std::endl;
+    Board &board = Board::instance();
+    board.set_pmt_gain(gain);
+    board.set_pmt_threshold(threshold);
+    _gain = gain;
+    _threshold = threshold;
+  }
+
+  _triggers = 0;
+  _window_start = std::chrono::steady_clock::now();
+  _window_frames = frames;
+  _window_empty = empty;
+}
@@ -0,0 +1,116 @@
+#include "pmt_map.h"
+
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+
+using namespace hapi;
+
+PMTMap::PMTMap() : _temp(std::numeric_limits<double>::quiet_NaN()) {}
+
+// Lines are "result=gain,threshold,time,temp" for the last calibration and
+// "gain,threshold,count,live,time,temp" for each measurement
+void PMTMap::load(std::filesystem::path p) {
+  std::ifstream in(p, std::ios::binary);
+  if (in) {
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.empty() || line[0] == '#') {
+        continue;
+      }
+      bool is_result = line.compare(0, 7, "result=") == 0;
+      if (is_result) {
+        line = line.substr(7);
+      }
+      for (auto &c : line) {
+        if (c == ',') c = ' ';
+      }
+      std::istringstream is_line(line);
+      unsigned int gain, threshold;
+      entry_t e{0, 0, 0, std::numeric_limits<double>::quiet_NaN()};
+      std::string temp;
+      if (is_result) {
+        is_line >> gain >> threshold >> e._time >> temp;
+      } else {
+        is_line >> gain >> threshold >> e._count >> e._live >> e._time >> temp;
+      }
+      if (!is_line || gain > 0xFF || threshold > 0xFF) {
+        continue;
+      }
+      if (temp != "nan") {
+        std::istringstream(temp) >> e._temp;
+      }
+      if (is_result) {
+        _has_result = true;
+        _result = std::make_pair(gain, threshold);
+        _result_entry = e;
+      } else {
+        _entries[std::make_pair(gain, threshold)] = e;
+      }
+    }
+    in.close();
+  }
+}
+
+void PMTMap::save(std::filesystem::path p) {
+  std::ofstream out(p, std::ios::binary);
+  if (out) {
+    out << "# hapi pmt noise map: gain,threshold,count,live,time,temp"
+        << std::endl;
+    auto temp = [](double t) {
+      return std::isnan(t) ? std::string("nan") : std::to_string(t);
+    };
+    if (_has_result) {
+      out << "result=" << _result.first << "," << _result.second << ","
+          << _result_entry._time << "," << temp(_result_entry._temp)
+          << std::endl;
+    }
+    for (auto const &i : _entries) {
+      out << i.first.first << "," << i.first.second << "," << i.second._count
+          << "," << i.second._live << "," << i.second._time << ","
+          << temp(i.second._temp) << std::endl;
+    }
+    out.close();
+  }
+}
+
+void PMTMap::set_temperature(double temp) { _temp = temp; }
+
+double PMTMap::temperature() { return _temp; }
+
+void PMTMap::record(unsigned int gain, unsigned int threshold,
+                    unsigned int count, double live) {
+  _entries[std::make_pair(gain, threshold)] =
+      entry_t{count, live, std::time(nullptr), _temp};
+}
+
+void PMTMap::set_result(unsigned int gain, unsigned int threshold) {
+  _has_result = true;
+  _result = std::make_pair(gain, threshold);
+  _result_entry = entry_t{0, 0, std::time(nullptr), _temp};
+}
+
+bool PMTMap::has_result(double max_age, double max_temp) {
+  return _has_result && is_current(_result_entry, max_age, max_temp);
+}
+
+std::pair<unsigned int, unsigned int> PMTMap::result() { return _result; }
+
+bool PMTMap::is_current(const entry_t &entry, double max_age,
+                        double max_temp) {
+  if (std::difftime(std::time(nullptr), entry._time) > max_age) {
+    return false;
+  }
+  // without both temperatures there is nothing to compare
+  if (std::isnan(entry._temp) || std::isnan(_temp)) {
+    return true;
+  }
+  return std::abs(entry._temp - _temp) <= max_temp;
+}
+
+const std::map<std::pair<unsigned int, unsigned int>, PMTMap::entry_t>
+    &PMTMap::entries() {
+  return _entries;
+}
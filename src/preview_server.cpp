@@ -0,0 +1,331 @@
+#include "preview_server.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+using namespace hapi;
+
+// clients served at once, e.g. a few browsers on the field laptop
+#define HAPI_PREVIEW_CLIENTS 4
+// longest a client may take to send its request or accept a frame
+#define HAPI_PREVIEW_TIMEOUT_MS 2000
+// longest wait in poll() before checking for stop again
+#define HAPI_PREVIEW_SLICE_MS 100
+#define HAPI_PREVIEW_BOUNDARY "hapiframe"
+
+namespace {
+void put16(std::string &out, std::size_t at, uint16_t v) {
+  out[at] = v & 0xff;
+  out[at + 1] = v >> 8;
+}
+
+void put32(std::string &out, std::size_t at, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    out[at + i] = (v >> (8 * i)) & 0xff;
+  }
+}
+
+/**
+ * bmp
+ *
+ * Encodes an 8 bit grayscale bmp of the image shrunk by factor, averaging
+ * each factor x factor block so the preview isn't noisier than the image.
+ */
+std::string bmp(const uint8_t *data, std::size_t width, std::size_t height,
+                std::size_t stride, std::size_t factor) {
+  const std::size_t header = 14 + 40 + 256 * 4;
+  std::size_t w = width / factor;
+  std::size_t h = height / factor;
+  // rows are padded to 4 bytes and stored bottom up
+  std::size_t row = (w + 3) & ~(std::size_t)3;
+  std::string out(header + row * h, '\0');
+  out[0] = 'B';
+  out[1] = 'M';
+  put32(out, 2, out.size());
+  put32(out, 10, header);
+  put32(out, 14, 40);
+  put32(out, 18, w);
+  put32(out, 22, h);
+  put16(out, 26, 1);
+  put16(out, 28, 8);
+  put32(out, 34, row * h);
+  put32(out, 46, 256);
+  for (int i = 0; i < 256; i++) {
+    out[54 + i * 4] = out[55 + i * 4] = out[56 + i * 4] = i;
+  }
+  std::size_t area = factor * factor;
+  for (std::size_t y = 0; y < h; y++) {
+    char *dst = &out[header + (h - 1 - y) * row];
+    const uint8_t *src = data + y * factor * stride;
+    for (std::size_t x = 0; x < w; x++) {
+      unsigned int sum = 0;
+      for (std::size_t j = 0; j < factor; j++) {
+        const uint8_t *p = src + j * stride + x * factor;
+        for (std::size_t i = 0; i < factor; i++) {
+          sum += p[i];
+        }
+      }
+      dst[x] = sum / area;
+    }
+  }
+  return out;
+}
+
+bool send_all(int fd, const char *data, std::size_t size) {
+  while (size > 0) {
+    ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool send_all(int fd, const std::string &data) {
+  return send_all(fd, data.data(), data.size());
+}
+
+void respond(int fd, const std::string &status, const std::string &type,
+             const std::string &body) {
+  std::ostringstream head;
+  head << "HTTP/1.0 " << status << "\r\nContent-Type: " << type
+       << "\r\nContent-Length: " << body.size()
+       << "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+  if (send_all(fd, head.str())) {
+    send_all(fd, body);
+  }
+}
+}  // namespace
+
+PreviewServer::PreviewServer(const std::string &address, unsigned short port,
+                             std::size_t streams, unsigned int width)
+    : _width(width), _frames(streams), _sequences(streams, 0) {
+  sockaddr_in bind_address;
+  std::memset(&bind_address, 0, sizeof(bind_address));
+  bind_address.sin_family = AF_INET;
+  bind_address.sin_port = htons(port);
+  if (::inet_pton(AF_INET, address.c_str(), &bind_address.sin_addr) != 1) {
+    throw std::runtime_error("Not an ipv4 address to serve the preview on: " +
+                             address);
+  }
+  _listen = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (_listen < 0) {
+    throw std::runtime_error(std::string("Could not create the preview "
+                                         "socket: ") +
+                             std::strerror(errno));
+  }
+  int on = 1;
+  ::setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (::bind(_listen, (sockaddr *)&bind_address, sizeof(bind_address)) < 0 ||
+      ::listen(_listen, HAPI_PREVIEW_CLIENTS) < 0 || ::pipe(_stop) < 0) {
+    std::string error = std::strerror(errno);
+    ::close(_listen);
+    throw std::runtime_error("Could not serve the preview on " + address +
+                             ":" + std::to_string(port) + ": " + error);
+  }
+  _accept = std::thread(&PreviewServer::accept_loop, this);
+}
+
+PreviewServer::~PreviewServer() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+  }
+  _cv.notify_all();
+  ssize_t n = ::write(_stop[1], "x", 1);
+  (void)n;
+  _accept.join();
+  for (auto &client : _clients) {
+    client._thread.join();
+  }
+  ::close(_listen);
+  ::close(_stop[0]);
+  ::close(_stop[1]);
+}
+
+void PreviewServer::publish(std::size_t stream, const uint8_t *data,
+                            std::size_t width, std::size_t height,
+                            std::size_t stride) {
+  std::size_t factor = 1;
+  if (_width > 0 && width > _width) {
+    factor = (width + _width - 1) / _width;
+  }
+  // encoded before taking the lock so clients only wait for the swap
+  std::shared_ptr<const std::string> frame =
+      std::make_shared<const std::string>(
+          bmp(data, width, height, stride, factor));
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _frames.at(stream) = frame;
+    _sequences[stream]++;
+  }
+  _cv.notify_all();
+}
+
+void PreviewServer::accept_loop() {
+  Logger &log = Logger::instance();
+  pollfd fds[2] = {{_listen, POLLIN, 0}, {_stop[0], POLLIN, 0}};
+  while (_running) {
+    if (::poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log.error() << "Preview server stopped: " << std::strerror(errno)
+                  << std::endl;
+      return;
+    }
+    if (fds[1].revents != 0) {
+      return;
+    }
+    int fd = ::accept4(_listen, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    // forget the clients that have left
+    std::size_t active = 0;
+    for (auto it = _clients.begin(); it != _clients.end();) {
+      if (it->_done) {
+        it->_thread.join();
+        it = _clients.erase(it);
+      } else {
+        active++;
+        it++;
+      }
+    }
+    if (active >= HAPI_PREVIEW_CLIENTS) {
+      respond(fd, "503 Service Unavailable", "text/plain",
+              "Too many preview clients.\n");
+      ::close(fd);
+      continue;
+    }
+    timeval timeout = {HAPI_PREVIEW_TIMEOUT_MS / 1000,
+                       (HAPI_PREVIEW_TIMEOUT_MS % 1000) * 1000};
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    _clients.emplace_back();
+    client_t &client = _clients.back();
+    client._thread = std::thread([this, &client, fd]() {
+      serve(fd);
+      ::close(fd);
+      client._done = true;
+    });
+  }
+}
+
+void PreviewServer::serve(int fd) {
+  // read the request head, only its first line matters
+  std::string request;
+  char buffer[1024];
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(HAPI_PREVIEW_TIMEOUT_MS);
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < 8192) {
+    if (!_running || std::chrono::steady_clock::now() > deadline) {
+      return;
+    }
+    pollfd p = {fd, POLLIN, 0};
+    if (::poll(&p, 1, HAPI_PREVIEW_SLICE_MS) <= 0) {
+      continue;
+    }
+    ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) {
+      return;
+    }
+    request.append(buffer, n);
+  }
+  std::istringstream line(request);
+  std::string method, path;
+  line >> method >> path;
+  if (method != "GET") {
+    respond(fd, "405 Method Not Allowed", "text/plain", "GET only.\n");
+    return;
+  }
+
+  if (path == "/") {
+    std::ostringstream page;
+    page << "<!DOCTYPE html><html><head><title>HAPI alignment</title></head>"
+         << "<body style=\"background:#000;margin:0\">";
+    for (std::size_t i = 0; i < _frames.size(); i++) {
+      page << "<img src=\"/stream/" << i << "\" style=\"max-width:"
+           << 100 / _frames.size() << "%\">";
+    }
+    page << "</body></html>\n";
+    respond(fd, "200 OK", "text/html", page.str());
+    return;
+  }
+
+  // /stream/<i> or /frame/<i>.bmp
+  bool stream = path.compare(0, 8, "/stream/") == 0;
+  bool frame = path.compare(0, 7, "/frame/") == 0;
+  char *end = nullptr;
+  const char *number = path.c_str() + (stream ? 8 : 7);
+  unsigned long index = std::strtoul(number, &end, 10);
+  if ((!stream && !frame) || end == number || index >= _frames.size() ||
+      (stream && *end != '\0') ||
+      (frame && std::strcmp(end, ".bmp") != 0)) {
+    respond(fd, "404 Not Found", "text/plain", "Not found.\n");
+    return;
+  }
+
+  unsigned long sequence = 0;
+  if (frame) {
+    std::shared_ptr<const std::string> latest;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      latest = _frames[index];
+    }
+    if (latest) {
+      respond(fd, "200 OK", "image/bmp", *latest);
+    } else {
+      respond(fd, "503 Service Unavailable", "text/plain", "No frame yet.\n");
+    }
+    return;
+  }
+  if (!send_all(fd,
+                "HTTP/1.0 200 OK\r\nContent-Type: multipart/x-mixed-replace; "
+                "boundary=" HAPI_PREVIEW_BOUNDARY
+                "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n")) {
+    return;
+  }
+  std::shared_ptr<const std::string> latest;
+  while ((latest = next(index, sequence)) != nullptr) {
+    std::ostringstream part;
+    part << "--" HAPI_PREVIEW_BOUNDARY "\r\nContent-Type: image/bmp\r\n"
+         << "Content-Length: " << latest->size() << "\r\n\r\n";
+    if (!send_all(fd, part.str()) || !send_all(fd, *latest) ||
+        !send_all(fd, "\r\n")) {
+      return;
+    }
+  }
+}
+
+std::shared_ptr<const std::string> PreviewServer::next(
+    std::size_t stream, unsigned long &sequence) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait(lock,
+           [&] { return !_running || _sequences[stream] != sequence; });
+  if (!_running) {
+    return nullptr;
+  }
+  // a slow client skips to the latest frame
+  sequence = _sequences[stream];
+  return _frames[stream];
+}
@@ -1,78 +1,303 @@
 #include "routines/acquisition.h"
 
+#include "blocking_queue.h"
 #include "board.h"
+#include "interval_timer.h"
+#include "laser_group.h"
 #include "logger.h"
+#include "pack12.h"
+#include "pmt_controller.h"
+#include "preview_server.h"
+#include "routines/os_utils.h"
 #include "routines/str_utils.h"
+#include "thermal_governor.h"
 
+#include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <stdexcept>
 #include <thread>
+#include <vector>
 
 #include <iostream>
 
 namespace hapi {
-extern volatile std::atomic<bool> running;
+// longest sleep while paused or holding off before checking for exit again
+#define HAPI_HOLD_SLICE std::chrono::milliseconds(100)
 
-void acquisition_loop(std::shared_ptr<USBCamera> &camera, OBISLaser &laser,
-                      std::filesystem::path &out_dir, std::string &image_type,
-                      std::chrono::milliseconds interval_time, HAPIMode mode) {
-  Board &board = Board::instance();
-  Logger &log = Logger::instance();
+// number of grabbed images that may wait for the writer thread before the
+// control thread starts dropping them. Together with the grab queues kept
+// below camera_buffers so every camera always has a free stream buffer.
+#define HAPI_FRAME_QUEUE_SIZE 4
 
-  if (use_camera(mode)) {
-    // begin acquisition
-    log.info() << "Beginning acquisition." << std::endl;
-    camera->begin_acquisition();
+// longest wait for the selected laser to come on before arming anyway
+#define HAPI_SELECT_WAIT std::chrono::milliseconds(200)
+
+// longest hold off between pmt triggers while a laser is hot, so a long quiet
+// spell doesn't stall acquisition
+#define HAPI_TRIGGER_HOLD_MAX std::chrono::seconds(10)
+
+// widest thumbnail in pixels
+#define HAPI_THUMB_WIDTH 600
+
+// triggers kept for naming the images from camera events, far more than can
+// be waiting in the frame queue
+#define HAPI_TRIGGER_LOG_SIZE 64
+
+/**
+ * trigger_log_t
+ *
+ * The triggers the control thread saw on the done line, so the writer can
+ * tell which one an image that came straight from a camera event belongs to.
+ * That is the last trigger before the image came in, allowing for the
+ * control thread seeing the done line up to window after the camera. The
+ * control thread logs a trigger as soon as it sees it, so it is there by the
+ * time the writer looks, and a trigger that still comes too late is counted.
+ */
+class trigger_log_t {
+ public:
+  struct trigger_t {
+    unsigned int _count;
+    std::string _time;
+    double _wavelength;
+    CameraGroup::clock::time_point _at;
+  };
+
+  trigger_log_t(std::size_t cameras, std::chrono::milliseconds window,
+                std::chrono::milliseconds timeout)
+      : _window(window), _timeout(timeout), _last(cameras, -1) {}
+
+  // control thread
+  void add(const trigger_t &trigger) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // an image of this trigger may have been discarded already
+    if (trigger._at <= _discarded) {
+      _late++;
+      Logger::instance().error()
+          << "Trigger " << trigger._count
+          << " was logged after its image was discarded." << std::endl;
+    }
+    _triggers.push_back(trigger);
+    if (_triggers.size() > HAPI_TRIGGER_LOG_SIZE) {
+      _triggers.pop_front();
+    }
+  }
+
+  // writer thread, names the frame after its trigger. False if it has none,
+  // e.g. from a spurious trigger, or its camera already had an image for it.
+  bool tag(frame_t &frame) {
+    Logger &log = Logger::instance();
+    std::size_t index = 0;
+    while (index < frame._images.size() && frame._images[index] == nullptr) {
+      index++;
+    }
+    CameraGroup::clock::time_point latest = frame._received + _window;
+    std::this_thread::sleep_until(latest);
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto t = _triggers.rbegin(); t != _triggers.rend(); t++) {
+      if (t->_at > latest) {
+        continue;
+      }
+      if (t->_at < frame._received - _timeout ||
+          (long long)t->_count <= _last[index]) {
+        break;
+      }
+      _last[index] = t->_count;
+      frame._count = t->_count;
+      frame._time = t->_time;
+      frame._wavelength = t->_wavelength;
+      return true;
+    }
+    _stale++;
+    _discarded = latest;
+    log.warning() << "Discarding an image of camera " << index
+                  << ", it matches no trigger." << std::endl;
+    return false;
+  }
+
+  // images that matched no trigger
+  unsigned long stale() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stale;
+  }
+
+  // triggers logged too late for the image they could have named
+  unsigned long late() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _late;
   }
 
+ private:
+  std::chrono::milliseconds _window;
+  std::chrono::milliseconds _timeout;
+  std::mutex _mutex;
+  std::deque<trigger_t> _triggers;
+  // the last trigger each camera's image was named after
+  std::vector<long long> _last;
+  unsigned long _stale{0};
+  // the latest a trigger could have been for the last discarded image
+  CameraGroup::clock::time_point _discarded;
+  unsigned long _late{0};
+};
+
+/**
+ * control_loop
+ *
+ * Arms the board, sends or waits for triggers, and grabs images. Runs on the
+ * real-time thread so it must not block on disk or anything slow. Slows down
+ * when the governor of the hottest laser says so and pauses while a laser
+ * has a temperature fault. When interleaving, switches to the next laser
+ * after each image. The cameras grab on their own threads, here it only
+ * waits for the images of each trigger. With camera events it doesn't wait
+ * at all, the images go straight to the writer and the triggers are only
+ * logged so the writer can name them.
+ */
+void control_loop(CameraGroup &cameras, LaserGroup &lasers,
+                  std::vector<ThermalGovernor> &governors,
+                  std::chrono::milliseconds interval_time, HAPIMode mode,
+                  BlockingQueue<frame_t> &frames, trigger_log_t *triggers,
+                  PMTController *controller, std::chrono::seconds pause_max,
+                  bool interleave) {
+  Board &board = Board::instance();
+  Logger &log = Logger::instance();
+
   // arm the board so it is ready to acquire images
-  log.info() << "Arming the HAPI-E board." << std::endl;
+  HAPI_INFO(log) << "Arming the HAPI-E board." << std::endl;
   board.arm();
 
   unsigned int image_count = 0;
 
-  std::chrono::high_resolution_clock::time_point current_time =
-      std::chrono::high_resolution_clock::now();
-  std::chrono::high_resolution_clock::time_point last_time = current_time;
+  IntervalTimer timer(interval_time);
+  bool interval = mode == HAPIMode::INTERVAL || mode == HAPIMode::ALIGN;
+  if (interval) {
+    timer.start();
+  }
 
-  log.info() << "Entering main loop." << std::endl;
+  // sleeps in slices so an exit request is seen, false if it was
+  auto hold = [&](std::chrono::microseconds t) {
+    auto end = std::chrono::steady_clock::now() + t;
+    while (running) {
+      auto left = end - std::chrono::steady_clock::now();
+      if (left <= std::chrono::steady_clock::duration::zero()) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+          left, HAPI_HOLD_SLICE));
+    }
+    return false;
+  };
+  // waits out a temperature fault, other faults or one that lasts too long
+  // stop acquisition. The monitor threads read the lasers, here it is only
+  // atomic loads. Returns false if acquisition should stop.
+  auto fault_ok = [&]() {
+    bool paused = false;
+    auto end = std::chrono::steady_clock::now() + pause_max;
+    FaultCode fault;
+    while ((fault = lasers.fault()) != 0) {
+      if (!ThermalGovernor::is_thermal(fault)) {
+        log.error() << "Stopping on laser fault." << std::endl;
+        running = false;
+        return false;
+      }
+      if (!paused) {
+        log.warning() << "Laser over temperature. Pausing up to "
+                      << pause_max.count() << " s." << std::endl;
+        end = std::chrono::steady_clock::now() + pause_max;
+        paused = true;
+      }
+      if (std::chrono::steady_clock::now() >= end) {
+        log.error() << "Laser did not cool down. Stopping." << std::endl;
+        running = false;
+        return false;
+      }
+      if (!hold(HAPI_HOLD_SLICE)) {
+        return false;
+      }
+    }
+    if (paused) {
+      HAPI_INFO(log) << "Laser cooled down. Resuming." << std::endl;
+      if (interval) {
+        // don't fire the deadlines missed while paused
+        timer.start();
+      }
+    }
+    return running.load();
+  };
+  // waits for the selected laser to be the only one on, returns its index
+  // or -1 if it didn't come on in time
+  auto wait_selected = [&]() {
+    auto end = std::chrono::steady_clock::now() + HAPI_SELECT_WAIT;
+    int emitting;
+    while ((emitting = lasers.emitting()) != (int)lasers.selected() &&
+           running && std::chrono::steady_clock::now() < end) {
+      std::this_thread::yield();
+    }
+    if (emitting < 0) {
+      log.warning() << "Lasers still switching, wavelength unknown."
+                    << std::endl;
+    }
+    return emitting;
+  };
+  std::vector<unsigned long> snapshot_sequences(lasers.size(), 0);
+  // the governor of the hottest laser sets the pace
+  std::size_t slowest = 0;
+
+  HAPI_INFO(log) << "Entering main loop." << std::endl;
   while (running) {
+    if (!fault_ok()) {
+      break;
+    }
+    bool changed = false;
+    for (std::size_t i = 0; i < lasers.size(); i++) {
+      const LaserMonitor::snapshot_t &snapshot = lasers.monitor(i).snapshot();
+      if (snapshot._sequence != snapshot_sequences[i]) {
+        snapshot_sequences[i] = snapshot._sequence;
+        changed = governors[i].update(snapshot) || changed;
+      }
+    }
+    if (changed) {
+      slowest = 0;
+      for (std::size_t i = 1; i < governors.size(); i++) {
+        if (governors[i].duty() < governors[slowest].duty()) {
+          slowest = i;
+        }
+      }
+      HAPI_INFO(log) << "Laser temperature governor: "
+                     << governors[slowest].duty() * 100
+                     << "% of the nominal image rate." << std::endl;
+      if (interval) {
+        timer.set_period(governors[slowest].stretch(interval_time));
+      }
+    }
     if (mode == HAPIMode::CW) {
-      std::this_thread::yield();
+      // nothing to trigger, only the lasers to watch
+      std::this_thread::sleep_for(HAPI_HOLD_SLICE);
       continue;
     }
-    log.info() << "Arming HAPI-E board." << std::endl;
+    int emitting = interleave ? wait_selected() : -1;
+    HAPI_INFO(log) << "Arming HAPI-E board." << std::endl;
     board.arm();
-    if (mode == HAPIMode::INTERVAL || mode == HAPIMode::ALIGN) {
-      log.info() << "Waiting for interval." << std::endl;
-      while (std::chrono::duration_cast<std::chrono::milliseconds>(
-                 current_time - last_time)
-                 .count() < interval_time.count()) {
-        current_time = std::chrono::high_resolution_clock::now();
-        FaultCode fault = laser.fault();
-        if (fault != 0) {
-          std::vector<OBISLaser::FaultBits> faults = laser.fault_bits(fault);
-          for (auto f : faults) {
-            log.error() << "Laser fault: " << laser.fault_str(f) << std::endl;
-          }
-          // TODO: be able to handle some types of laser faults (overheating)
-          running = false;
-        }
-        if (running) {
-          std::this_thread::yield();
-        } else {
-          break;
-        }
-      }
-      if (running) {
-        log.info() << "Sending trigger." << std::endl;
-        board.trigger();
+    auto armed = std::chrono::steady_clock::now();
+    if (interval) {
+      HAPI_INFO(log) << "Waiting for interval." << std::endl;
+      if (!timer.wait(running)) {
+        HAPI_INFO(log) << "Exit requested." << std::endl;
+        break;
       }
+      HAPI_INFO(log) << "Sending trigger." << std::endl;
+      board.trigger();
     } else {
-      log.info() << "Waiting for trigger." << std::endl;
+      HAPI_INFO(log) << "Waiting for trigger." << std::endl;
     }
     // wait for the board to signal it has taken an image
     while (!board.is_done()) {
-      if (running) {
+      if (running && lasers.fault() == 0) {
         std::this_thread::yield();
       } else {
         // exit the program if signaled
@@ -81,93 +306,473 @@ void acquisition_loop(std::shared_ptr<USBCamera> &camera, OBISLaser &laser,
     }
     // exit if no image was captured and the program was signaled to exit
     if (!board.is_done() && !running) {
-      log.info() << "Exit requested." << std::endl;
+      HAPI_INFO(log) << "Exit requested." << std::endl;
       break;
     };
-    log.info() << "Trigger recieved." << std::endl;
+    // a laser fault came up while waiting, the top of the loop decides
+    // whether to pause or stop
+    if (!board.is_done()) {
+      board.disarm();
+      continue;
+    }
+    CameraGroup::clock::time_point triggered = CameraGroup::clock::now();
+    HAPI_INFO(log) << "Trigger recieved." << std::endl;
     // get the time the image was taken
     std::string image_time = str_time();
+    // a camera triggered by the board has its image on the way already, the
+    // writer must find the trigger before disarming's pin delays are over
+    if (triggers != nullptr) {
+      triggers->add(trigger_log_t::trigger_t{
+          image_count, image_time,
+          emitting >= 0 ? lasers.wavelength(emitting) : 0, triggered});
+      image_count++;
+    }
     // disarm the board so no other images can be captured while we process
     // the current one
-    log.info() << "Disarming the HAPI-E board." << std::endl;
+    HAPI_INFO(log) << "Disarming the HAPI-E board." << std::endl;
     board.disarm();
 
-    if (use_camera(mode)) {
+    if (triggers != nullptr) {
+      cameras.trigger();
+    } else if (use_camera(mode)) {
+      frame_t frame;
+      std::size_t collected = 0;
       try {
-        acquire_image(camera, out_dir, image_type, image_count, image_time,
-                      mode);
-        image_count++;
+        // get the images of this trigger from the cameras
+        HAPI_INFO(log) << "Acquiring images from " << cameras.size()
+                       << " camera(s)." << std::endl;
+        cameras.trigger();
+        collected = cameras.collect(frame._images, triggered);
       } catch (const std::exception &ex) {
         log.exception(ex) << "Failed to acquire image." << std::endl;
         break;
       }
+      for (std::size_t i = 0; i < cameras.size(); i++) {
+        frame._suffixes.push_back(cameras.size() > 1 ? "_" + cameras.serial(i)
+                                                     : "");
+      }
+      frame._count = image_count;
+      frame._time = image_time;
+      frame._wavelength = emitting >= 0 ? lasers.wavelength(emitting) : 0;
+      if (collected == 0) {
+        log.error() << "No camera delivered an image." << std::endl;
+      } else if (frames.try_push(frame)) {
+        image_count++;
+      } else {
+        log.warning() << "Writer is behind. Dropping image." << std::endl;
+        for (auto &image : frame._images) {
+          if (image != nullptr) {
+            image->Release();
+          }
+        }
+      }
+    }
+    if (controller != nullptr) {
+      controller->update();
+    }
+    if (interleave) {
+      // switches while the frame is handed off and the board re-arms
+      lasers.select((lasers.selected() + 1) % lasers.size());
+    }
+    // pmt triggers can't be slowed down at the source, hold off re-arming so
+    // the time from one arm to the next is stretched by the duty
+    if (mode == HAPIMode::TRIGGER && governors[slowest].duty() < 1) {
+      auto cycle = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - armed);
+      hold(std::min<std::chrono::microseconds>(
+          governors[slowest].stretch(cycle) - cycle, HAPI_TRIGGER_HOLD_MAX));
     }
   }
 
-  if (use_camera(mode)) {
-    log.info() << "Ending acquisition." << std::endl;
-    camera->end_acquisition();
+  if (interval) {
+    IntervalTimer::stats_t stats = timer.stats();
+    HAPI_INFO(log) << "Trigger schedule: " << stats._count << " triggers, "
+                   << stats._missed << " missed deadlines." << std::endl;
+    HAPI_INFO(log) << "    Period (us): mean " << stats._period_mean << " min "
+                   << stats._period_min << " max " << stats._period_max
+                   << " jitter " << stats._jitter << std::endl;
+    HAPI_INFO(log) << "    Wake up lateness (us): mean " << stats._late_mean
+                   << " max " << stats._late_max << std::endl;
   }
 }
 
-void acquire_image(std::shared_ptr<USBCamera> &camera,
-                   std::filesystem::path &out_dir, std::string &image_type,
-                   unsigned int image_count, const std::string &image_time,
-                   HAPIMode mode) {
+/**
+ * writer_loop
+ *
+ * Saves images handed over by the control thread, or by the camera events,
+ * until it is done.
+ */
+void writer_loop(BlockingQueue<frame_t> &frames, trigger_log_t *triggers,
+                 std::filesystem::path &out_dir, std::string &image_type,
+                 HAPIMode mode, PMTController *controller,
+                 PreviewServer *preview) {
   Logger &log = Logger::instance();
-  // get the image from the camera
-  log.info() << "Acquiring image from camera." << std::endl;
-  Spinnaker::ImagePtr result = camera->acquire_image();
-  if (result->IsIncomplete()) {
-    log.info() << "Image incomplete with status " << result->GetImageStatus()
-               << "." << std::endl;
-  } else {
-    if (mode != HAPIMode::ALIGN && image_count == 0) {
-      if (!std::filesystem::exists(out_dir)) {
-        log.info() << "First image. Creating output directory." << std::endl;
-        // creates out dir and thumbnail dir in one command
-        std::filesystem::create_directories(
-            out_dir / (out_dir.stem().string() + "_thumbs"));
+  frame_t frame;
+  while (frames.pop(frame)) {
+    try {
+      if (frame._event && !triggers->tag(frame)) {
+        for (auto &image : frame._images) {
+          if (image != nullptr) {
+            image->Release();
+          }
+        }
+        frame._images.clear();
+        continue;
       }
+      // the pmt is tuned against the first camera, an event frame only has
+      // the image of one
+      if (controller != nullptr && !frame._images.empty() &&
+          frame._images[0] != nullptr) {
+        controller->classify(frame._images[0]);
+      }
+      save_image(frame, out_dir, image_type, mode, preview);
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Failed to save image." << std::endl;
     }
-    if (!std::filesystem::exists("/var/www/hapi/")) {
-      log.info() << "Creating /var/www/hapi/ directory." << std::endl;
-      std::filesystem::create_directories("/var/www/hapi/");
+    frame._images.clear();
+  }
+}
+
+void acquisition_loop(CameraGroup &cameras, LaserGroup &lasers,
+                      std::filesystem::path &out_dir, std::string &image_type,
+                      std::chrono::milliseconds interval_time, HAPIMode mode,
+                      Config &config) {
+  Logger &log = Logger::instance();
+  int rt_cpu = config.get<int>("rt_cpu");
+  int rt_priority = config.get<int>("rt_priority");
+
+  BlockingQueue<frame_t> frames(HAPI_FRAME_QUEUE_SIZE);
+  std::unique_ptr<trigger_log_t> triggers;
+  if (use_camera(mode)) {
+    // begin acquisition, the grab threads start here
+    HAPI_INFO(log) << "Beginning acquisition on " << cameras.size()
+                   << " camera(s)." << std::endl;
+    std::chrono::milliseconds window(
+        config.get<unsigned int>("camera_match_window"));
+    std::chrono::milliseconds timeout(
+        config.get<unsigned int>("camera_timeout"));
+    cameras.set_window(window);
+    cameras.set_timeout(timeout);
+    CameraGroup::sink_t sink;
+    if (config.get<bool>("camera_events")) {
+      HAPI_INFO(log) << "Taking images from camera events." << std::endl;
+      triggers.reset(new trigger_log_t(cameras.size(), window, timeout));
+      std::vector<std::string> suffixes;
+      for (std::size_t i = 0; i < cameras.size(); i++) {
+        suffixes.push_back(cameras.size() > 1 ? "_" + cameras.serial(i) : "");
+      }
+      // each image goes to the writer on its own as soon as it completes
+      sink = [&log, &frames, suffixes](std::size_t index,
+                                       Spinnaker::ImagePtr image,
+                                       CameraGroup::clock::time_point at) {
+        if (!running) {
+          return false;
+        }
+        frame_t frame;
+        frame._images.assign(suffixes.size(), nullptr);
+        frame._images[index] = image;
+        frame._suffixes = suffixes;
+        frame._event = true;
+        frame._received = at;
+        if (!frames.try_push(frame)) {
+          log.warning() << "Writer is behind. Dropping image." << std::endl;
+          return false;
+        }
+        return true;
+      };
+    }
+    cameras.begin(config.get<unsigned int>("camera_buffers"), sink);
+  }
+
+  // only pmt triggers can be tuned
+  std::unique_ptr<PMTController> controller;
+  if (mode == HAPIMode::TRIGGER && config.get<bool>("pmt_control")) {
+    HAPI_INFO(log) << "Adjusting the PMT during acquisition." << std::endl;
+    controller.reset(new PMTController(config));
+  }
+
+  lasers.start_monitors(
+      std::chrono::milliseconds(
+          config.get<unsigned int>("laser_monitor_period")),
+      [&log, &lasers](std::size_t index, FaultCode fault,
+                      const LaserMonitor::snapshot_t &snapshot) {
+        const std::string &device = lasers.device(index);
+        if (fault == 0) {
+          HAPI_INFO(log) << "Laser faults cleared on " << device << "."
+                         << std::endl;
+          return;
+        }
+        for (auto f : OBISLaser::fault_bits(fault)) {
+          log.error() << "Laser fault on " << device << ": "
+                      << OBISLaser::fault_str(f) << std::endl;
+        }
+        log.error() << "Laser temperatures: baseplate "
+                    << snapshot._telemetry._baseplateTemp << " C, diode "
+                    << snapshot._telemetry._diodeTemp << " C, internal "
+                    << snapshot._telemetry._internalTemp << " C"
+                    << std::endl;
+      });
+  HAPI_INFO(log) << "Started " << lasers.size() << " laser monitor(s)."
+                 << std::endl;
+  std::vector<ThermalGovernor> governors;
+  for (std::size_t i = 0; i < lasers.size(); i++) {
+    governors.emplace_back(lasers.laser(i).sys_info(), config);
+  }
+  std::chrono::seconds pause_max(config.get<unsigned int>("thermal_pause_max"));
+  bool interleave = config.get<bool>("laser_interleave") && lasers.size() > 1;
+  if (interleave) {
+    HAPI_INFO(log) << "Interleaving " << lasers.size() << " lasers."
+                   << std::endl;
+    lasers.select(0);
+  }
+
+  // aligning streams previews from memory instead of saving every frame
+  std::unique_ptr<PreviewServer> preview;
+  if (mode == HAPIMode::ALIGN) {
+    std::string address = config.get<std::string>("preview_bind");
+    unsigned int port = config.get<unsigned int>("preview_port");
+    try {
+      unsigned int width = config.get<unsigned int>("preview_width");
+      preview.reset(new PreviewServer(address, port, cameras.size(), width));
+      HAPI_INFO(log) << "Serving the alignment preview on " << address << ":"
+                     << port << "." << std::endl;
+    } catch (const std::exception &ex) {
+      log.exception(ex) << "Saving the alignment images to disk instead."
+                        << std::endl;
+    }
+  }
+  std::thread writer(writer_loop, std::ref(frames), triggers.get(),
+                     std::ref(out_dir), std::ref(image_type), mode,
+                     controller.get(), preview.get());
+
+  // main already did this before startup, again for the grab threads the
+  // cameras and libraries started since, which may have set their own
+  set_non_realtime(rt_cpu);
+  std::exception_ptr error;
+  std::thread control([&]() {
+    if (!set_realtime(rt_priority, rt_cpu)) {
+      log.warning() << "Running control thread without real-time priority."
+                    << std::endl;
+    }
+    try {
+      control_loop(cameras, lasers, governors, interval_time, mode, frames,
+                   triggers.get(), controller.get(), pause_max, interleave);
+    } catch (...) {
+      error = std::current_exception();
+    }
+  });
+  control.join();
+  lasers.stop_monitors();
+  if (lasers.errors() > 0) {
+    log.warning() << "Laser monitors: " << lasers.errors() << " failed polls."
+                  << std::endl;
+  }
+
+  // let the writer finish what is already queued
+  frames.close();
+  writer.join();
+
+  if (use_camera(mode)) {
+    HAPI_INFO(log) << "Ending acquisition." << std::endl;
+    cameras.end();
+    HAPI_INFO(log) << "Cameras: " << cameras.dropped() << " dropped, "
+                   << cameras.stale() << " stale, " << cameras.missed()
+                   << " missed images, " << cameras.skipped() << " lost frames."
+                   << std::endl;
+    if (triggers) {
+      HAPI_INFO(log) << "Camera events: " << triggers->stale()
+                     << " images matched no trigger, " << triggers->late()
+                     << " triggers logged too late." << std::endl;
+    }
+    for (std::size_t i = 0; i < cameras.size(); i++) {
+      try {
+        HAPI_INFO(log) << "Camera " << cameras.serial(i)
+                       << " stream statistics:" << std::endl;
+        for (auto const &stat : cameras.camera(i).stream_stats()) {
+          HAPI_INFO(log) << "    " << stat.first << ": " << stat.second
+                         << std::endl;
+        }
+      } catch (const std::exception &ex) {
+        log.exception(ex) << "Failed to read the stream statistics."
+                          << std::endl;
+      }
+    }
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+/**
+ * save_packed12
+ *
+ * Writes a Mono12p or Mono16 image as a .p12 file: a header like a pgm's,
+ * "P12", the width and height and the maximum value, then the rows packed by
+ * pack12. Mono12p images come packed from the camera and are written as they
+ * are, Mono16 ones are packed first so they take 1.5 bytes per pixel too.
+ * hapi-unpack12 turns the file into a 16 bit pgm.
+ */
+void save_packed12(Spinnaker::ImagePtr &image,
+                   const std::filesystem::path &fname) {
+  std::size_t width = image->GetWidth();
+  std::size_t height = image->GetHeight();
+  std::size_t stride = image->GetStride();
+  if (width % 2 != 0) {
+    // rows have to end on a whole byte to match the camera's packing
+    throw std::runtime_error("12 bit images need an even width.");
+  }
+  std::size_t row = packed12_size(width);
+  const char *data = (const char *)image->GetData();
+  std::ofstream out(fname.string(), std::ios::binary);
+  if (!out) {
+    throw std::runtime_error("Failed to open " + fname.string() + ".");
+  }
+  out << "P12\n" << width << " " << height << "\n4095\n";
+  if (image->GetPixelFormat() == Spinnaker::PixelFormat_Mono12p) {
+    if (stride == row) {
+      out.write(data, row * height);
+    } else {
+      for (std::size_t y = 0; y < height; y++) {
+        out.write(data + y * stride, row);
+      }
+    }
+  } else {
+    std::vector<uint8_t> packed(row * height);
+    for (std::size_t y = 0; y < height; y++) {
+      pack12((const uint16_t *)(data + y * stride), &packed[y * row], width);
+    }
+    out.write((const char *)packed.data(), packed.size());
+  }
+  if (!out) {
+    throw std::runtime_error("Failed to write " + fname.string() + ".");
+  }
+}
+
+/**
+ * save_thumbnail
+ *
+ * Shrinks a mono 8 bit image to at most HAPI_THUMB_WIDTH pixels across,
+ * averaging each block of pixels, and saves only the small image.
+ */
+void save_thumbnail(Spinnaker::ImagePtr &image,
+                    const std::filesystem::path &fname) {
+  std::size_t width = image->GetWidth();
+  std::size_t height = image->GetHeight();
+  std::size_t stride = image->GetStride();
+  std::size_t factor = (width + HAPI_THUMB_WIDTH - 1) / HAPI_THUMB_WIDTH;
+  factor = std::max<std::size_t>(factor, 1);
+  std::size_t w = width / factor;
+  std::size_t h = height / factor;
+  std::size_t area = factor * factor;
+  const uint8_t *data = (const uint8_t *)image->GetData();
+  std::vector<uint8_t> pixels(w * h);
+  for (std::size_t y = 0; y < h; y++) {
+    const uint8_t *src = data + y * factor * stride;
+    for (std::size_t x = 0; x < w; x++) {
+      unsigned int sum = 0;
+      for (std::size_t j = 0; j < factor; j++) {
+        const uint8_t *p = src + j * stride + x * factor;
+        for (std::size_t i = 0; i < factor; i++) {
+          sum += p[i];
+        }
+      }
+      pixels[y * w + x] = sum / area;
     }
+  }
+  Spinnaker::ImagePtr thumb = Spinnaker::Image::Create(
+      w, h, 0, 0, Spinnaker::PixelFormat_Mono8, pixels.data());
+  thumb->Save(fname.string().c_str());
+}
+
+/**
+ * save_one
+ *
+ * Saves and thumbnails one camera's image of a frame. Only the first camera
+ * updates the web page preview. With a preview server the image only goes
+ * to its clients.
+ */
+void save_one(frame_t &frame, std::size_t index,
+              std::filesystem::path &out_dir, std::string &image_type,
+              HAPIMode mode, PreviewServer *preview) {
+  Logger &log = Logger::instance();
+  Spinnaker::ImagePtr &result = frame._images[index];
+  unsigned int image_count = frame._count;
+  // when the lasers take turns the name says which one lit the frame
+  std::string image_time = frame._time;
+  if (frame._wavelength > 0) {
+    image_time += "_" + std::to_string((int)std::round(frame._wavelength)) +
+                  "nm";
+  }
+  image_time += frame._suffixes[index];
+  bool web_page = index == 0;
+  if (result->IsIncomplete()) {
+    HAPI_INFO(log) << "Image incomplete with status "
+                   << result->GetImageStatus() << "." << std::endl;
+  } else {
     // save the image
-    log.info() << "Converting image to mono 8 bit with no color processing."
-               << std::endl;
+    HAPI_INFO(log) << "Converting image to mono 8 bit with no color processing."
+                   << std::endl;
     Spinnaker::ImagePtr converted = result->Convert(
         Spinnaker::PixelFormat_Mono8, Spinnaker::NO_COLOR_PROCESSING);
     std::filesystem::path fname;
     std::filesystem::path last = "/var/www/hapi/last.png";
-    if (mode == HAPIMode::ALIGN) {
-      fname = "/var/www/hapi/biglast.tiff";
-      log.info() << "Saving image (" << image_count << ") " << fname << "."
-                 << std::endl;
+    if (preview != nullptr) {
+      // straight from memory to the browsers, nothing touches the disk
+      preview->publish(index, (const uint8_t *)converted->GetData(),
+                       converted->GetWidth(), converted->GetHeight(),
+                       converted->GetStride());
+    } else if (mode == HAPIMode::ALIGN) {
+      fname = "/var/www/hapi/biglast" + frame._suffixes[index] + ".tiff";
+      HAPI_INFO(log) << "Saving image (" << image_count << ") " << fname << "."
+                     << std::endl;
       converted->Save(fname.string().c_str());
-      log.info() << "Creating thumbnail image." << std::endl;
-      std::string convert = "sudo convert " + fname.string() +
-                            " -thumbnail 600 " + last.string() + " &";
-      std::system(convert.c_str());
+      if (web_page) {
+        HAPI_INFO(log) << "Creating thumbnail image." << std::endl;
+        std::string convert = "sudo convert " + fname.string() +
+                              " -thumbnail " +
+                              std::to_string(HAPI_THUMB_WIDTH) + " " +
+                              last.string() + " &";
+        std::system(convert.c_str());
+      }
     } else {
-      fname = out_dir / (image_time + "." + image_type);
-      log.info() << "Saving image (" << image_count << ") " << fname << "."
-                 << std::endl;
-      converted->Save(fname.string().c_str());
       std::filesystem::path thumb =
           out_dir / (out_dir.stem().string() + "_thumbs");
       thumb /= image_time + "_thumb" + "." + image_type;
-      log.info() << "Creating thumbnail image." << std::endl;
-      std::string convert = "sudo convert " + fname.string() +
-                            " -thumbnail 600 " + thumb.string();
-      std::string convert_last =
-          "sudo convert " + thumb.string() + " " + last.string();
-      std::string cmd = "(" + convert + " && " + convert_last + ") &";
-      std::system(cmd.c_str());
+      Spinnaker::PixelFormatEnums format = result->GetPixelFormat();
+      std::string cmd;
+      if (format == Spinnaker::PixelFormat_Mono12p ||
+          format == Spinnaker::PixelFormat_Mono16) {
+        // the full depth goes to the packed file, the 8 bit conversion only
+        // makes the thumbnail, which is shrunk in memory so the full size 8
+        // bit image is never written
+        fname = out_dir / (image_time + ".p12");
+        HAPI_INFO(log) << "Saving 12 bit image (" << image_count << ") "
+                       << fname << "." << std::endl;
+        save_packed12(result, fname);
+        HAPI_INFO(log) << "Creating thumbnail image." << std::endl;
+        save_thumbnail(converted, thumb);
+      } else {
+        fname = out_dir / (image_time + "." + image_type);
+        HAPI_INFO(log) << "Saving image (" << image_count << ") " << fname
+                       << "." << std::endl;
+        converted->Save(fname.string().c_str());
+        HAPI_INFO(log) << "Creating thumbnail image." << std::endl;
+        cmd = "sudo convert " + fname.string() + " -thumbnail " +
+              std::to_string(HAPI_THUMB_WIDTH) + " " + thumb.string();
+      }
+      if (web_page) {
+        std::string convert_last =
+            "sudo convert " + thumb.string() + " " + last.string();
+        cmd = cmd.empty() ? convert_last
+                          : "(" + cmd + " && " + convert_last + ")";
+      }
+      if (!cmd.empty()) {
+        std::system((cmd + " &").c_str());
+      }
     }
   }
-  log.info() << "Releasing image." << std::endl;
+  HAPI_INFO(log) << "Releasing image." << std::endl;
   result->Release();
   // wait for image to be freed before we arm
   while (result->IsInUse()) {
@@ -175,6 +780,55 @@ void acquire_image(std::shared_ptr<USBCamera> &camera,
   }
 }
 
+void save_image(frame_t &frame, std::filesystem::path &out_dir,
+                std::string &image_type, HAPIMode mode,
+                PreviewServer *preview) {
+  Logger &log = Logger::instance();
+  // the first trigger's images may have been dropped, so any image can be
+  // the first one saved
+  if (mode != HAPIMode::ALIGN) {
+    if (!std::filesystem::exists(out_dir)) {
+      HAPI_INFO(log) << "First image. Creating output directory." << std::endl;
+      // creates out dir and thumbnail dir in one command
+      std::filesystem::create_directories(
+          out_dir / (out_dir.stem().string() + "_thumbs"));
+    }
+  }
+  if (preview == nullptr && !std::filesystem::exists("/var/www/hapi/")) {
+    HAPI_INFO(log) << "Creating /var/www/hapi/ directory." << std::endl;
+    std::filesystem::create_directories("/var/www/hapi/");
+  }
+  // the cameras' images are converted and written at the same time
+  std::vector<std::future<void>> saved;
+  for (std::size_t i = 1; i < frame._images.size(); i++) {
+    if (frame._images[i] != nullptr) {
+      saved.push_back(std::async(std::launch::async, save_one, std::ref(frame),
+                                 i, std::ref(out_dir), std::ref(image_type),
+                                 mode, preview));
+    }
+  }
+  std::exception_ptr error;
+  try {
+    if (!frame._images.empty() && frame._images[0] != nullptr) {
+      save_one(frame, 0, out_dir, image_type, mode, preview);
+    }
+  } catch (...) {
+    error = std::current_exception();
+  }
+  for (auto &s : saved) {
+    try {
+      s.get();
+    } catch (...) {
+      if (!error) {
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
 bool use_camera(HAPIMode mode) {
   return mode == HAPIMode::INTERVAL || mode == HAPIMode::TRIGGER ||
          mode == HAPIMode::ALIGN;
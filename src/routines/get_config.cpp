@@ -2,20 +2,60 @@
 #include "logger.h"
 #include "routines/str_utils.h"
 
+#include <stdexcept>
+
 namespace hapi {
 // default configuration parameters
 std::map<std::string, std::string> config_defaults = {
     {"output", "hapi/"},       {"camera_trigger", "1"}, {"delay", "0b1000"},
     {"exp", "0b0010"},         {"pulse", "0b01111"},    {"image_type", "tiff"},
     {"pmt_threshold", "0x85"}, {"pmt_gain", "0xc0"},    {"interval", "3000"},
-    {"camera_gain", "44.0"}};  // old camera gain 47.994267
+    {"camera_gain", "44.0"},  // old camera gain 47.994267
+    {"rt_cpu", "3"},           {"rt_priority", "80"},
+    {"trigger_width", "100"},  {"laser_timeout", "1000"},
+    {"laser_retries", "2"},    {"laser_monitor_period", "1000"},
+    // usb ids of the Coherent OBIS, an empty serial number takes any laser.
+    // laser_serial can list several, e.g. one per wavelength.
+    {"laser_vid", "0x0d4d"},   {"laser_pid", "0x003d"},
+    {"laser_serial", ""},      {"laser_count", "1"},
+    {"laser_interleave", "0"},
+    // cameras sharing the trigger, an empty list takes every camera found
+    {"camera_serial", ""},     {"camera_buffers", "10"},
+    {"camera_match_window", "20"}, {"camera_timeout", "1000"},
+    // 1 has the driver hand images to the writer as they complete, the done
+    // line only tells which trigger they belong to
+    {"camera_events", "0"},
+    // usb bandwidth cap per camera in bytes/s, 0 for none. camera_probe runs
+    // the cameras free for that many ms at startup and reports their rate.
+    {"camera_throughput_limit", "0"}, {"camera_probe", "0"},
+    // mono8, or mono12p or mono16 to keep 12 bits, stored packed as .p12
+    {"camera_pixel_format", "mono8"},
+    // align mode preview over http, see PreviewServer. Only this machine can
+    // see it unless preview_bind is set to 0.0.0.0 or an interface's address.
+    {"preview_bind", "127.0.0.1"},
+    {"preview_port", "8080"},  {"preview_width", "640"},
+    {"preview_interval", "100"},
+    // laser temperature governor, see ThermalGovernor
+    {"thermal_margin", "5.0"}, {"thermal_min_duty", "0.1"},
+    {"thermal_pause_max", "600"},
+    // online pmt adjustment in trigger mode, see PMTController
+    {"pmt_control", "0"},      {"pmt_control_window", "20"},
+    {"pmt_control_step", "1"}, {"pmt_rate_max", "5.0"},
+    {"pmt_empty_high", "0.5"}, {"pmt_empty_low", "0.1"},
+    {"pmt_empty_diff", "0.02"}, {"pmt_gain_min", "0xa0"},
+    {"pmt_gain_max", "0xe0"},  {"pmt_threshold_min", "0x60"},
+    {"pmt_threshold_max", "0xa0"},
+    // lowest level logged, debug, info, warning, error or critical. What to
+    // do when logging outpaces the console: block, drop, or drop_info to drop
+    // only debug and info messages.
+    {"log_level", "info"},     {"log_drop", "drop_info"}};
 
 Config get_config() {
   Logger &log = Logger::instance();
   // load config
   Config config(config_defaults);
   std::filesystem::path config_path = "/etc/hapi/hapi.conf";
-  log.info() << "Loading config from " << config_path << "." << std::endl;
+  HAPI_INFO(log) << "Loading config from " << config_path << "." << std::endl;
   try {
     if (std::filesystem::exists(config_path)) {
       config.load(config_path);
@@ -26,9 +66,9 @@ Config get_config() {
     log.exception(ex) << "Failed to load config. Using defaults." << std::endl;
     config = Config(config_defaults);
   }
-  log.info() << "Config:" << std::endl;
+  HAPI_INFO(log) << "Config:" << std::endl;
   for (auto const &item : config.items()) {
-    log.info() << "    " << item.first << ": " << item.second << std::endl;
+    HAPI_INFO(log) << "    " << item.first << ": " << item.second << std::endl;
   }
   return config;
 }
@@ -36,7 +76,7 @@ Config get_config() {
 std::string get_image_type(Config &config) {
   Logger &log = Logger::instance();
   // get the image type from the config. default to png
-  log.info() << "Loading image type from the config." << std::endl;
+  HAPI_INFO(log) << "Loading image type from the config." << std::endl;
   std::string image_type;
   try {
     image_type = config.get<std::string>("image_type");
@@ -55,10 +95,35 @@ std::string get_image_type(Config &config) {
         << std::endl;
     image_type = "png";
   }
-  log.info() << "Image type set to " << image_type << std::endl;
+  HAPI_INFO(log) << "Image type set to " << image_type << std::endl;
   return image_type;
 }
 
+void configure_logger(Config &config) {
+  Logger &log = Logger::instance();
+  try {
+    log.set_level(Logger::parse_level(config["log_level"]));
+  } catch (const std::invalid_argument &ex) {
+    log.exception(ex) << "Defaulting to info." << std::endl;
+    log.set_level(Logger::LogLevel::INFO);
+  }
+  std::string drop = config["log_drop"];
+  lower(drop);
+  if (drop == "block") {
+    log.set_drop_policy(Logger::DropPolicy::BLOCK);
+  } else if (drop == "drop") {
+    log.set_drop_policy(Logger::DropPolicy::DROP);
+  } else {
+    if (drop != "drop_info") {
+      log.warning() << "Unsupported log drop policy given: " << drop
+                    << ". Defaulting to drop_info." << std::endl;
+      drop = "drop_info";
+    }
+    log.set_drop_policy(Logger::DropPolicy::DROP_INFO);
+  }
+  HAPI_INFO(log) << "Log drop policy set to " << drop << std::endl;
+}
+
 std::filesystem::path get_out_dir(std::string &start_time, Config &config) {
   Logger &log = Logger::instance();
   std::filesystem::path out_dir;
@@ -71,7 +136,7 @@ std::filesystem::path get_out_dir(std::string &start_time, Config &config) {
     out_dir = std::filesystem::current_path();
   }
   out_dir /= start_time;
-  log.info() << "Output directory set to " << out_dir << std::endl;
+  HAPI_INFO(log) << "Output directory set to " << out_dir << std::endl;
   return out_dir;
 }
 };  // namespace hapi
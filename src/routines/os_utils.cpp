@@ -1,17 +1,31 @@
 #include "routines/os_utils.h"
 
+#include <algorithm>
 #include <array>
+#include <cerrno>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <memory>
 
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "logger.h"
 
+// where the kernel lists tty devices, each links to its usb interface
+#define HAPI_SYSFS_TTY "/sys/class/tty"
+
+// one entry per thread of this process
+#define HAPI_PROC_TASKS "/proc/self/task"
+
 // bool that states whether the program should remain running
 
 namespace hapi {
@@ -24,10 +38,12 @@ void signal_handler(int sig) { running = false; }
 bool set_usbfs_mb() {
   Logger &log = Logger::instance();
   // set usbfs memory
-  log.info() << "Setting usbfs memory to 1000mb." << std::endl;
-  std::system(
-      "sudo sh -c 'echo 1000 > "
-      "/sys/module/usbcore/parameters/usbfs_memory_mb'");
+  HAPI_INFO(log) << "Setting usbfs memory to 1000mb." << std::endl;
+  // already running as root, no need to start a shell for it
+  {
+    std::ofstream out("/sys/module/usbcore/parameters/usbfs_memory_mb");
+    out << 1000 << std::endl;
+  }
   std::ifstream in("/sys/module/usbcore/parameters/usbfs_memory_mb",
                    std::ios::binary);
   unsigned int mb = 0;
@@ -42,8 +58,8 @@ bool initialize_signal_handlers() {
   // set signal handler
   Logger &log = Logger::instance();
   auto set_sh = [&](int sig) -> bool {
-    log.info() << "Registering signal handler for signal " << sig << "."
-               << std::endl;
+    HAPI_INFO(log) << "Registering signal handler for signal " << sig << "."
+                   << std::endl;
     if (std::signal(sig, signal_handler) == SIG_ERR) {
       log.critical() << "Failed to set signal handler for signal " << sig
                      << std::endl;
@@ -69,4 +85,132 @@ std::string exec(const char *cmd) {
   }
   return result.substr(0, result.length() - 1);
 }
+
+std::vector<usb_serial_t> find_usb_serial(unsigned int vid, unsigned int pid,
+                                          const std::string &serial) {
+  std::vector<usb_serial_t> devices;
+  std::unique_ptr<DIR, int (*)(DIR *)> dir(opendir(HAPI_SYSFS_TTY), closedir);
+  if (!dir) {
+    return devices;
+  }
+  auto read = [](const std::string &path) {
+    std::string value;
+    std::ifstream in(path, std::ios::binary);
+    std::getline(in, value);
+    return value;
+  };
+  while (dirent *entry = readdir(dir.get())) {
+    std::string name = entry->d_name;
+    if (name.compare(0, 6, "ttyACM") != 0) {
+      continue;
+    }
+    // device links to the usb interface, its parent is the usb device
+    char interface[PATH_MAX];
+    std::string link = std::string(HAPI_SYSFS_TTY "/") + name + "/device";
+    if (realpath(link.c_str(), interface) == nullptr) {
+      continue;
+    }
+    std::string usb = interface;
+    usb = usb.substr(0, usb.rfind('/'));
+    usb_serial_t d;
+    d._device = "/dev/" + name;
+    d._port = usb.substr(usb.rfind('/') + 1);
+    d._vid = std::strtoul(read(usb + "/idVendor").c_str(), nullptr, 16);
+    d._pid = std::strtoul(read(usb + "/idProduct").c_str(), nullptr, 16);
+    d._serial = read(usb + "/serial");
+    if ((vid == 0 || d._vid == vid) && (pid == 0 || d._pid == pid) &&
+        (serial.empty() || d._serial == serial)) {
+      devices.push_back(d);
+    }
+  }
+  std::sort(devices.begin(), devices.end(),
+            [](const usb_serial_t &a, const usb_serial_t &b) {
+              return a._port != b._port ? a._port < b._port
+                                        : a._device < b._device;
+            });
+  return devices;
+}
+
+bool set_realtime(int priority, int cpu) {
+  Logger &log = Logger::instance();
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpu < 0 || cpu >= cpus) {
+    log.error() << "Real-time cpu " << cpu << " is not online (" << cpus
+                << " cpus)." << std::endl;
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0) {
+    log.error() << "Failed to pin thread to cpu " << cpu << ": "
+                << std::strerror(err) << std::endl;
+    return false;
+  }
+  sched_param param{};
+  param.sched_priority = priority;
+  err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (err != 0) {
+    log.error() << "Failed to set SCHED_FIFO priority " << priority << ": "
+                << std::strerror(err) << std::endl;
+    return false;
+  }
+  // keep page faults out of the real-time path
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    log.error() << "Failed to lock memory: " << std::strerror(errno)
+                << std::endl;
+    return false;
+  }
+  HAPI_INFO(log) << "Real-time thread running at SCHED_FIFO " << priority
+                 << " on cpu " << cpu << "." << std::endl;
+  return true;
+}
+
+bool set_non_realtime(int rt_cpu) {
+  Logger &log = Logger::instance();
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (long i = 0; i < cpus; i++) {
+    if (i != rt_cpu) {
+      CPU_SET(i, &set);
+    }
+  }
+  // on a single core machine there is nowhere else to go
+  if (CPU_COUNT(&set) == 0) {
+    return true;
+  }
+  // the affinity is per thread, so every thread already running is moved,
+  // e.g. the logger's. Threads created later inherit it from their creator.
+  std::unique_ptr<DIR, int (*)(DIR *)> dir(opendir(HAPI_PROC_TASKS),
+                                           closedir);
+  if (!dir) {
+    log.error() << "Failed to list the threads in " HAPI_PROC_TASKS ": "
+                << std::strerror(errno) << std::endl;
+    return false;
+  }
+  bool ok = true;
+  while (dirent *entry = readdir(dir.get())) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    pid_t tid = std::strtol(entry->d_name, nullptr, 10);
+    // a thread may have exited since it was listed
+    if (sched_setaffinity(tid, sizeof(set), &set) != 0 && errno != ESRCH) {
+      log.error() << "Failed to move thread " << tid << " off cpu " << rt_cpu
+                  << ": " << std::strerror(errno) << std::endl;
+      ok = false;
+    }
+  }
+  sched_param param{};
+  param.sched_priority = 0;
+  int err = pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+  if (err != 0) {
+    log.error() << "Failed to set normal priority: " << std::strerror(err)
+                << std::endl;
+    return false;
+  }
+  return ok;
+}
 };  // namespace hapi
@@ -1,12 +1,16 @@
 #include "routines/pmt_calibrate.h"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <cmath>
+#include <functional>
 #include <iomanip>
+#include <vector>
 
 #include "board.h"
 #include "logger.h"
+#include "pmt_map.h"
 
 namespace hapi {
 
@@ -14,125 +18,532 @@ namespace hapi {
 // os_utils.cpp
 extern volatile std::atomic<bool> running;
 
+// measurements older than this (seconds) or further than this from the
+// current laser baseplate temperature (degrees C) are not reused from the map
+#define HAPI_MAP_MAX_AGE (7 * 24 * 60 * 60)
+#define HAPI_MAP_MAX_TEMP 5.0
+// how far either side of the last result a warm start checks the noise
+#define HAPI_WARM_SPAN 24
+
+struct rate_probe_t {
+  // the gain or threshold value probed
+  int _x;
+  unsigned int _count;
+  // seconds the board was armed
+  double _live;
+};
+
+// noise rates, in triggers per probe window, the sequential test in pass()
+// decides between. A setting passes if its rate is at most
+// HAPI_SPRT_PASS_RATE and fails if it is at least HAPI_SPRT_FAIL_RATE.
+#define HAPI_SPRT_PASS_RATE 0.5
+#define HAPI_SPRT_FAIL_RATE 4.0
+// the coarse test's rates are further apart but break even at the same rate,
+// so it decides in about a third of the time and only misjudges settings
+// close to the answer
+#define HAPI_SPRT_COARSE_PASS_RATE 0.072
+#define HAPI_SPRT_COARSE_FAIL_RATE 8.0
+// windows after which an undecided probe goes with the likelier hypothesis
+#define HAPI_SPRT_MAX_WINDOWS 1
+// binary search steps this large or larger use the coarse test, the later
+// ones can still correct what it gets wrong
+#define HAPI_COARSE_HALF 8
+
 /**
  * pass
  *
- * Checks if with the given gain and threshold the board has not been triggered
- * in a time interval
+ * Checks if with the given gain and threshold the board's noise trigger rate
+ * is low, using Wald's sequential probability ratio test on the Poisson
+ * trigger rate so the probe stops as soon as the answer is known at the
+ * given confidence. A single noise trigger does not fail a setting.
  *
  * gain: the gain value to check
  * threshold: the trigger threshold
- * time_limit: the time limit to check within
+ * time_limit: the probe window the test rates are relative to
+ * confidence: probability of not passing a noisy setting, and of not failing
+ * a quiet one
+ * coarse: use the quicker test for settings likely far from the answer
+ * probe: set to the triggers counted and the time armed
  */
 inline bool pass(const unsigned int gain, const unsigned int threshold,
-                 const std::chrono::milliseconds& time_limit, Board& board) {
+                 const std::chrono::milliseconds& time_limit,
+                 const double confidence, const bool coarse,
+                 rate_probe_t& probe, PMTBoard& board) {
   Logger& log = Logger::instance();
+  std::chrono::duration<double> window = time_limit;
+  double r0 = (coarse ? HAPI_SPRT_COARSE_PASS_RATE : HAPI_SPRT_PASS_RATE) /
+              window.count();
+  double r1 = (coarse ? HAPI_SPRT_COARSE_FAIL_RATE : HAPI_SPRT_FAIL_RATE) /
+              window.count();
+  double alpha = 1.0 - confidence;
+  double accept = std::log(alpha / (1.0 - alpha));
+  double reject = std::log((1.0 - alpha) / alpha);
+  double step = std::log(r1 / r0);
+
   board.set_pmt_gain(gain);
   board.set_pmt_threshold(threshold);
   board.reset();
   board.arm();
-  auto start_time = std::chrono::high_resolution_clock::now();
-  auto current_time = start_time;
-  while (current_time - start_time < time_limit) {
-    if (board.is_done() || !running) {
-      auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                    current_time - start_time)
-                    .count();
-      if (ms > 0) {
-        log.debug() << "Gain: 0x" << std::hex << gain << " Threshold: 0x"
-                    << threshold << " Triggered in: " << std::dec << ms
-                    << " milliseconds." << std::endl;
+  unsigned int count = 0;
+  std::chrono::duration<double> live(0);
+  auto armed_time = board.now();
+  bool result = false;
+  while (running) {
+    auto current_time = board.now();
+    std::chrono::duration<double> t = live + (current_time - armed_time);
+    // log likelihood ratio of the fail rate over the pass rate
+    double llr = count * step - (r1 - r0) * t.count();
+    if (board.is_done()) {
+      live = t;
+      count++;
+      HAPI_DEBUG(log) << "Gain: 0x" << std::hex << gain << " Threshold: 0x"
+                      << threshold << " Trigger " << std::dec << count << " at "
+                      << live.count() << " seconds." << std::endl;
+      if (llr + step >= reject) {
+        result = false;
+        break;
       }
+      // re-arming is dead time and doesn't count towards the test
       board.disarm();
-      return false;
+      board.arm();
+      armed_time = board.now();
+    } else if (llr <= accept) {
+      live = t;
+      result = true;
+      break;
+    } else if (t >= window * HAPI_SPRT_MAX_WINDOWS) {
+      live = t;
+      result = llr < 0;
+      break;
     }
-    current_time = std::chrono::high_resolution_clock::now();
   }
   board.disarm();
-  return true;
+  probe._count = count;
+  probe._live = live.count();
+  return result && running;
 }
 
-std::pair<unsigned int, unsigned int> pmt_calibrate(long long time_limit) {
+pmt_calibration_t pmt_calibrate(long long time_limit, double confidence,
+                                PMTMap& map, PMTBoard& board) {
+  auto start_time = board.now();
   auto ms = std::chrono::milliseconds(time_limit);
-  Board& board = Board::instance();
+  unsigned int probes = 0;
 
-  board.set_trigger_source(Board::TriggerSource::PMT);
+  board.set_trigger_source(PMTBoard::TriggerSource::PMT);
   Logger& log = Logger::instance();
-  log.info() << "Trigger interval:" << time_limit << " ms" << std::endl;
-
-  int gain = 0xFF / 2;
-  int threshold = 0xFF / 2;
-  int gainhalf = (0xFF + 1) / 4;  // first cut is half of the range
-  int offset = 3;                 // extra adjustment to reduce random triggers
-  int half = (0xFF + 1) / 4;      // first cut is half of the range
-  // for (gain = 0xFF; gain >= 0; gain--) {
-  while (gainhalf > 1) {
+  HAPI_INFO(log) << "Trigger interval:" << time_limit << " ms" << std::endl;
+
+  int offset = 3;  // extra adjustment to reduce random triggers
+
+  // the probes stop as soon as they are decided, which biases their counts,
+  // so they are not recorded as rate measurements in the map
+  auto quiet = [&](int gain, int threshold, bool coarse) {
+    rate_probe_t probe{0, 0, 0};
+    bool r = pass(gain, threshold, ms, confidence, coarse, probe, board);
+    probes++;
+    return r;
+  };
+  // binary search over one setting, larger values trigger more easily
+  auto search = [&](const char* name, int value, int half,
+                    const std::function<bool(int, bool)>& passes) {
+    while (half > 1) {
+      if (!running) {
+        throw PMTCalibrationError();
+      }
+      HAPI_INFO(log) << "Binary search with " << name << ": " << value
+                     << std::endl;
+      if (passes(value, half >= HAPI_COARSE_HALF)) {  // no trigger, increase
+        value += half;
+        HAPI_INFO(log) << "...no trigger" << std::endl;
+      } else {  // trigger, lower
+        value -= half;
+        HAPI_INFO(log) << "...trigger" << std::endl;
+      }
+      value = std::min(std::max(value, 0), 0xFF);
+      half /= 2;
+      HAPI_INFO(log) << "Next adjustment: " << half << std::endl;
+    }
+    return value;
+  };
+  // the last result still holds if a setting below it is quiet and one above
+  // it is not, otherwise the setting moved and is searched for from scratch
+  auto warm_search = [&](const char* name, int last,
+                         const std::function<bool(int, bool)>& passes) {
+    int low = std::max(last - HAPI_WARM_SPAN, 0x00);
+    int high = std::min(last + HAPI_WARM_SPAN, 0xFF);
+    HAPI_INFO(log) << "Checking the " << name << " between " << low << " and "
+                   << high << std::endl;
+    if (passes(low, false) && !passes(high, false)) {
+      HAPI_INFO(log) << "The " << name << " is unchanged." << std::endl;
+      return last;
+    }
     if (!running) {
-      goto exit;
+      throw PMTCalibrationError();
+    }
+    HAPI_INFO(log) << "The " << name
+                   << " moved since the last calibration. Full search."
+                   << std::endl;
+    return search(name, 0xFF / 2, (0xFF + 1) / 4, passes);
+  };
+
+  // 0x00 is 'highest' threshold ie hardest to pass
+  int gain, threshold;
+  if (map.has_result(HAPI_MAP_MAX_AGE, HAPI_MAP_MAX_TEMP)) {
+    int last_gain = map.result().first;
+    int last_threshold = std::min((int)map.result().second + offset, 0xFF);
+    HAPI_INFO(log) << "Starting from the last calibration: gain " << last_gain
+                   << " threshold " << last_threshold << std::endl;
+    gain = warm_search("gain", last_gain,
+                       [&](int g, bool c) { return quiet(g, 0xFF / 2, c); });
+    threshold = warm_search("threshold", last_threshold,
+                            [&](int t, bool c) { return quiet(gain, t, c); });
+  } else {
+    gain = search("gain", 0xFF / 2, (0xFF + 1) / 4,
+                  [&](int g, bool c) { return quiet(g, 0xFF / 2, c); });
+    threshold = search("threshold", 0xFF / 2, (0xFF + 1) / 4,
+                       [&](int t, bool c) { return quiet(gain, t, c); });
+  }
+
+  pmt_calibration_t result{};
+  result._gain = gain;
+  result._threshold = std::max(threshold - offset, 0);
+  result._probes = probes;
+  result._duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      board.now() - start_time);
+  map.set_result(result._gain, result._threshold);
+  return result;
+}
+
+// most triggers counted in one rate probe, enough for a ~20% rate estimate
+#define HAPI_PROBE_MAX_COUNT 25
+// probes with less live time than this are saturated and can't be fit
+#define HAPI_PROBE_MIN_LIVE 0.001
+// how far under the fitted value the confidence bound may push the result
+#define HAPI_BOUND_SPAN 0x20
+// most probes spent calibrating either the gain or the threshold
+#define HAPI_AXIS_MAX_PROBES 12
+// how far past the busiest refinement probe probes still count for the final
+// fit
+#define HAPI_FIT_SPAN 0x10
+
+/**
+ * measure_rate
+ *
+ * Counts triggers with the given gain and threshold until the board has been
+ * armed for time_limit or enough triggers were seen. The board is re-armed
+ * after each trigger and the time spent re-arming is not counted.
+ */
+inline rate_probe_t measure_rate(const unsigned int gain,
+                                 const unsigned int threshold,
+                                 const std::chrono::milliseconds& time_limit,
+                                 PMTBoard& board) {
+  board.set_pmt_gain(gain);
+  board.set_pmt_threshold(threshold);
+  board.reset();
+  board.arm();
+  rate_probe_t probe{0, 0, 0};
+  std::chrono::duration<double> limit = time_limit;
+  std::chrono::duration<double> live(0);
+  auto armed_time = board.now();
+  while (running) {
+    auto current_time = board.now();
+    if (board.is_done()) {
+      live += current_time - armed_time;
+      probe._count++;
+      if (probe._count >= HAPI_PROBE_MAX_COUNT || live >= limit) {
+        break;
+      }
+      board.disarm();
+      board.arm();
+      armed_time = board.now();
+    } else if (live + (current_time - armed_time) >= limit) {
+      live += current_time - armed_time;
+      break;
+    }
+  }
+  board.disarm();
+  probe._live = live.count();
+  return probe;
+}
+
+/**
+ * normal_quantile
+ *
+ * Inverse of the standard normal cdf (Abramowitz and Stegun 26.2.23, error
+ * under 4.5e-4)
+ */
+inline double normal_quantile(double p) {
+  double q = p < 0.5 ? p : 1.0 - p;
+  double t = std::sqrt(-2.0 * std::log(q));
+  double z = t - (2.515517 + 0.802853 * t + 0.010328 * t * t) /
+                     (1.0 + 1.432788 * t + 0.189269 * t * t +
+                      0.001308 * t * t * t);
+  return p < 0.5 ? -z : z;
+}
+
+// Poisson maximum likelihood fit of log(rate) = a + b * (x - x0)
+struct rate_fit_t {
+  bool _ok;
+  double _x0;
+  double _a, _b;
+  double _var_a, _var_b, _cov;
+
+  double ln_rate(double x) const { return _a + _b * (x - _x0); }
+  double ln_rate_sigma(double x) const {
+    double d = x - _x0;
+    return std::sqrt(std::max(0.0, _var_a + d * d * _var_b + 2 * d * _cov));
+  }
+  // the value where the fitted rate equals the given rate
+  double solve(double rate) const { return _x0 + (std::log(rate) - _a) / _b; }
+};
+
+/**
+ * fit_rate
+ *
+ * Fits the trigger counts of the probes as Poisson with an exponential rate.
+ * Probes without triggers still bound the rate so they are part of the fit.
+ */
+inline rate_fit_t fit_rate(const std::vector<rate_probe_t>& probes) {
+  rate_fit_t fit{false, 0, 0, 0, 0, 0, 0};
+  double live = 0, count = 0;
+  unsigned int n = 0, nonzero = 0;
+  for (auto& p : probes) {
+    if (p._live < HAPI_PROBE_MIN_LIVE) continue;
+    fit._x0 += p._x;
+    live += p._live;
+    count += p._count;
+    n++;
+    if (p._count > 0) nonzero++;
+  }
+  // the slope is only pinned down once two settings have seen triggers
+  if (nonzero < 2) return fit;
+  fit._x0 /= n;
+  fit._a = std::log(count / live);
+  // Newton-Raphson on the log likelihood, information matrix [i00 i01; i01 i11]
+  double i00 = 0, i01 = 0, i11 = 0;
+  for (int iter = 0; iter < 50; iter++) {
+    double g0 = 0, g1 = 0;
+    i00 = i01 = i11 = 0;
+    for (auto& p : probes) {
+      if (p._live < HAPI_PROBE_MIN_LIVE) continue;
+      double d = p._x - fit._x0;
+      double mu = p._live * std::exp(fit.ln_rate(p._x));
+      g0 += p._count - mu;
+      g1 += (p._count - mu) * d;
+      i00 += mu;
+      i01 += mu * d;
+      i11 += mu * d * d;
     }
-    log.info() << "Binary search with gain: " << gain << std::endl;
-    /*if ((gain + 1) % 16 == 0) {
-      log.info() << std::setfill('0') << std::right << std::hex
-                 << "Testing gain range: 0x" << std::setw(2) << gain << "-0x"
-                 << std::setw(2) << (gain - 0x0Fu) << std::endl;
+    double det = i00 * i11 - i01 * i01;
+    if (det <= 0) return fit;
+    double da = (i11 * g0 - i01 * g1) / det;
+    double db = (i00 * g1 - i01 * g0) / det;
+    // damp steps so the exponential doesn't overflow on bad starts
+    double step = std::max(std::abs(da), std::abs(db) * 0x80);
+    if (step > 2) {
+      da *= 2 / step;
+      db *= 2 / step;
     }
-    if (pass(gain, threshold, ms, board)) {
-      log.info() << "Found gain: 0x" << std::hex << std::setw(2)
-                 << std::setfill('0') << gain << std::endl; */
-
-    if (pass(gain, threshold, ms, board))  // no trigger, increase gain
-    {
-      gain += gainhalf;
-      log.info() << "...no trigger" << std::endl;
-    } else  // trigger, lower gain
-    {
-      gain -= gainhalf;
-      log.info() << "...trigger" << std::endl;
+    fit._a += da;
+    fit._b += db;
+    if (std::abs(da) < 1e-9 && std::abs(db) < 1e-9) break;
+  }
+  double det = i00 * i11 - i01 * i01;
+  if (det <= 0) return fit;
+  fit._var_a = i11 / det;
+  fit._var_b = i00 / det;
+  fit._cov = -i01 / det;
+  // noise can only go up with gain and threshold
+  fit._ok = fit._b > 0 && std::isfinite(fit._a);
+  return fit;
+}
+
+struct axis_result_t {
+  int _x;
+  double _rate;
+  double _rate_upper;
+};
+
+/**
+ * calibrate_axis
+ *
+ * Finds the largest value (0x00-0xFF) whose fitted false trigger rate is
+ * under target_rate with the given confidence. Probes a coarse grid, then
+ * where the first fit expects a few triggers per window, and refits without
+ * the probes far above those.
+ */
+inline axis_result_t calibrate_axis(
+    const std::function<rate_probe_t(int)>& probe,
+    const std::vector<rate_probe_t>& seed, double target_rate,
+    double confidence, double window, const char* name) {
+  Logger& log = Logger::instance();
+  double z = normal_quantile(confidence);
+  // probes taken now, the seed measurements are only fit alongside them
+  std::vector<rate_probe_t> probes;
+  auto with_seed = [&](const std::vector<rate_probe_t>& v) {
+    std::vector<rate_probe_t> all(seed);
+    all.insert(all.end(), v.begin(), v.end());
+    return all;
+  };
+  auto run = [&](double value) {
+    int x = std::min(std::max((int)std::lround(value), 0x00), 0xFF);
+    for (auto& p : probes) {
+      if (p._x == x) return;
     }
-    gainhalf /= 2;
-    log.info() << "Next adjustment: " << gainhalf << std::endl;
-
-  }  // end gain binary search
-
-  // binary search for t
-  threshold = 0xFF / 2;
-
-  while (half > 1)  // break when we
-  {
-    log.info() << "Binary search with threshold: " << threshold << std::endl;
-
-    if (pass(gain, threshold, ms, board))  // no trigger, increase threshold
-    {
-      threshold += half;  // 0x00 is 'highest' threshold ie hardest to pass
-      log.info() << "...no trigger" << std::endl;
-    } else  // trigger, lower threshold
-    {
-      threshold -= half;
-      log.info() << "...trigger" << std::endl;
+    rate_probe_t p = probe(x);
+    p._x = x;
+    HAPI_INFO(log) << name << ": 0x" << std::hex << x << std::dec << " "
+                   << p._count << " triggers in " << p._live << " s"
+                   << std::endl;
+    probes.push_back(p);
+  };
+
+  rate_fit_t fit = fit_rate(seed);
+  if (fit._ok) {
+    HAPI_INFO(log) << name << ": starting from " << seed.size()
+                   << " saved measurements." << std::endl;
+  } else {
+    for (int x : {0x20, 0x60, 0xA0, 0xE0}) {
+      if (!running) throw PMTCalibrationError();
+      run(x);
     }
-    half /= 2;
-    log.info() << "Next adjustment: " << half << std::endl;
-    if (!running) {
-      goto exit;
+    fit = fit_rate(with_seed(probes));
+  }
+  // split the gap between the quietest setting that triggered and the
+  // busiest that didn't until there are two settings with triggers
+  while (!fit._ok && probes.size() < HAPI_AXIS_MAX_PROBES) {
+    if (!running) throw PMTCalibrationError();
+    int triggered = 0x100, quiet = -1;
+    std::vector<rate_probe_t> all = with_seed(probes);
+    for (auto& p : all) {
+      if (p._count > 0) triggered = std::min(triggered, p._x);
+    }
+    for (auto& p : all) {
+      if (p._count == 0 && p._x < triggered) quiet = std::max(quiet, p._x);
+    }
+    if (triggered > 0xFF) {
+      if (quiet == 0xFF) break;
+      run(0xFF);
+    } else if (triggered - quiet > 1) {
+      run((triggered + quiet) / 2.0);
+    } else {
+      break;
     }
-  }  // end binary search
-  return std::make_pair(gain, std::max(threshold - offset, 0));
-
-  // for (threshold = 0x00; threshold <= 0xFF; threshold++) {
-  //  if ((threshold) % 16 == 0) {
-  //    log.info() << std::setfill('0') << std::right << std::hex
-  //             << "Testing threshold range: 0x" << std::setw(2) << threshold
-  //             << std::endl;
-  //  }
-  //    if (!running) {
-  //      goto exit;
-  //    }
-  //    if (!pass(gain, threshold, ms, board)) {
-  //      return std::make_pair(gain, std::max(threshold - 1, 0));
-  //    }
-  //  }
-
-exit:
-  throw PMTCalibrationError();
+    fit = fit_rate(with_seed(probes));
+  }
+  if (!fit._ok) throw PMTCalibrationError();
+  HAPI_INFO(log) << name << " estimate: 0x" << std::hex
+                 << (int)std::max(0.0, std::min(255.0, fit.solve(target_rate)))
+                 << std::dec << std::endl;
+
+  // probe where a window should see a few triggers, the closest to the target
+  // that still pins down the slope, then extrapolate from there
+  double high = fit.solve(18 / window);
+  for (double counts : {2.0, 6.0, 18.0}) {
+    if (!running) throw PMTCalibrationError();
+    run(fit.solve(counts / window));
+  }
+  // far above that the rate stops being exponential (pile up, saturation)
+  std::vector<rate_probe_t> near;
+  for (auto& p : with_seed(probes)) {
+    if (p._x <= high + HAPI_FIT_SPAN) near.push_back(p);
+  }
+  rate_fit_t local = fit_rate(near);
+  if (local._ok) fit = local;
+
+  // far below the fitted value the widening extrapolation error makes the
+  // bound meaningless, don't chase it there
+  auto best = [&]() {
+    int lowest = std::max((int)std::floor(fit.solve(target_rate)) -
+                              HAPI_BOUND_SPAN,
+                          0x00);
+    for (int i = 0xFF; i >= lowest; i--) {
+      if (fit.ln_rate(i) + z * fit.ln_rate_sigma(i) <= std::log(target_rate)) {
+        return i;
+      }
+    }
+    return -1;
+  };
+  // if the extrapolation is too uncertain, probe closer to the target where
+  // even windows without triggers narrow down the slope
+  int x = best();
+  for (double counts = 0.7; x < 0 && probes.size() < HAPI_AXIS_MAX_PROBES;
+       counts /= 3) {
+    if (!running) throw PMTCalibrationError();
+    run(fit.solve(counts / window));
+    near.push_back(probes.back());
+    rate_fit_t local = fit_rate(near);
+    if (local._ok) fit = local;
+    x = best();
+  }
+  if (x < 0) {
+    x = std::min(std::max((int)std::floor(fit.solve(target_rate)), 0x00), 0xFF);
+    log.warning() << name << ": could not bound the rate at "
+                  << confidence * 100
+                  << "% confidence, using the fitted value. A longer probe "
+                     "window narrows the bound."
+                  << std::endl;
+  }
+  axis_result_t r;
+  r._x = x;
+  r._rate = std::exp(fit.ln_rate(x));
+  r._rate_upper = std::exp(fit.ln_rate(x) + z * fit.ln_rate_sigma(x));
+  HAPI_INFO(log) << name << " fit: log(rate) = " << fit._a << " + " << fit._b
+                 << " * (x - " << fit._x0 << ")" << std::endl;
+  return r;
+}
+
+pmt_calibration_t pmt_calibrate_rate(double target_rate, double confidence,
+                                     long long millis, PMTMap& map,
+                                     PMTBoard& board) {
+  auto start_time = board.now();
+  auto ms = std::chrono::milliseconds(millis);
+  Logger& log = Logger::instance();
+  unsigned int probes = 0;
+
+  board.set_trigger_source(PMTBoard::TriggerSource::PMT);
+  HAPI_INFO(log) << "Target false trigger rate: " << target_rate << " Hz at "
+                 << confidence * 100 << "% confidence" << std::endl;
+  HAPI_INFO(log) << "Probe live time: " << millis << " ms" << std::endl;
+
+  auto run = [&](int gain, int threshold) {
+    rate_probe_t probe = measure_rate(gain, threshold, ms, board);
+    probes++;
+    map.record(gain, threshold, probe._count, probe._live);
+    return probe;
+  };
+  // saved measurements along one line of the grid that are still current
+  auto saved = [&](bool along_gain, int fixed) {
+    std::vector<rate_probe_t> seed;
+    for (auto const& i : map.entries()) {
+      int gain = i.first.first, threshold = i.first.second;
+      if ((along_gain ? threshold : gain) != fixed) continue;
+      if (!map.is_current(i.second, HAPI_MAP_MAX_AGE, HAPI_MAP_MAX_TEMP)) {
+        continue;
+      }
+      seed.push_back(rate_probe_t{along_gain ? gain : threshold,
+                                  i.second._count, i.second._live});
+    }
+    return seed;
+  };
+
+  const int threshold = 0xFF / 2;
+  axis_result_t g = calibrate_axis(
+      [&](int gain) { return run(gain, threshold); }, saved(true, threshold),
+      target_rate, confidence, millis / 1000.0, "Gain");
+  axis_result_t t = calibrate_axis(
+      [&](int threshold) { return run(g._x, threshold); }, saved(false, g._x),
+      target_rate, confidence, millis / 1000.0, "Threshold");
+
+  pmt_calibration_t result;
+  result._gain = g._x;
+  result._threshold = t._x;
+  result._rate = t._rate;
+  result._rate_upper = t._rate_upper;
+  result._probes = probes;
+  result._duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+      board.now() - start_time);
+  map.set_result(result._gain, result._threshold);
+  return result;
 }
 }  // namespace hapi
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <ctime>
+#include <sstream>
 
 namespace hapi {
 // Returns a std::string of the current time in the format YYYY_MM_DD-HH_MM_SS
@@ -9,8 +10,10 @@ std::string str_time() {
   std::time_t t = std::time(nullptr);
   char mbstr[100];
   std::string str;
-  if (std::strftime(mbstr, sizeof(mbstr), "%Y_%m_%d-%H_%M_%S",
-                    std::gmtime(&t))) {
+  // gmtime shares its result between threads
+  std::tm tm;
+  gmtime_r(&t, &tm);
+  if (std::strftime(mbstr, sizeof(mbstr), "%Y_%m_%d-%H_%M_%S", &tm)) {
     return std::string(mbstr);
   } else {
     return "unknown";
@@ -20,4 +23,27 @@ std::string str_time() {
 void lower(std::string &in) {
   std::transform(in.begin(), in.end(), in.begin(), ::tolower);
 }
+
+std::vector<std::string> split_list(const std::string &in, char delim) {
+  std::vector<std::string> items;
+  std::istringstream list(in);
+  std::string item;
+  while (std::getline(list, item, delim)) {
+    item.erase(0, item.find_first_not_of(' '));
+    item.erase(item.find_last_not_of(' ') + 1);
+    if (!item.empty()) {
+      items.push_back(item);
+    }
+  }
+  return items;
+}
+
+uint64_t fnv1a(const std::string &in) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : in) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
 }  // namespace hapi
@@ -1,10 +1,20 @@
 #include "serial.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdarg>
+#include <cstring>
 #include <exception>
 #include <iostream>
-#include <sstream>
 #include <stdexcept>
+#include <vector>
+
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+
+// longest single poll() before checking the cancel hook again
+#define HAPI_SERIAL_SLICE_MS 100
 
 SerialInterface::SerialInterface(void) {}
 
@@ -24,13 +34,10 @@ void SerialInterface::open(std::string device, speed_t baud, bool blocking) {
   }
   _blocking = blocking;
 
-  int flags = O_RDWR | O_NOCTTY;
-
-  if (!blocking) {
-    flags |= O_NONBLOCK;
-  }
+  // waits are done in poll() so a read or write can never block past its
+  // deadline
+  int flags = O_RDWR | O_NOCTTY | O_NONBLOCK;
   _device_fd = ::open(device.c_str(), flags);
-  _device_f = fdopen(_device_fd, "r+");
 
   if (!is_open()) {
     std::cout << "Could not open device: " << device
@@ -51,6 +58,17 @@ void SerialInterface::open(std::string device, speed_t baud, bool blocking) {
                                     .append(__FUNCTION__));
   }
 
+  // one process per device, a second hapi must not talk to the same laser
+  if (flock(_device_fd, LOCK_EX | LOCK_NB) < 0) {
+    close();
+    throw SerialBusy(std::string("Device ")
+                         .append(device)
+                         .append(" is in use by another process! ")
+                         .append(__FUNCTION__));
+  }
+  // keeps anything else from opening it, except root
+  ioctl(_device_fd, TIOCEXCL);
+
   if (tcgetattr(_device_fd, &_config) < 0) {
     std::cout << "Error getting the attributes associated with the device! "
               << __FUNCTION__ << std::endl;
@@ -86,48 +104,242 @@ void SerialInterface::open(std::string device, speed_t baud, bool blocking) {
 
 void SerialInterface::close(void) {
   if (is_open()) {
+    ioctl(_device_fd, TIOCNXCL);
     ::close(_device_fd);
-    fclose(_device_f);
-    _device_f = nullptr;
     _device_fd = -1;
+    _head = 0;
+    _size = 0;
   }
 }
 
-bool SerialInterface::is_open(void) { return _device_f != nullptr; }
+bool SerialInterface::is_open(void) { return _device_fd >= 0; }
+
+bool SerialInterface::wait(short events, clock::time_point deadline) {
+  pollfd pfd{_device_fd, events, 0};
+  for (;;) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - clock::now());
+    if (left.count() <= 0) {
+      return false;
+    }
+    if (_cancel && _cancel()) {
+      throw SerialCancelled(
+          std::string("Serial wait cancelled! ").append(__FUNCTION__));
+    }
+    int r = poll(&pfd, 1, std::min<long long>(left.count(),
+                                              HAPI_SERIAL_SLICE_MS));
+    if (r > 0) {
+      if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        throw std::runtime_error(
+            std::string("Serial device closed! ").append(__FUNCTION__));
+      }
+      return true;
+    }
+    if (r < 0 && errno != EINTR) {
+      throw std::runtime_error(std::string("Error waiting on device: ")
+                                   .append(std::strerror(errno))
+                                   .append(" ")
+                                   .append(__FUNCTION__));
+    }
+  }
+}
+
+std::size_t SerialInterface::fill(clock::time_point deadline) {
+  if (_size == sizeof _buffer) {
+    return 0;
+  }
+  // the free space is contiguous up to the end of the buffer or up to _head
+  std::size_t tail = (_head + _size) % sizeof _buffer;
+  std::size_t space = tail >= _head ? sizeof _buffer - tail : _head - tail;
+  for (;;) {
+    ssize_t n = ::read(_device_fd, _buffer + tail, space);
+    if (n > 0) {
+      _size += n;
+      return n;
+    }
+    if (n == 0) {
+      throw std::runtime_error(
+          std::string("Serial device closed! ").append(__FUNCTION__));
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      throw std::runtime_error(std::string("Error reading from device: ")
+                                   .append(std::strerror(errno))
+                                   .append(" ")
+                                   .append(__FUNCTION__));
+    }
+    // nothing to read yet, sleep until there is
+    if (!wait(POLLIN, deadline)) {
+      return 0;
+    }
+  }
+}
+
+void SerialInterface::take(std::string &str, std::size_t n) {
+  std::size_t first = std::min(n, sizeof _buffer - _head);
+  str.append(_buffer + _head, first);
+  str.append(_buffer, n - first);
+  _head = (_head + n) % sizeof _buffer;
+  _size -= n;
+}
 
 std::string SerialInterface::getline(char delim) {
-  std::ostringstream ss;
-  int ch;
-  while ((ch = std::fgetc(_device_f)) != delim) {
-    if (ch != EOF) {
-      ss << (char)ch;
+  return getline(delim, clock::now() + _timeout);
+}
+
+std::size_t SerialInterface::find(char delim) {
+  // the buffered bytes are in at most two pieces, the second one wrapped
+  // around to the start of the buffer
+  std::size_t first = std::min(_size, sizeof _buffer - _head);
+  const char *end =
+      static_cast<const char *>(std::memchr(_buffer + _head, delim, first));
+  if (end != nullptr) {
+    return end - (_buffer + _head) + 1;
+  }
+  if (_size > first) {
+    end =
+        static_cast<const char *>(std::memchr(_buffer, delim, _size - first));
+    if (end != nullptr) {
+      return first + (end - _buffer) + 1;
+    }
+  }
+  return 0;
+}
+
+std::size_t SerialInterface::take(char *dest, std::size_t size,
+                                  std::size_t n) {
+  std::size_t copy = std::min(n, size);
+  std::size_t first = std::min(copy, sizeof _buffer - _head);
+  std::memcpy(dest, _buffer + _head, first);
+  std::memcpy(dest + first, _buffer, copy - first);
+  _head = (_head + n) % sizeof _buffer;
+  _size -= n;
+  return copy;
+}
+
+std::string SerialInterface::getline(char delim, clock::time_point deadline) {
+  std::string line;
+  for (;;) {
+    std::size_t n = find(delim);
+    if (n > 0) {
+      take(line, n);
+      return line;
+    }
+    // no delimiter yet, keep what there is and wait for more
+    take(line, _size);
+    if (fill(deadline) == 0) {
+      // the partial line is dropped, a retry has to ask again anyway
+      _timeouts++;
+      throw SerialTimeout(std::string("Timed out waiting for a line! ")
+                              .append(__FUNCTION__));
+    }
+  }
+}
+
+std::size_t SerialInterface::getline(char *line, std::size_t size, char delim,
+                                     clock::time_point deadline) {
+  std::size_t length = 0;
+  for (;;) {
+    std::size_t n = find(delim);
+    length += take(line + length, size - 1 - length, n > 0 ? n : _size);
+    if (n > 0) {
+      line[length] = '\0';
+      return length;
+    }
+    if (fill(deadline) == 0) {
+      _timeouts++;
+      throw SerialTimeout(std::string("Timed out waiting for a line! ")
+                              .append(__FUNCTION__));
     }
   }
-  ss << delim;
-  return ss.str();
 }
 
 std::string SerialInterface::read(void) {
-  std::ostringstream ss;
-  int ch;
-  while ((ch = std::fgetc(_device_f)) != EOF) {
-    ss << ch;
+  std::string str;
+  pollfd pfd{_device_fd, POLLIN, 0};
+  for (;;) {
+    take(str, _size);
+    // only read what has already arrived
+    if (poll(&pfd, 1, 0) <= 0 || fill(clock::now()) == 0) {
+      break;
+    }
   }
-  return ss.str();
+  return str;
+}
+
+void SerialInterface::discard(void) {
+  _head = 0;
+  _size = 0;
+  tcflush(_device_fd, TCIFLUSH);
 }
 
 int SerialInterface::write(std::string str) {
-  return ::write(_device_fd, str.c_str(), str.length());
+  return write(str.data(), str.length(), clock::now() + _timeout);
 }
 
-int SerialInterface::write(char c) { return ::write(_device_fd, &c, 1); }
+int SerialInterface::write(char c) {
+  return write(&c, 1, clock::now() + _timeout);
+}
+
+int SerialInterface::write(const char *data, std::size_t length,
+                           clock::time_point deadline) {
+  std::size_t done = 0;
+  // the tty may take only part of it if its output queue is full
+  while (done < length) {
+    ssize_t n = ::write(_device_fd, data + done, length - done);
+    if (n > 0) {
+      done += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      throw std::runtime_error(std::string("Error writing to device: ")
+                                   .append(std::strerror(errno))
+                                   .append(" ")
+                                   .append(__FUNCTION__));
+    }
+    if (!wait(POLLOUT, deadline)) {
+      _timeouts++;
+      throw SerialTimeout(std::string("Timed out writing to device! ")
+                              .append(__FUNCTION__));
+    }
+  }
+  return done;
+}
 
 int SerialInterface::printf(const char *fmt, ...) {
+  char small[256];
   std::va_list args;
   va_start(args, fmt);
-  int r = std::vfprintf(_device_f, fmt, args);
+  int n = std::vsnprintf(small, sizeof small, fmt, args);
   va_end(args);
-  return r;
+  if (n < 0) {
+    return n;
+  }
+  if ((std::size_t)n < sizeof small) {
+    return write(small, n, clock::now() + _timeout);
+  }
+  std::vector<char> large(n + 1);
+  va_start(args, fmt);
+  std::vsnprintf(large.data(), large.size(), fmt, args);
+  va_end(args);
+  return write(large.data(), n, clock::now() + _timeout);
 }
 
 bool SerialInterface::is_blocking(void) { return _blocking; }
+
+void SerialInterface::set_timeout(std::chrono::milliseconds timeout) {
+  _timeout = timeout;
+}
+
+std::chrono::milliseconds SerialInterface::timeout(void) { return _timeout; }
+
+void SerialInterface::set_cancel(std::function<bool()> cancel) {
+  _cancel = cancel;
+}
+
+unsigned long SerialInterface::timeouts(void) { return _timeouts; }
@@ -0,0 +1,91 @@
+#include "simulated_board.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace hapi;
+
+// virtual time each call takes, matching the real board's pin and DAC delays
+#define HAPI_SIM_PIN_DELAY 0.1
+#define HAPI_SIM_DAC_DELAY 0.1
+// virtual time between two polls of the done pin
+#define HAPI_SIM_POLL 0.0005
+
+SimulatedBoard::model_t SimulatedBoard::default_model() {
+  model_t m;
+  m._dark_rate = 0.05;
+  m._gain_slope = 0.06;
+  m._threshold_slope = 0.09;
+  m._particle_rate = 0.002;
+  m._particle_efficiency = 0.5;
+  m._max_rate = 1000;
+  return m;
+}
+
+SimulatedBoard::SimulatedBoard(const model_t &model, unsigned int seed)
+    : _model(model), _rng(seed) {}
+
+double SimulatedBoard::rate(int gain, int threshold) const {
+  // dark counts grow exponentially with the gain and with the threshold
+  // byte, since larger bytes are lower thresholds
+  double dark = _model._dark_rate *
+                std::exp(_model._gain_slope * (gain - 0x80) +
+                         _model._threshold_slope * (threshold - 0x80));
+  // particle pulses are well above the noise so their efficiency saturates
+  double x = _model._gain_slope * (gain - 0x80) +
+             _model._threshold_slope * (threshold - 0x80);
+  double e = _model._particle_efficiency /
+             (_model._particle_efficiency +
+              (1 - _model._particle_efficiency) * std::exp(-x));
+  return std::min(dark + _model._particle_rate * e, _model._max_rate);
+}
+
+void SimulatedBoard::schedule() {
+  // triggers are Poisson so the wait for the next one is exponential
+  std::exponential_distribution<double> wait(rate(_gain, _threshold));
+  _event = _clock + wait(_rng);
+}
+
+void SimulatedBoard::arm() {
+  _clock += HAPI_SIM_PIN_DELAY;
+  _armed = true;
+  schedule();
+}
+
+void SimulatedBoard::disarm() {
+  _clock += HAPI_SIM_PIN_DELAY;
+  _armed = false;
+}
+
+bool SimulatedBoard::is_done() {
+  _clock += HAPI_SIM_POLL;
+  return _armed && _clock >= _event;
+}
+
+void SimulatedBoard::reset() {
+  arm();
+  disarm();
+}
+
+// only pmt triggers are modelled, the source just costs the pin delay
+void SimulatedBoard::set_trigger_source(TriggerSource) {
+  _clock += HAPI_SIM_PIN_DELAY;
+}
+
+void SimulatedBoard::set_pmt_gain(int gain_byte) {
+  if (gain_byte == _gain) return;
+  _gain = gain_byte;
+  _clock += HAPI_SIM_DAC_DELAY;
+  if (_armed) schedule();
+}
+
+void SimulatedBoard::set_pmt_threshold(int threshold_byte) {
+  if (threshold_byte == _threshold) return;
+  _threshold = threshold_byte;
+  _clock += HAPI_SIM_DAC_DELAY;
+  if (_armed) schedule();
+}
+
+std::chrono::duration<double> SimulatedBoard::now() {
+  return std::chrono::duration<double>(_clock);
+}
@@ -0,0 +1,98 @@
+#include "task_graph.h"
+
+#include <exception>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "logger.h"
+
+using namespace hapi;
+
+TaskGraph::TaskGraph() {}
+
+void TaskGraph::add(const std::string &name,
+                    const std::vector<std::string> &after,
+                    std::function<void()> task) {
+  task_t t;
+  t._name = name;
+  for (auto const &a : after) {
+    t._after.push_back(find(a));
+  }
+  t._task = task;
+  _tasks.push_back(t);
+}
+
+void TaskGraph::run() {
+  Logger &log = Logger::instance();
+  std::vector<std::promise<void>> done(_tasks.size());
+  std::vector<std::shared_future<void>> finished;
+  for (auto &d : done) {
+    finished.push_back(d.get_future().share());
+  }
+  std::mutex mutex;
+  std::exception_ptr error;
+  clock::time_point start = clock::now();
+
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < _tasks.size(); i++) {
+    threads.emplace_back([&, i]() {
+      task_t &task = _tasks[i];
+      try {
+        // a failed task passes its exception on to everything after it
+        for (auto a : task._after) {
+          finished[a].get();
+        }
+      } catch (...) {
+        log.warning() << "Skipping " << task._name << "." << std::endl;
+        done[i].set_exception(std::current_exception());
+        return;
+      }
+      clock::time_point begin = clock::now();
+      try {
+        task._task();
+        clock::time_point end = clock::now();
+        HAPI_INFO(log) << "Startup: " << task._name << " took "
+                       << std::chrono::duration_cast<std::chrono::milliseconds>(
+                              end - begin)
+                              .count()
+                       << " ms, done at "
+                       << std::chrono::duration_cast<std::chrono::milliseconds>(
+                              end - start)
+                              .count()
+                       << " ms." << std::endl;
+        done[i].set_value();
+      } catch (...) {
+        log.error() << "Startup: " << task._name << " failed." << std::endl;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+        done[i].set_exception(std::current_exception());
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  HAPI_INFO(log) << "Startup: all done in "
+                 << std::chrono::duration_cast<std::chrono::milliseconds>(
+                        clock::now() - start)
+                        .count()
+                 << " ms." << std::endl;
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+std::size_t TaskGraph::find(const std::string &name) {
+  for (std::size_t i = 0; i < _tasks.size(); i++) {
+    if (_tasks[i]._name == name) {
+      return i;
+    }
+  }
+  throw std::invalid_argument("Unknown task: " + name);
+}
@@ -0,0 +1,67 @@
+#include "thermal_governor.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace hapi;
+
+// fraction of the way to a higher duty taken on each reading, the duty drops
+// at once but recovers over several readings so it doesn't oscillate
+#define HAPI_THERMAL_RECOVERY 0.2
+// smallest duty change worth applying
+#define HAPI_THERMAL_STEP 0.02
+
+ThermalGovernor::ThermalGovernor(const OBISLaser::sys_info_t &info,
+                                 Config &config)
+    : _baseplate_max(info._baseplateMaxTemp),
+      _diode_max(info._diodeMaxTemp),
+      _internal_max(info._internalTempMax) {
+  _margin = std::max(config.get<double>("thermal_margin"), 0.1);
+  _min_duty = std::min(std::max(config.get<double>("thermal_min_duty"), 0.01),
+                       1.0);
+}
+
+bool ThermalGovernor::update(const LaserMonitor::snapshot_t &snapshot) {
+  if (!snapshot._valid) {
+    return false;
+  }
+  const OBISLaser::telemetry_t &t = snapshot._telemetry;
+  // how far into the margin the hottest sensor is, 1 outside of it and 0 at
+  // the limit
+  auto headroom = [this](double temp, double max) {
+    return std::min(std::max((max - temp) / _margin, 0.0), 1.0);
+  };
+  double h = std::min({headroom(t._baseplateTemp, _baseplate_max),
+                       headroom(t._diodeTemp, _diode_max),
+                       headroom(t._internalTemp, _internal_max)});
+  double target = _min_duty + (1 - _min_duty) * h;
+  if (target < _duty) {
+    _duty = target;
+  } else {
+    _duty += HAPI_THERMAL_RECOVERY * (target - _duty);
+    if (target - _duty < HAPI_THERMAL_STEP / 2) {
+      _duty = target;
+    }
+  }
+  if (std::abs(_duty - _applied) >= HAPI_THERMAL_STEP ||
+      (_duty == 1 && _applied != 1)) {
+    _applied = _duty;
+    return true;
+  }
+  return false;
+}
+
+double ThermalGovernor::duty() { return _applied; }
+
+std::chrono::microseconds ThermalGovernor::stretch(
+    std::chrono::microseconds nominal) {
+  return std::chrono::microseconds((long long)(nominal.count() / _applied));
+}
+
+bool ThermalGovernor::is_thermal(FaultCode fault) {
+  const FaultCode thermal = OBISLaser::FaultBits::BasePlateTempFault |
+                            OBISLaser::FaultBits::DiodeTempFault |
+                            OBISLaser::FaultBits::InternalTempFault |
+                            OBISLaser::FaultBits::DiodeTempLimitError;
+  return fault != 0 && (fault & ~thermal) == 0;
+}
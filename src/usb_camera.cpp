@@ -1,11 +1,20 @@
 #include "usb_camera.h"
 
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
 
 #include "SpinGenApi/SpinnakerGenApi.h"
 
 using namespace hapi;
 
+// longest probe() waits for a free running frame
+#define HAPI_PROBE_TIMEOUT std::chrono::milliseconds(1000)
+
+// the user set hapi keeps its camera settings in
+#define HAPI_USER_SET Spinnaker::UserSetSelector_UserSet1
+#define HAPI_USER_SET_DEFAULT Spinnaker::UserSetDefault_UserSet1
+
 using namespace Spinnaker;
 using namespace Spinnaker::GenApi;
 using namespace Spinnaker::GenICam;
@@ -65,6 +74,14 @@ std::map<std::string, std::string> USBCamera::get_device_info() {
   return device_info;
 }
 
+std::string USBCamera::serial() {
+  CStringPtr serial = _ptr->GetTLDeviceNodeMap().GetNode("DeviceSerialNumber");
+  if (!IsAvailable(serial) || !IsReadable(serial)) {
+    throw std::runtime_error("Device serial number not available.");
+  }
+  return std::string(serial->GetValue().c_str());
+}
+
 void USBCamera::set_acquisition_mode(
     const Spinnaker::AcquisitionModeEnums mode) {
   _ptr->AcquisitionMode.SetValue(mode);
@@ -80,6 +97,37 @@ ImagePtr USBCamera::acquire_image() {
   return _ptr->GetNextImage();
 }
 
+ImagePtr USBCamera::next_image(std::chrono::milliseconds timeout) {
+  try {
+    return _ptr->GetNextImage(timeout.count());
+  } catch (const Spinnaker::Exception& ex) {
+    if (ex.GetError() == SPINNAKER_ERR_TIMEOUT) {
+      return nullptr;
+    }
+    throw;
+  }
+}
+
+void USBCamera::set_buffer_count(unsigned int count) {
+  INodeMap& nmap = _ptr->GetTLStreamNodeMap();
+  CEnumerationPtr mode = nmap.GetNode("StreamBufferCountMode");
+  CIntegerPtr manual = nmap.GetNode("StreamBufferCountManual");
+  if (!IsWritable(mode) || !IsWritable(manual)) {
+    throw std::runtime_error("Stream buffer count not writable.");
+  }
+  CEnumEntryPtr entry = mode->GetEntryByName("Manual");
+  mode->SetIntValue(entry->GetValue());
+  manual->SetValue(std::min<int64_t>(count, manual->GetMax()));
+}
+
+void USBCamera::register_image_event(ImageEvent& handler) {
+  _ptr->RegisterEvent(handler);
+}
+
+void USBCamera::unregister_image_event(ImageEvent& handler) {
+  _ptr->UnregisterEvent(handler);
+}
+
 void USBCamera::end_acquisition() { _ptr->EndAcquisition(); }
 
 void USBCamera::init() { _ptr->Init(); }
@@ -103,3 +151,118 @@ void USBCamera::set_auto_gain(Spinnaker::GainAutoEnums a) {
 }
 
 void USBCamera::set_gain(double gain) { _ptr->Gain.SetValue(gain); }
+
+void USBCamera::set_pixel_format(Spinnaker::PixelFormatEnums format) {
+  if (!IsWritable(_ptr->PixelFormat)) {
+    throw std::runtime_error("Pixel format not writable.");
+  }
+  _ptr->PixelFormat.SetValue(format);
+}
+
+double USBCamera::get_gain() { return _ptr->Gain.GetValue(); }
+
+double USBCamera::get_exposure() { return _ptr->ExposureTime.GetValue(); }
+
+void USBCamera::save_user_set() {
+  _ptr->UserSetSelector.SetValue(HAPI_USER_SET);
+  _ptr->UserSetSave.Execute();
+  _ptr->UserSetDefault.SetValue(HAPI_USER_SET_DEFAULT);
+}
+
+void USBCamera::load_user_set() {
+  _ptr->UserSetSelector.SetValue(HAPI_USER_SET);
+  _ptr->UserSetLoad.Execute();
+}
+
+void USBCamera::set_trigger_type(TriggerType type) { _type = type; }
+
+USBCamera::link_t USBCamera::link() {
+  link_t link;
+  // DeviceLinkSpeed is in bytes per second like the throughput
+  link._speed = _ptr->DeviceLinkSpeed.GetValue();
+  link._throughput_limit = _ptr->DeviceLinkThroughputLimit.GetValue();
+  link._throughput = _ptr->DeviceLinkCurrentThroughput.GetValue();
+  link._resulting_fps = _ptr->AcquisitionResultingFrameRate.GetValue();
+  return link;
+}
+
+void USBCamera::set_throughput_limit(int64_t bytes_per_s) {
+  if (bytes_per_s == 0) {
+    _ptr->DeviceLinkThroughputLimitMode.SetValue(
+        DeviceLinkThroughputLimitMode_Off);
+    return;
+  }
+  _ptr->DeviceLinkThroughputLimitMode.SetValue(
+      DeviceLinkThroughputLimitMode_On);
+  bytes_per_s = std::max(bytes_per_s, _ptr->DeviceLinkThroughputLimit.GetMin());
+  bytes_per_s = std::min(bytes_per_s, _ptr->DeviceLinkThroughputLimit.GetMax());
+  _ptr->DeviceLinkThroughputLimit.SetValue(bytes_per_s);
+}
+
+std::map<std::string, int64_t> USBCamera::stream_stats() {
+  static const char* const counters[] = {
+      "StreamTotalBufferCount",    "StreamFailedBufferCount",
+      "StreamBufferUnderrunCount", "StreamLostFrameCount",
+      "StreamDroppedFrameCount",   "StreamIncompleteFrameCount"};
+  std::map<std::string, int64_t> stats;
+  INodeMap& nmap = _ptr->GetTLStreamNodeMap();
+  for (const char* name : counters) {
+    CIntegerPtr counter = nmap.GetNode(name);
+    // not every driver version has every counter
+    if (IsAvailable(counter) && IsReadable(counter)) {
+      stats[name] = counter->GetValue();
+    }
+  }
+  return stats;
+}
+
+USBCamera::probe_t USBCamera::probe(std::chrono::milliseconds duration) {
+  using clock = std::chrono::steady_clock;
+  probe_t probe = {0, 0, 0, 0};
+  double bytes = 0;
+  clock::time_point first, last;
+  _ptr->TriggerMode.SetValue(Spinnaker::TriggerModeEnums::TriggerMode_Off);
+  bool acquiring = false;
+  try {
+    begin_acquisition();
+    acquiring = true;
+    clock::time_point end = clock::now() + duration;
+    while (clock::now() < end) {
+      ImagePtr image = next_image(HAPI_PROBE_TIMEOUT);
+      if (image == nullptr) {
+        break;
+      }
+      last = clock::now();
+      // the rate is timed from the first frame, it counts from there
+      if (probe._frames++ == 0) {
+        first = last;
+      } else {
+        bytes += image->GetBufferSize();
+      }
+      if (image->IsIncomplete()) {
+        probe._incomplete++;
+      }
+      image->Release();
+    }
+    acquiring = false;
+    end_acquisition();
+  } catch (...) {
+    // leave the camera stopped and triggered as it was, the first error is
+    // the one reported
+    if (acquiring) {
+      try {
+        end_acquisition();
+      } catch (...) {
+      }
+    }
+    configure_trigger(_type);
+    throw;
+  }
+  configure_trigger(_type);
+  double seconds = std::chrono::duration<double>(last - first).count();
+  if (probe._frames > 1 && seconds > 0) {
+    probe._fps = (probe._frames - 1) / seconds;
+    probe._bytes_per_s = bytes / seconds;
+  }
+  return probe;
+}
@@ -0,0 +1,107 @@
+#ifndef HAPI_OBIS_EMULATOR_H
+#define HAPI_OBIS_EMULATOR_H
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+
+#include "obis.h"
+
+namespace hapi {
+// Answers the OBIS commands obis.cpp sends on the master side of a pseudo
+// terminal, so OBISLaser can open the slave side like a real laser. Replies
+// can be delayed, paced at a baud rate or dropped, and faults can be injected
+// or come from a simple baseplate temperature model.
+class OBISEmulator {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  struct options_t {
+    // time the laser takes to answer each command
+    std::chrono::microseconds _latency;
+    // bits per second of the simulated line, 0 transfers instantly
+    unsigned int _baud;
+    // fault code raised _fault_after seconds after the emulator starts
+    FaultCode _fault;
+    double _fault_after;
+    // probability that a reply is lost
+    double _drop;
+    // degrees per second the baseplate heats up while emitting
+    double _heat;
+    double _ambient;
+    unsigned int _seed;
+  };
+
+  static options_t default_options();
+
+  OBISEmulator(const options_t &options);
+  ~OBISEmulator();
+
+  // the slave side of the pseudo terminal, for OBISLaser to open
+  const std::string &device();
+  // answers commands until stop() is called, from any thread
+  void run();
+  void stop();
+
+  // commands answered and replies dropped so far
+  unsigned long commands();
+  unsigned long dropped();
+
+ private:
+  struct reply_t {
+    clock::time_point _due;
+    std::string _text;
+  };
+
+  options_t _options;
+  int _master{-1};
+  // held open so the master doesn't hang up while no client is connected
+  int _slave{-1};
+  int _stop[2]{-1, -1};
+  std::string _device;
+  std::mt19937 _random;
+
+  std::string _input;
+  std::string _output;
+  std::deque<reply_t> _pending;
+  clock::time_point _last_due;
+  clock::time_point _start;
+  clock::time_point _last_update;
+  unsigned long _commands{0};
+  unsigned long _dropped{0};
+
+  // laser state
+  bool _handshake;
+  bool _prompt;
+  bool _auto_start;
+  bool _indicator;
+  bool _emission;
+  bool _cdrh;
+  bool _temp_probe;
+  bool _blanking;
+  bool _injected;
+  unsigned short _amod_type;
+  OBISLaser::SourceType _mode;
+  double _power_level;
+  double _baseplate_temp;
+  FaultCode _fault;
+  unsigned int _cycles;
+  std::deque<unsigned int> _errors;
+  std::map<unsigned short, std::string> _user;
+
+  void reset();
+  // advances the temperature model and the injected fault to now
+  void update(clock::time_point now);
+  StatusCode status();
+  // answers one command, returns the reply lines or an empty string
+  std::string handle(const std::string &line);
+  void queue(const std::string &reply, std::size_t received,
+             clock::time_point now);
+  // time the line takes to send n bytes, 10 bits each
+  clock::duration transfer(std::size_t n);
+};
+}  // namespace hapi
+
+#endif
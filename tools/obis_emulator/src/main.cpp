@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "argparse.h"
+#include "logger.h"
+#include "obis.h"
+#include "obis_emulator.h"
+
+using namespace hapi;
+
+OBISEmulator* running = nullptr;
+
+void stop_handler(int) {
+  if (running) running->stop();
+}
+
+/**
+ * benchmark
+ *
+ * Connects an OBISLaser to the emulator and times the reads the acquisition
+ * does, runs times each. Reports the mean and worst time of each and how
+ * often the serial stack had to time out and ask again.
+ */
+void benchmark(OBISEmulator& emulator, unsigned int runs,
+               std::chrono::milliseconds timeout, unsigned int retries) {
+  Logger& log = Logger::instance();
+  using clock = std::chrono::steady_clock;
+  struct operation_t {
+    const char* _name;
+    std::function<void(OBISLaser&)> _run;
+  };
+  std::vector<operation_t> operations = {
+      {"status", [](OBISLaser& l) { l.status(); }},
+      {"baseplate_temp", [](OBISLaser& l) { l.baseplate_temp(); }},
+      {"telemetry", [](OBISLaser& l) { l.telemetry(); }},
+      {"sys_info", [](OBISLaser& l) { l.sys_info(true); }},
+      {"state on/off", [](OBISLaser& l) {
+         l.state(OBISLaser::State::On);
+         l.state(OBISLaser::State::Off);
+       }}};
+
+  std::thread thread(&OBISEmulator::run, &emulator);
+  try {
+    OBISLaser laser(emulator.device());
+    laser.set_timeout(timeout);
+    laser.set_retries(retries);
+    log.info() << "Benchmarking " << runs << " runs per operation against "
+               << emulator.device() << "." << std::endl;
+    for (auto const& op : operations) {
+      double sum = 0, worst = 0;
+      unsigned int failed = 0;
+      unsigned long timeouts = laser.timeouts();
+      unsigned long asked = laser.retries();
+      for (unsigned int i = 0; i < runs; i++) {
+        auto start = clock::now();
+        try {
+          op._run(laser);
+        } catch (const std::exception& ex) {
+          failed++;
+        }
+        double ms =
+            std::chrono::duration<double, std::milli>(clock::now() - start)
+                .count();
+        sum += ms;
+        worst = std::max(worst, ms);
+      }
+      // formatted apart so the log stream keeps its flags
+      std::ostringstream line;
+      line << std::left << std::setw(16) << op._name << std::right
+           << std::fixed << std::setprecision(3) << " mean " << std::setw(9)
+           << sum / runs << " ms, max " << std::setw(9) << worst << " ms, "
+           << laser.timeouts() - timeouts << " timeouts, "
+           << laser.retries() - asked << " retries, " << failed << " failed";
+      log.info() << line.str() << std::endl;
+    }
+  } catch (const std::exception& ex) {
+    log.exception(ex) << "Benchmark failed." << std::endl;
+  }
+  emulator.stop();
+  thread.join();
+  log.info() << emulator.commands() << " commands answered, "
+             << emulator.dropped() << " replies dropped." << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  Logger& log = Logger::instance();
+  log.set_stream(std::cout);
+
+  ArgumentParser parser("HAPI OBIS Laser Emulator");
+  parser.add_argument("-l", "--link",
+                      "--link [path] Also makes the pty available at the "
+                      "given path.",
+                      false);
+  parser.add_argument("-L", "--latency",
+                      "--latency [ms] Time the laser takes to answer each "
+                      "command.",
+                      false);
+  parser.add_argument("-b", "--baud",
+                      "--baud [rate] Paces the replies at the given baud "
+                      "rate, 0 sends them instantly (default).",
+                      false);
+  parser.add_argument("-f", "--fault",
+                      "--fault [code] Raises the given fault code, e.g. 0x1.",
+                      false);
+  parser.add_argument("-a", "--after",
+                      "--after [s] Raises the fault this long after starting.",
+                      false);
+  parser.add_argument("-d", "--drop",
+                      "--drop [p] Drops each reply with the given probability.",
+                      false);
+  parser.add_argument("-t", "--heat",
+                      "--heat [C/s] Heats the baseplate while emitting until "
+                      "it faults.",
+                      false);
+  parser.add_argument("-s", "--seed", "--seed [n] Seeds the reply drops.",
+                      false);
+  parser.add_argument("-B", "--bench",
+                      "--bench [runs] Times OBISLaser against the emulator "
+                      "and exits.",
+                      false);
+  parser.add_argument("-T", "--timeout",
+                      "--timeout [ms] Reply timeout OBISLaser uses in the "
+                      "benchmark (default 1000).",
+                      false);
+  try {
+    parser.parse(argc, argv);
+  } catch (const ArgumentParser::ArgumentNotFound& ex) {
+    log.exception(ex) << "Failed to parse command line arguments." << std::endl;
+    log.critical() << "Exiting (-1)..." << std::endl;
+    return -1;
+  }
+  if (parser.is_help()) return 0;
+
+  OBISEmulator::options_t options = OBISEmulator::default_options();
+  if (parser.exists("L")) {
+    options._latency = std::chrono::microseconds(
+        (long long)(parser.get<double>("L") * 1000.0));
+  }
+  if (parser.exists("b")) options._baud = parser.get<unsigned int>("b");
+  if (parser.exists("f")) {
+    options._fault = std::stoul(parser.get<std::string>("f"), nullptr, 0);
+  }
+  if (parser.exists("a")) options._fault_after = parser.get<double>("a");
+  if (parser.exists("d")) options._drop = parser.get<double>("d");
+  if (parser.exists("t")) options._heat = parser.get<double>("t");
+  if (parser.exists("s")) options._seed = parser.get<unsigned int>("s");
+  if (options._drop < 0 || options._drop > 1) {
+    log.critical() << "Drop probability must be in [0, 1]." << std::endl;
+    log.critical() << "Exiting (-1)..." << std::endl;
+    return -1;
+  }
+
+  try {
+    OBISEmulator emulator(options);
+    if (parser.exists("B")) {
+      long long timeout = parser.exists("T") ? parser.get<int>("T") : 1000;
+      benchmark(emulator, std::max(parser.get<int>("B"), 1),
+                std::chrono::milliseconds(timeout), 2);
+      return 0;
+    }
+
+    std::string link = parser.get<std::string>("l");
+    if (!link.empty()) {
+      ::unlink(link.c_str());
+      if (::symlink(emulator.device().c_str(), link.c_str()) < 0) {
+        log.error() << "Could not link " << link << " to "
+                    << emulator.device() << "." << std::endl;
+        link.clear();
+      }
+    }
+    log.info() << "Emulating an OBIS laser on " << emulator.device()
+               << (link.empty() ? "" : " (" + link + ")") << "." << std::endl;
+
+    running = &emulator;
+    std::signal(SIGINT, stop_handler);
+    std::signal(SIGTERM, stop_handler);
+    emulator.run();
+    running = nullptr;
+    if (!link.empty()) ::unlink(link.c_str());
+    log.info() << emulator.commands() << " commands answered, "
+               << emulator.dropped() << " replies dropped." << std::endl;
+  } catch (const std::exception& ex) {
+    log.exception(ex) << "Emulator failed." << std::endl;
+    log.critical() << "Exiting (-1)..." << std::endl;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,445 @@
+#include "obis_emulator.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+using namespace hapi;
+
+// ratings of the emulated laser, an OBIS 488 LX 60 mW
+#define HAPI_EMULATOR_POWER 0.06
+#define HAPI_EMULATOR_CURRENT_MIN 0.03
+#define HAPI_EMULATOR_CURRENT_MAX 0.15
+#define HAPI_EMULATOR_BASE_HIGH 50.0
+#define HAPI_EMULATOR_DIODE_SET 25.0
+// fraction of the difference to ambient the baseplate loses per second
+#define HAPI_EMULATOR_COOLING 0.01
+// degrees below the limit the baseplate must cool to before the fault clears
+#define HAPI_EMULATOR_HYSTERESIS 1.0
+// error records kept before the queue reports an overflow
+#define HAPI_EMULATOR_ERRORS 32
+#define HAPI_EMULATOR_USER_MAX 31
+
+namespace {
+std::string lower(std::string str) {
+  std::transform(str.begin(), str.end(), str.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return str;
+}
+
+std::string trim(const std::string &str) {
+  auto begin = str.find_first_not_of(" \t\r\n");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  auto end = str.find_last_not_of(" \t\r\n");
+  return str.substr(begin, end - begin + 1);
+}
+
+template <typename T>
+std::string to_str(T value) {
+  std::ostringstream os;
+  os << value;
+  return os.str();
+}
+
+const std::map<std::string, std::string> &info() {
+  static const std::map<std::string, std::string> info = {
+      {"*idn?", "Coherent, Inc - OBIS 488nm 60mW - V1.0.1 - Jan 12 2018"},
+      {"syst:inf:mod?", "OBIS 488nm LX 60mW"},
+      {"syst:inf:mdat?", "2018-03-14"},
+      {"syst:inf:cdat?", "2018-03-16"},
+      {"syst:inf:fver?", "V1.0.1"},
+      {"syst:inf:snum?", "EMU0001"},
+      {"syst:inf:pnum?", "1185052"},
+      {"syst:inf:pver?", "V1.0.0"},
+      {"syst:inf:wav?", "488"},
+      {"syst:inf:pow?", to_str(HAPI_EMULATOR_POWER)},
+      {"syst:inf:type?", "DDL"},
+      {"sour:pow:nom?", to_str(HAPI_EMULATOR_POWER)},
+      {"sour:pow:lim:low?", "0"},
+      {"sour:pow:lim:high?", to_str(HAPI_EMULATOR_POWER * 1.1)},
+      {"sour:temp:prot:bas:high?", to_str(HAPI_EMULATOR_BASE_HIGH)},
+      {"sour:temp:prot:bas:low?", "10"},
+      {"sour:temp:prot:diod:high?", "40"},
+      {"sour:temp:prot:diod:low?", "10"},
+      {"sour:temp:prot:int:high?", "60"},
+      {"sour:temp:prot:int:low?", "10"},
+      {"sour:curr:lim:low?", to_str(HAPI_EMULATOR_CURRENT_MIN)},
+      {"sour:curr:lim:high?", to_str(HAPI_EMULATOR_CURRENT_MAX)},
+      {"sour:temp:dset?", to_str(HAPI_EMULATOR_DIODE_SET)},
+      {"syst:lock?", "ON"}};
+  return info;
+}
+}  // namespace
+
+OBISEmulator::options_t OBISEmulator::default_options() {
+  return options_t{std::chrono::microseconds(0), 0, 0, 0, 0, 0, 25.0, 0};
+}
+
+OBISEmulator::OBISEmulator(const options_t &options)
+    : _options(options), _random(options._seed) {
+  _master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (_master < 0 || grantpt(_master) < 0 || unlockpt(_master) < 0) {
+    throw std::runtime_error(std::string("Could not create a pty: ") +
+                             std::strerror(errno));
+  }
+  char name[64];
+  if (ptsname_r(_master, name, sizeof name) != 0) {
+    throw std::runtime_error("Could not get the pty's name.");
+  }
+  _device = name;
+  _slave = ::open(name, O_RDWR | O_NOCTTY);
+  if (_slave < 0) {
+    throw std::runtime_error("Could not open " + _device);
+  }
+  struct termios config;
+  tcgetattr(_slave, &config);
+  cfmakeraw(&config);
+  tcsetattr(_slave, TCSANOW, &config);
+  fcntl(_master, F_SETFL, fcntl(_master, F_GETFL) | O_NONBLOCK);
+  if (pipe(_stop) < 0) {
+    throw std::runtime_error("Could not create the stop pipe.");
+  }
+  _start = _last_update = _last_due = clock::now();
+  _baseplate_temp = _options._ambient;
+  _cycles = 0;
+  _fault = 0;
+  _injected = false;
+  reset();
+}
+
+OBISEmulator::~OBISEmulator() {
+  for (int fd : {_master, _slave, _stop[0], _stop[1]}) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+}
+
+const std::string &OBISEmulator::device() { return _device; }
+
+unsigned long OBISEmulator::commands() { return _commands; }
+
+unsigned long OBISEmulator::dropped() { return _dropped; }
+
+void OBISEmulator::stop() {
+  char c = 0;
+  if (::write(_stop[1], &c, 1) < 0) {
+    throw std::runtime_error("Could not stop the emulator.");
+  }
+}
+
+void OBISEmulator::reset() {
+  _handshake = false;
+  _prompt = false;
+  _auto_start = false;
+  _indicator = true;
+  _emission = false;
+  _cdrh = true;
+  _temp_probe = true;
+  _blanking = false;
+  _amod_type = 1;
+  _mode = OBISLaser::SourceType::ConstantPower;
+  _power_level = 0;
+  _errors.clear();
+}
+
+void OBISEmulator::update(clock::time_point now) {
+  double dt = std::chrono::duration<double>(now - _last_update).count();
+  _last_update = now;
+  if (_emission) {
+    _baseplate_temp += _options._heat * dt;
+  }
+  _baseplate_temp -=
+      (_baseplate_temp - _options._ambient) * HAPI_EMULATOR_COOLING * dt;
+  if (_baseplate_temp > HAPI_EMULATOR_BASE_HIGH) {
+    _fault |= OBISLaser::FaultBits::BasePlateTempFault;
+  } else if (_baseplate_temp <
+             HAPI_EMULATOR_BASE_HIGH - HAPI_EMULATOR_HYSTERESIS) {
+    _fault &= ~static_cast<FaultCode>(OBISLaser::FaultBits::BasePlateTempFault);
+  }
+  if (_options._fault && !_injected &&
+      std::chrono::duration<double>(now - _start).count() >=
+          _options._fault_after) {
+    _fault |= _options._fault;
+    _injected = true;
+  }
+}
+
+StatusCode OBISEmulator::status() {
+  StatusCode s = OBISLaser::StatusBits::LaserWarmUp;
+  if (_fault) {
+    s |= OBISLaser::StatusBits::LaserFault;
+  }
+  if (_emission) {
+    s |= OBISLaser::StatusBits::LaserEmission;
+    if (!_fault) {
+      s |= OBISLaser::StatusBits::LaserReady;
+    }
+  } else {
+    s |= OBISLaser::StatusBits::LaserStandby;
+  }
+  if (!_errors.empty()) {
+    s |= OBISLaser::StatusBits::LaserError;
+  }
+  if (_mode != OBISLaser::SourceType::ConstantPower &&
+      _mode != OBISLaser::SourceType::ConstantCurrent) {
+    s |= OBISLaser::StatusBits::ExternalOperatingMode;
+  }
+  return s;
+}
+
+std::string OBISEmulator::handle(const std::string &line) {
+  std::string cmd = trim(line);
+  if (cmd.empty()) {
+    return "";
+  }
+  auto space = cmd.find_first_of(" \t");
+  std::string header = lower(cmd.substr(0, space));
+  std::string args = space == std::string::npos ? "" : trim(cmd.substr(space));
+  bool is_query = header.back() == '?';
+
+  auto ok = [&](const std::string &value) {
+    std::string r = is_query ? value + "\r\n" : "";
+    return _handshake ? r + "OK\r\n" : r;
+  };
+  // queries always get an answer, commands only when handshaking
+  auto err = [&](unsigned int code) {
+    if (_errors.size() < HAPI_EMULATOR_ERRORS) {
+      _errors.push_back(code);
+    } else {
+      _errors.back() = 350;
+    }
+    return is_query || _handshake ? "ERR-" + std::to_string(code) + "\r\n"
+                                  : std::string();
+  };
+  auto state_str = [](bool s) { return std::string(s ? "ON" : "OFF"); };
+  // parses an on/off argument, returns 0 or the error code
+  auto state_arg = [&](bool &s) -> unsigned int {
+    std::string a = lower(args);
+    if (a.empty()) return 109;
+    if (a == "on" || a == "1") {
+      s = true;
+    } else if (a == "off" || a == "0") {
+      s = false;
+    } else {
+      return 220;
+    }
+    return 0;
+  };
+
+  std::map<std::string, bool *> states = {{"syst:comm:hand", &_handshake},
+                                          {"syst:comm:prom", &_prompt},
+                                          {"syst:aut", &_auto_start},
+                                          {"syst:ind:las", &_indicator},
+                                          {"syst:cdrh", &_cdrh},
+                                          {"sour:temp:apr", &_temp_probe},
+                                          {"sour:am:blank", &_blanking}};
+  std::string node = is_query ? header.substr(0, header.size() - 1) : header;
+  auto s = states.find(node);
+  if (s != states.end()) {
+    if (is_query) {
+      return ok(state_str(*s->second));
+    }
+    bool value;
+    unsigned int e = state_arg(value);
+    if (e) return err(e);
+    // the handshake setting applies to its own reply
+    *s->second = value;
+    return ok("");
+  }
+  auto i = info().find(header);
+  if (i != info().end()) {
+    return ok(i->second);
+  }
+
+  double hours = std::chrono::duration<double>(clock::now() - _start).count() /
+                 3600.0;
+  bool emitting = _emission && !_fault;
+  double power = emitting ? _power_level : 0;
+  if (header == "*rst") {
+    reset();
+    return ok("");
+  } else if (header == "*tst?" || header == "syst:faul?") {
+    return ok(std::to_string(_fault));
+  } else if (header == "syst:stat?") {
+    return ok(std::to_string(status()));
+  } else if (header == "syst:err:coun?") {
+    return ok(std::to_string(_errors.size()));
+  } else if (header == "syst:err:cle") {
+    _errors.clear();
+    return ok("");
+  } else if (header == "syst:inf:amod:type?") {
+    return ok(std::to_string(_amod_type));
+  } else if (header == "syst:inf:amod:type") {
+    if (args.empty()) return err(109);
+    _amod_type = std::strtoul(args.c_str(), nullptr, 10);
+    return ok("");
+  } else if (header == "syst:inf:user?") {
+    return ok(_user[std::strtoul(args.c_str(), nullptr, 10)]);
+  } else if (header == "syst:inf:user") {
+    auto comma = args.find(',');
+    if (comma == std::string::npos) return err(109);
+    std::string data = trim(args.substr(comma + 1));
+    if (data.size() > HAPI_EMULATOR_USER_MAX) return err(220);
+    _user[std::strtoul(args.c_str(), nullptr, 10)] = data;
+    return ok("");
+  } else if (header == "syst:cycl?") {
+    return ok(std::to_string(_cycles));
+  } else if (header == "syst:hour?" || header == "syst:diod:hour?") {
+    return ok(std::to_string((unsigned int)hours));
+  } else if (header == "sour:am:stat?") {
+    return ok(state_str(_emission));
+  } else if (header == "sour:am:stat") {
+    bool value;
+    unsigned int e = state_arg(value);
+    if (e) return err(e);
+    if (value && !_emission) {
+      _cycles++;
+    }
+    _emission = value;
+    return ok("");
+  } else if (header == "sour:am:sour?") {
+    static const char *names[] = {"CWP",   "CWC",   "DIGITAL", "ANALOG",
+                                  "MIXED", "DIGSO", "MIXSO"};
+    return ok(names[_mode]);
+  } else if (header == "sour:am:int" || header == "sour:am:ext") {
+    static const std::map<std::string, OBISLaser::SourceType> internal = {
+        {"cwp", OBISLaser::SourceType::ConstantPower},
+        {"cwc", OBISLaser::SourceType::ConstantCurrent}};
+    static const std::map<std::string, OBISLaser::SourceType> external = {
+        {"dig", OBISLaser::SourceType::Digital},
+        {"analog", OBISLaser::SourceType::Analog},
+        {"mixed", OBISLaser::SourceType::Mixed},
+        {"digso", OBISLaser::SourceType::DIGSO},
+        {"mixso", OBISLaser::SourceType::MIXSO}};
+    auto &modes = header == "sour:am:int" ? internal : external;
+    if (args.empty()) return err(109);
+    auto m = modes.find(lower(args));
+    if (m == modes.end()) return err(220);
+    _mode = m->second;
+    return ok("");
+  } else if (header == "sour:pow:lev:imm:ampl") {
+    if (args.empty()) return err(109);
+    char *end;
+    double value = std::strtod(args.c_str(), &end);
+    if (*end != '\0' || value < 0 || value > HAPI_EMULATOR_POWER * 1.1) {
+      return err(220);
+    }
+    _power_level = value;
+    return ok("");
+  } else if (header == "sour:pow:lev:ampl?" ||
+             header == "sour:pow:lev:imm:ampl?") {
+    return ok(to_str(_power_level));
+  } else if (header == "sour:pow:lev?") {
+    return ok(to_str(power));
+  } else if (header == "sour:pow:curr?") {
+    double current = emitting ? HAPI_EMULATOR_CURRENT_MIN +
+                                    (HAPI_EMULATOR_CURRENT_MAX -
+                                     HAPI_EMULATOR_CURRENT_MIN) *
+                                        power / HAPI_EMULATOR_POWER
+                              : 0;
+    return ok(to_str(current));
+  } else if (header == "sour:temp:bas?") {
+    return ok(to_str(_baseplate_temp));
+  } else if (header == "sour:temp:diod?") {
+    return ok(to_str(HAPI_EMULATOR_DIODE_SET));
+  } else if (header == "sour:temp:int?") {
+    return ok(to_str(_baseplate_temp + 5.0));
+  } else if (header == "sour:pow:cal" || header == "sour:pow:unc") {
+    return ok("");
+  }
+  return err(100);
+}
+
+OBISEmulator::clock::duration OBISEmulator::transfer(std::size_t n) {
+  if (_options._baud == 0) {
+    return clock::duration::zero();
+  }
+  return std::chrono::duration_cast<clock::duration>(
+      std::chrono::duration<double>(n * 10.0 / _options._baud));
+}
+
+void OBISEmulator::queue(const std::string &reply, std::size_t received,
+                         clock::time_point now) {
+  // the laser answers one command at a time, after the whole command has
+  // come in over the line
+  clock::time_point start = std::max(now + transfer(received), _last_due);
+  _last_due = start + _options._latency + transfer(reply.size());
+  if (reply.empty()) {
+    return;
+  }
+  if (std::bernoulli_distribution(_options._drop)(_random)) {
+    _dropped++;
+    return;
+  }
+  _pending.push_back(reply_t{_last_due, reply});
+}
+
+void OBISEmulator::run() {
+  char buffer[256];
+  while (true) {
+    auto now = clock::now();
+    while (!_pending.empty() && _pending.front()._due <= now) {
+      _output += _pending.front()._text;
+      _pending.pop_front();
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = _master;
+    fds[0].events = POLLIN | (_output.empty() ? 0 : POLLOUT);
+    fds[1].fd = _stop[0];
+    fds[1].events = POLLIN;
+    struct timespec wait;
+    struct timespec *timeout = nullptr;
+    if (!_pending.empty()) {
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    _pending.front()._due - now)
+                    .count();
+      wait.tv_sec = ns / 1000000000;
+      wait.tv_nsec = ns % 1000000000;
+      timeout = &wait;
+    }
+    if (ppoll(fds, 2, timeout, nullptr) < 0) {
+      if (errno == EINTR) continue;
+      throw std::runtime_error(std::string("Emulator poll failed: ") +
+                               std::strerror(errno));
+    }
+    if (fds[1].revents) {
+      return;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      ssize_t n = ::read(_master, buffer, sizeof buffer);
+      if (n > 0) {
+        _input.append(buffer, n);
+        now = clock::now();
+        update(now);
+        std::size_t end;
+        while ((end = _input.find('\n')) != std::string::npos) {
+          std::string line = _input.substr(0, end + 1);
+          _input.erase(0, end + 1);
+          if (trim(line).empty()) continue;
+          _commands++;
+          queue(handle(line), line.size(), now);
+        }
+      }
+    }
+    if ((fds[0].revents & POLLOUT) && !_output.empty()) {
+      ssize_t n = ::write(_master, _output.data(), _output.size());
+      if (n > 0) {
+        _output.erase(0, n);
+      }
+    }
+  }
+}
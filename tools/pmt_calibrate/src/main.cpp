@@ -1,17 +1,112 @@
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
 
 #include "argparse.h"
 #include "board.h"
 #include "config.h"
 #include "logger.h"
+#include "obis.h"
+#include "pmt_map.h"
 #include "routines/get_config.h"
 #include "routines/os_utils.h"
 #include "routines/pmt_calibrate.h"
+#include "simulated_board.h"
 
 using namespace hapi;
 
+/**
+ * ideal_threshold
+ *
+ * The largest threshold whose modelled rate at the given gain is at most the
+ * target rate, -1 if there is none.
+ */
+int ideal_threshold(const SimulatedBoard& board, int gain, double rate) {
+  for (int t = 0xFF; t >= 0; t--) {
+    if (board.rate(gain, t) <= rate) return t;
+  }
+  return -1;
+}
+
+/**
+ * benchmark
+ *
+ * Runs every calibration strategy against simulated boards with seeds
+ * 0..runs-1 and reports how long each took on the board's clock and how far
+ * from the target rate it ended up. The warm strategies calibrate once to
+ * fill the noise map and time a second calibration on a fresh board.
+ */
+void benchmark(unsigned int runs, double target_rate, double confidence,
+               long long binary_ms, long long rate_ms) {
+  Logger& log = Logger::instance();
+  struct strategy_t {
+    const char* _name;
+    bool _rate;
+    bool _warm;
+  };
+  std::vector<strategy_t> strategies = {{"binary", false, false},
+                                        {"binary warm", false, true},
+                                        {"rate", true, false},
+                                        {"rate warm", true, true}};
+  SimulatedBoard::model_t model = SimulatedBoard::default_model();
+  auto calibrate = [&](const strategy_t& s, PMTMap& map, PMTBoard& board) {
+    if (s._rate) {
+      return pmt_calibrate_rate(target_rate, confidence, rate_ms, map, board);
+    }
+    return pmt_calibrate(binary_ms, confidence, map, board);
+  };
+
+  // only the results are of interest, not every probe
+  std::ostream null(nullptr);
+  log.info() << "Benchmarking " << runs << " seeded runs per strategy at a "
+             << "target rate of " << target_rate << " Hz." << std::endl;
+  for (auto const& s : strategies) {
+    double time_sum = 0, time_max = 0, probes = 0, error_sum = 0;
+    double rate_sum = 0;
+    unsigned int over = 0, failed = 0;
+    log.set_streams(null, null, null, null, std::cout);
+    for (unsigned int seed = 0; seed < runs; seed++) {
+      PMTMap map;
+      SimulatedBoard board(model, seed);
+      try {
+        if (s._warm) {
+          SimulatedBoard first(model, seed + runs);
+          calibrate(s, map, first);
+        }
+        pmt_calibration_t cal = calibrate(s, map, board);
+        std::chrono::duration<double> t = cal._duration;
+        double rate = board.rate(cal._gain, cal._threshold);
+        time_sum += t.count();
+        time_max = std::max(time_max, t.count());
+        probes += cal._probes;
+        error_sum += std::abs((int)cal._threshold -
+                              ideal_threshold(board, cal._gain, target_rate));
+        rate_sum += rate;
+        if (rate > target_rate) over++;
+      } catch (const PMTCalibrationError& ex) {
+        failed++;
+      }
+    }
+    log.set_stream(std::cout);
+    unsigned int n = runs - failed;
+    if (n == 0) {
+      log.warning() << s._name << ": every run failed." << std::endl;
+      continue;
+    }
+    log.info() << s._name << ": time mean " << time_sum / n << " s max "
+               << time_max << " s, probes " << probes / n
+               << ", threshold error " << error_sum / n << ", rate "
+               << rate_sum / n << " Hz, over target " << over << "/" << n
+               << ", failed " << failed << std::endl;
+  }
+}
+
 int main(int argc, char* argv[]) {
   Logger& log = Logger::instance();
   log.set_stream(std::cout);
@@ -23,6 +118,28 @@ int main(int argc, char* argv[]) {
   parser.add_argument(
       "-i", "--interval",
       "The time interval in milliseconds that it should check in.", false);
+  parser.add_argument("-r", "--rate",
+                      "--rate [Hz] Uses rate based calibration aiming for the "
+                      "given false trigger rate.",
+                      false);
+  parser.add_argument("-p", "--confidence",
+                      "Confidence level of the calibration (default 0.95).",
+                      false);
+  parser.add_argument("-l", "--laser",
+                      "--laser [device] Reads the laser temperature from the "
+                      "given device to check the saved noise map against.",
+                      false);
+  parser.add_argument("-f", "--fresh",
+                      "Ignores the saved noise map and searches from scratch.",
+                      false);
+  parser.add_argument("-s", "--simulate",
+                      "--simulate [seed] Calibrates a simulated board instead "
+                      "of the real one.",
+                      false);
+  parser.add_argument("-b", "--benchmark",
+                      "--benchmark [runs] Compares the calibration strategies "
+                      "on simulated boards.",
+                      false);
   try {
     parser.parse(argc, argv);
   } catch (const ArgumentParser::ArgumentNotFound& ex) {
@@ -33,13 +150,77 @@ int main(int argc, char* argv[]) {
   if (parser.is_help()) return 0;
 
   auto write = parser.get<bool>("w");
-  long long ms = 5000;
+  bool rate = parser.exists("r");
+  long long ms = rate ? 1000 : 5000;
   if (parser.exists("i")) ms = parser.get<int>("i");
+  double target_rate = parser.exists("b") ? 0.1 : 0;
+  if (rate) std::istringstream(parser.get<std::string>("r")) >> target_rate;
+  double confidence = 0.95;
+  if (parser.exists("p")) {
+    std::istringstream(parser.get<std::string>("p")) >> confidence;
+  }
+  if ((rate && target_rate <= 0) || confidence < 0.5 || confidence >= 1) {
+    log.critical() << "Rate must be positive and confidence in [0.5, 1)."
+                   << std::endl;
+    log.critical() << "Exiting (-1)..." << std::endl;
+    return -1;
+  }
 
-  std::pair<unsigned int, unsigned int> vals;
+  if (parser.exists("b")) {
+    unsigned int runs = parser.get<int>("b");
+    long long binary_ms = parser.exists("i") ? ms : 5000;
+    long long rate_ms = parser.exists("i") ? ms : 1000;
+    benchmark(std::max(runs, 1u), target_rate, confidence, binary_ms, rate_ms);
+    return 0;
+  }
+
+  std::unique_ptr<SimulatedBoard> simulated;
+  if (parser.exists("s")) {
+    simulated.reset(new SimulatedBoard(SimulatedBoard::default_model(),
+                                       parser.get<int>("s")));
+    log.info() << "Calibrating a simulated board." << std::endl;
+  }
+  PMTBoard& board =
+      simulated ? static_cast<PMTBoard&>(*simulated) : Board::instance();
+
+  PMTMap map;
+  if (!parser.get<bool>("f") && !simulated) {
+    map.load("/etc/hapi/pmt.map");
+  }
+  if (parser.exists("l") && !simulated) {
+    try {
+      OBISLaser laser(parser.get<std::string>("l"));
+      map.set_temperature(laser.baseplate_temp());
+      log.info() << "Laser baseplate temperature: " << map.temperature()
+                 << " C" << std::endl;
+    } catch (const std::exception& ex) {
+      log.exception(ex) << "Failed to read the laser temperature."
+                        << std::endl;
+    }
+  }
+
+  unsigned int gain, threshold;
   try {
     log.info() << "Calibrating..." << std::endl;
-    vals = pmt_calibrate(ms);
+    if (rate) {
+      pmt_calibration_t cal =
+          pmt_calibrate_rate(target_rate, confidence, ms, map, board);
+      gain = cal._gain;
+      threshold = cal._threshold;
+      log.info() << "Predicted false trigger rate: " << cal._rate
+                 << " Hz (upper bound " << cal._rate_upper << " Hz)"
+                 << std::endl;
+      log.info() << "Probes: " << cal._probes << std::endl;
+      log.info() << "Calibration time: " << cal._duration.count() << " ms"
+                 << std::endl;
+    } else {
+      pmt_calibration_t cal = pmt_calibrate(ms, confidence, map, board);
+      gain = cal._gain;
+      threshold = cal._threshold;
+      log.info() << "Probes: " << cal._probes << std::endl;
+      log.info() << "Calibration time: " << cal._duration.count() << " ms"
+                 << std::endl;
+    }
   } catch (const PMTCalibrationError& ex) {
     log.critical()
         << "Could not find values for the gain and threshold that worked."
@@ -47,14 +228,23 @@ int main(int argc, char* argv[]) {
     log.critical() << "Exiting (-1)..." << std::endl;
     return -1;
   }
-  auto gain = vals.first;
-  auto threshold = vals.second;
+
+  if (!simulated && is_root()) {
+    log.info() << "Saving PMT noise map to /etc/hapi/pmt.map" << std::endl;
+    map.save("/etc/hapi/pmt.map");
+  }
 
   log.info() << "Calibration success!" << std::endl;
   log.info() << std::hex << "Gain:      0x" << std::setw(2) << std::setfill('0')
              << gain << std::endl;
   log.info() << std::hex << "Threshold: 0x" << std::setw(2) << std::setfill('0')
-             << threshold << std::endl;
+             << threshold << std::dec << std::endl;
+
+  if (simulated) {
+    log.info() << "Modelled false trigger rate: "
+               << simulated->rate(gain, threshold) << " Hz" << std::endl;
+    return 0;
+  }
 
   if (write) {
     if (!is_root()) {
@@ -0,0 +1,73 @@
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "pack12.h"
+
+using namespace hapi;
+
+/**
+ * unpack
+ *
+ * Turns a .p12 image saved by hapi into a 16 bit pgm next to it, with the
+ * 12 bits in the high bits so viewers show the full range.
+ */
+void unpack(const std::string &fname) {
+  std::ifstream in(fname, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Failed to open " + fname + ".");
+  }
+  std::string magic;
+  std::size_t width = 0, height = 0;
+  unsigned int max = 0;
+  in >> magic >> width >> height >> max;
+  // a single newline separates the header from the pixels
+  in.get();
+  if (!in || magic != "P12" || width % 2 != 0) {
+    throw std::runtime_error(fname + " is not a 12 bit hapi image.");
+  }
+  std::size_t row = packed12_size(width);
+  std::vector<uint8_t> packed(row * height);
+  in.read((char *)packed.data(), packed.size());
+  if (!in) {
+    throw std::runtime_error(fname + " is truncated.");
+  }
+
+  std::vector<uint16_t> pixels(width * height);
+  unpack12(packed.data(), pixels.data(), pixels.size());
+  // pgm samples are big endian
+  std::vector<uint8_t> samples(pixels.size() * 2);
+  for (std::size_t i = 0; i < pixels.size(); i++) {
+    samples[2 * i] = pixels[i] >> 8;
+    samples[2 * i + 1] = pixels[i] & 0xff;
+  }
+
+  std::string out_name = fname.substr(0, fname.rfind('.')) + ".pgm";
+  std::ofstream out(out_name, std::ios::binary);
+  out << "P5\n" << width << " " << height << "\n65535\n";
+  out.write((const char *)samples.data(), samples.size());
+  if (!out) {
+    throw std::runtime_error("Failed to write " + out_name + ".");
+  }
+  std::cout << fname << " -> " << out_name << std::endl;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: hapi-unpack12 IMAGE.p12..." << std::endl;
+    return 1;
+  }
+  int rc = 0;
+  for (int i = 1; i < argc; i++) {
+    try {
+      unpack(argv[i]);
+    } catch (const std::exception &ex) {
+      std::cerr << ex.what() << std::endl;
+      rc = 1;
+    }
+  }
+  return rc;
+}